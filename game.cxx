@@ -1,7 +1,35 @@
 #include <iostream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <new>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#define HAVE_SOCKETS 1
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS has SO_NOSIGPIPE instead
+#endif
+#endif
 
 using std::endl;
 using std::cerr;
@@ -21,8 +49,17 @@ class RenderManager;
 class GameObject;
 
 void        SetUpGame(int, RenderManager &, GameObject, std::vector<GameObject>);
+const char *GetShaderPrelude();
 const char *GetVertexShader();
 const char *GetFragmentShader();
+const char *GetFXAAVertexShader();
+const char *GetFXAAFragmentShader();
+const char *GetDebrisUpdateShader();
+const char *GetDebrisVertexShader();
+const char *GetDebrisFragmentShader();
+const char *GetImpostorVertexShader();
+const char *GetImpostorFragmentShader();
+const char *GetCullComputeShader();
 
 class Triangle
 {
@@ -276,6 +313,125 @@ void GetCubeData(std::vector<float>& coords, std::vector<float>& normals) {
 }
 
 
+//
+// Startup timeline
+//
+// Records when each startup step finished, relative to when the timeline
+// was created, so that time-to-first-frame can be tracked. Steps may be
+// marked from worker threads.
+//
+class StartupTimeline
+{
+  public:
+         StartupTimeline();
+    void Mark(const char *step);
+    void Mark(const char *step, std::chrono::steady_clock::time_point when);
+    void Print();
+
+  private:
+    struct Entry
+    {
+        const char *step;
+        double      ms;
+    };
+
+    std::chrono::steady_clock::time_point start;
+    std::vector<Entry>                    entries;
+    std::mutex                            lock;
+};
+
+StartupTimeline::StartupTimeline()
+{
+    start = std::chrono::steady_clock::now();
+}
+
+void StartupTimeline::Mark(const char *step)
+{
+    Mark(step, std::chrono::steady_clock::now());
+}
+
+void StartupTimeline::Mark(const char *step, std::chrono::steady_clock::time_point when)
+{
+    std::chrono::duration<double, std::milli> d = when - start;
+    std::lock_guard<std::mutex> guard(lock);
+    Entry e = {step, d.count()};
+    entries.push_back(e);
+}
+
+void StartupTimeline::Print()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<Entry> sorted = entries;
+    for (int i = 1; i < sorted.size(); i++) // insertion sort, keeps ties in order
+        for (int j = i; j > 0 && sorted[j].ms < sorted[j-1].ms; j--)
+            std::swap(sorted[j], sorted[j-1]);
+    fprintf(stderr, "Startup timeline:\n");
+    for (int i = 0; i < sorted.size(); i++)
+        fprintf(stderr, "  %8.2f ms  %s\n", sorted[i].ms, sorted[i].step);
+}
+
+//
+// Generates the vertex data for every shape on worker threads, so it can
+// overlap window creation and shader compilation. The GL upload happens
+// on the main thread once Wait() returns.
+//
+struct MeshData
+{
+    std::vector<float> coords;
+    std::vector<float> normals;
+};
+
+class MeshBuilder
+{
+  public:
+    enum { numMeshes = 3 }; // in RenderManager::ShapeType order
+
+              MeshBuilder(StartupTimeline *timeline);
+    void      Start();
+    void      Wait();
+    MeshData &Get(int shape) { return meshes[shape]; };
+
+  private:
+    StartupTimeline *timeline;
+    MeshData         meshes[numMeshes];
+    std::thread      workers[numMeshes];
+
+    void Build(int shape);
+};
+
+MeshBuilder::MeshBuilder(StartupTimeline *t)
+{
+    timeline = t;
+}
+
+void MeshBuilder::Start()
+{
+    for (int i = 0; i < numMeshes; i++)
+        workers[i] = std::thread(&MeshBuilder::Build, this, i);
+}
+
+void MeshBuilder::Wait()
+{
+    for (int i = 0; i < numMeshes; i++)
+        if (workers[i].joinable())
+            workers[i].join();
+}
+
+void MeshBuilder::Build(int shape)
+{
+    static const char *names[numMeshes] = {"sphere mesh generated", "cylinder mesh generated",
+                                           "cube mesh generated"};
+    MeshData &m = meshes[shape];
+    if (shape == 0)
+        GetSphereData(m.coords, m.normals);
+    else if (shape == 1)
+        GetCylinderData(m.coords, m.normals);
+    else
+        GetCubeData(m.coords, m.normals);
+    if (timeline)
+        timeline->Mark(names[shape]);
+}
+
 //
 //
 // PART 2: RenderManager module
@@ -290,7 +446,187 @@ void _print_shader_info_log(GLuint shader_index) {
   printf("shader info log for GL index %u:\n%s\n", shader_index, shader_log);
 }
 
-class RenderManager
+//
+// Crash debris
+//
+// Each crash throws a burst of debrisPerBurst particles, which fly out,
+// fall, bounce on the road and fade over debrisLifetime seconds. Bursts
+// reuse debrisBursts fixed ranges of the particle buffers round robin.
+// A particle's starting state is a hash of its index and the burst seed,
+// so spawning needs no per-particle data from the CPU.
+//
+const int   debrisBursts    = 4;
+const int   debrisPerBurst  = 25600;           // a multiple of 4
+const int   debrisParticles = debrisBursts * debrisPerBurst;
+const float debrisLifetime  = 2.5f;            // seconds
+const float debrisGravity   = 9.8f;
+const float debrisBounce    = 0.4f;            // vertical speed kept when hitting the road
+const float debrisFriction  = 0.7f;            // horizontal speed kept when hitting the road
+
+// The same integer hash as the update shader, mapped to [0, 1)
+static inline float DebrisRandom(uint32_t x)
+{
+  x ^= x >> 16; x *= 0x7feb352dU;
+  x ^= x >> 15; x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+//
+// The CPU fallback: the same simulation on structure-of-arrays data,
+// four particles at a time with SSE where available. Unlike the GPU path
+// its results have to be uploaded every frame.
+//
+class DebrisSimulator
+{
+  public:
+         DebrisSimulator();
+    void Spawn(int burst, glm::vec3 origin, uint32_t seed);
+    void Update(int burst, float dt);
+    void Pack(int burst, float *out); // interleaved posAge, velocity/size as the GPU buffers
+
+  private:
+    std::vector<float> px, py, pz, age, vx, vy, vz, size;
+};
+
+DebrisSimulator::DebrisSimulator()
+  : px(debrisParticles), py(debrisParticles), pz(debrisParticles), age(debrisParticles, debrisLifetime),
+    vx(debrisParticles), vy(debrisParticles), vz(debrisParticles), size(debrisParticles)
+{
+}
+
+void DebrisSimulator::Spawn(int burst, glm::vec3 origin, uint32_t seed)
+{
+  for (int i = burst * debrisPerBurst; i < (burst + 1) * debrisPerBurst; i++) {
+    uint32_t id = (uint32_t) i * 4u + seed;
+    float angle = DebrisRandom(id) * 6.2831853f;
+    float up = DebrisRandom(id + 1);
+    float speed = 2.0f + 10.0f * DebrisRandom(id + 2);
+    float horizontal = sqrtf(1.0f - up * up);
+    vx[i] = cosf(angle) * horizontal * speed;
+    vy[i] = up * speed;
+    vz[i] = sinf(angle) * horizontal * speed;
+    px[i] = origin[0] + vx[i] * 0.03f;
+    py[i] = origin[1] + vy[i] * 0.03f;
+    pz[i] = origin[2] + vz[i] * 0.03f;
+    age[i] = 0.0f;
+    size[i] = 0.5f + 0.5f * DebrisRandom(id + 3);
+  }
+}
+
+void DebrisSimulator::Update(int burst, float dt)
+{
+  int first = burst * debrisPerBurst;
+  int last = first + debrisPerBurst;
+#ifdef HAVE_SSE2
+  __m128 vdt = _mm_set1_ps(dt);
+  __m128 fall = _mm_set1_ps(debrisGravity * dt);
+  __m128 zero = _mm_setzero_ps();
+  __m128 bounce = _mm_set1_ps(-debrisBounce);
+  __m128 friction = _mm_set1_ps(debrisFriction);
+  for (int i = first; i < last; i += 4) {
+    __m128 x = _mm_loadu_ps(&px[i]), y = _mm_loadu_ps(&py[i]), z = _mm_loadu_ps(&pz[i]);
+    __m128 dx = _mm_loadu_ps(&vx[i]), dy = _mm_loadu_ps(&vy[i]), dz = _mm_loadu_ps(&vz[i]);
+    dy = _mm_sub_ps(dy, fall);
+    x = _mm_add_ps(x, _mm_mul_ps(dx, vdt));
+    y = _mm_add_ps(y, _mm_mul_ps(dy, vdt));
+    z = _mm_add_ps(z, _mm_mul_ps(dz, vdt));
+    // bounce the lanes that went below the road
+    __m128 hit = _mm_cmplt_ps(y, zero);
+    y = _mm_max_ps(y, zero);
+    dy = _mm_or_ps(_mm_and_ps(hit, _mm_mul_ps(dy, bounce)), _mm_andnot_ps(hit, dy));
+    __m128 keep = _mm_or_ps(_mm_and_ps(hit, friction), _mm_andnot_ps(hit, _mm_set1_ps(1.0f)));
+    dx = _mm_mul_ps(dx, keep);
+    dz = _mm_mul_ps(dz, keep);
+    _mm_storeu_ps(&px[i], x); _mm_storeu_ps(&py[i], y); _mm_storeu_ps(&pz[i], z);
+    _mm_storeu_ps(&vx[i], dx); _mm_storeu_ps(&vy[i], dy); _mm_storeu_ps(&vz[i], dz);
+    _mm_storeu_ps(&age[i], _mm_add_ps(_mm_loadu_ps(&age[i]), vdt));
+  }
+#else
+  for (int i = first; i < last; i++) {
+    vy[i] -= debrisGravity * dt;
+    px[i] += vx[i] * dt;
+    py[i] += vy[i] * dt;
+    pz[i] += vz[i] * dt;
+    if (py[i] < 0.0f) {
+      py[i] = 0.0f;
+      vy[i] *= -debrisBounce;
+      vx[i] *= debrisFriction;
+      vz[i] *= debrisFriction;
+    }
+    age[i] += dt;
+  }
+#endif
+}
+
+void DebrisSimulator::Pack(int burst, float *out)
+{
+  int first = burst * debrisPerBurst;
+  int last = first + debrisPerBurst;
+#ifdef HAVE_SSE2
+  for (int i = first; i < last; i += 4, out += 32) {
+    __m128 a = _mm_loadu_ps(&px[i]), b = _mm_loadu_ps(&py[i]);
+    __m128 c = _mm_loadu_ps(&pz[i]), d = _mm_loadu_ps(&age[i]);
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    __m128 e = _mm_loadu_ps(&vx[i]), f = _mm_loadu_ps(&vy[i]);
+    __m128 g = _mm_loadu_ps(&vz[i]), h = _mm_loadu_ps(&size[i]);
+    _MM_TRANSPOSE4_PS(e, f, g, h);
+    _mm_storeu_ps(out, a);      _mm_storeu_ps(out + 4, e);
+    _mm_storeu_ps(out + 8, b);  _mm_storeu_ps(out + 12, f);
+    _mm_storeu_ps(out + 16, c); _mm_storeu_ps(out + 20, g);
+    _mm_storeu_ps(out + 24, d); _mm_storeu_ps(out + 28, h);
+  }
+#else
+  for (int i = first; i < last; i++, out += 8) {
+    out[0] = px[i]; out[1] = py[i]; out[2] = pz[i]; out[3] = age[i];
+    out[4] = vx[i]; out[5] = vy[i]; out[6] = vz[i]; out[7] = size[i];
+  }
+#endif
+}
+
+//
+// What the GL was asked to do during one frame. Indices are counted per
+// shape (in RenderManager::ShapeType order); bytes are everything passed
+// to glBufferSubData and glUniform*.
+//
+const int numShapeTypes = 3;
+
+struct RenderStats
+{
+    unsigned int drawCalls;
+    unsigned int draws[numShapeTypes];    // mesh draws, all views
+    unsigned int indices[numShapeTypes];  // indices submitted, all views
+    unsigned int points;                  // debris points drawn
+    unsigned int vaoBinds;
+    unsigned int programBinds;
+    unsigned int stateChanges;            // viewport, buffer range and mask changes
+    unsigned int uniformUploads;
+    unsigned int bytesUploaded;
+
+    void Clear() { memset(this, 0, sizeof(*this)); };
+    void Add(const RenderStats &o, int sign = 1);
+};
+
+void RenderStats::Add(const RenderStats &o, int sign)
+{
+    drawCalls += sign * o.drawCalls;
+    for (int i = 0; i < numShapeTypes; i++) {
+        draws[i] += sign * o.draws[i];
+        indices[i] += sign * o.indices[i];
+    }
+    points += sign * o.points;
+    vaoBinds += sign * o.vaoBinds;
+    programBinds += sign * o.programBinds;
+    stateChanges += sign * o.stateChanges;
+    uniformUploads += sign * o.uniformUploads;
+    bytesUploaded += sign * o.bytesUploaded;
+}
+
+//
+// What the scene code draws through. RenderManager is the GL backend;
+// SoftwareRasterizer draws the same frames on the CPU.
+//
+class Renderer
 {
   public:
    enum ShapeType
@@ -300,12 +636,103 @@ class RenderManager
       CUBE
    };
 
-                 RenderManager();
+   virtual           ~Renderer() {};
+   virtual void      SetView(int i, glm::vec3 &c, glm::vec3 &, glm::vec3 &) = 0;
+   virtual void      SetViewCount(int n) = 0;
+   virtual int       GetViewCount() = 0;
+   virtual glm::mat4 GetViewProjection(int i = 0) = 0;
+   virtual void      SetColor(double r, double g, double b) = 0;
+   virtual void      Render(ShapeType, glm::mat4 model) = 0;
+   virtual void      BeginFrame() = 0;
+   virtual void      EndFrame() = 0;
+   // bounding volumes and occlusion queries, see OcclusionCuller
+   virtual void      RenderProxy(ShapeType, glm::mat4 model) = 0;
+   virtual int       PollOcclusionQuery(int id) = 0;
+   virtual bool      BeginOcclusionQuery(int id) = 0;
+   virtual void      EndOcclusionQuery() = 0;
+   virtual void      ResetOcclusionQuery(int id) = 0;
+};
+
+class RenderManager : public Renderer
+{
+  public:
+   enum AntiAliasing
+   {
+      AA_NONE,
+      AA_FXAA,   // post-process on the offscreen target
+      AA_MSAA4   // 4x multisampled window
+   };
+
+   enum DebrisMode
+   {
+      DEBRIS_OFF,
+      DEBRIS_GPU,   // transform feedback, the state never leaves the GPU
+      DEBRIS_CPU    // simulated on the CPU and uploaded every frame
+   };
+
+   // What the shaders light with. The variant compiled for it leaves out
+   // the terms whose coefficient is 0, see LightingVariant.
+   struct Lighting
+   {
+      glm::vec3 dir;
+      glm::vec4 coeff;        // Ka, Kd, Ks, specular exponent
+      bool      perFragment;  // evaluate per pixel instead of per vertex
+   };
+
+   // Shader variant bits, each a #define in the program's source
+   enum ShaderVariant
+   {
+      VARIANT_AMBIENT      = 1 << 0,
+      VARIANT_DIFFUSE      = 1 << 1,
+      VARIANT_SPECULAR     = 1 << 2,
+      VARIANT_PER_FRAGMENT = 1 << 3,
+      VARIANT_INSTANCED    = 1 << 4,  // model and color per instance, for RenderIndirect
+      VARIANT_IMPOSTOR     = 1 << 5   // ray-cast sphere quads, for DrawImpostors
+   };
+
+                 RenderManager(StartupTimeline *timeline = NULL, AntiAliasing aa = AA_NONE);
+                ~RenderManager();
    void          SetView(glm::vec3 &c, glm::vec3 &, glm::vec3 &);
-   void          SetUpGeometry();
+   void          SetView(int i, glm::vec3 &c, glm::vec3 &, glm::vec3 &);
+   void          SetViewCount(int n);
+   int           GetViewCount() { return numViews; };
+   void          SetUpGeometry(MeshBuilder &);
    void          SetColor(double r, double g, double b);
    void          Render(ShapeType, glm::mat4 model);
+   void          BeginFrame();
+   void          EndFrame();
+   void          SetDynamicResolution(double budgetMs);
+   void          SetDebrisMode(DebrisMode mode);
+   void          SpawnDebris(glm::vec3 position, glm::vec3 color);
+   void          UpdateDebris(float dt);  // between BeginFrame and EndFrame
+   bool          DebrisActive();
+   void          PrintDebrisCost();
+   void          SetDebrisOffset(glm::vec3 offset) { debrisOffset = offset; };
+   void          SetSphereImpostors(bool on);
+   void          SetLighting(const Lighting &);
+   void          PrintShaderVariants();
+   // GPU-driven drawing, see GPUCuller
+   bool          SupportsGPUCulling() { return GLEW_VERSION_4_3; };
+   bool          SetUpIndirect(GLuint instanceBuffer);
+   void          RenderIndirect(GLuint commandBuffer);
+   int           GetIndexCount(ShapeType);
+   glm::vec4     GetMeshBounds(ShapeType st) { return meshBounds[st]; };
+   void          DispatchCompute(GLuint program, GLuint groups, GLbitfield barriers);
+   void          RenderProxy(ShapeType, glm::mat4 model);
+   int           PollOcclusionQuery(int id);
+   bool          BeginOcclusionQuery(int id);
+   void          EndOcclusionQuery();
+   void          ResetOcclusionQuery(int id);
+   glm::mat4     GetViewProjection(int i = 0) { return views[i].projection * views[i].view; };
+   float         GetResolutionScale() { return resolutionScale; };
+   double        GetGPUFrameTime() { return gpuFrameTime; };
+   double        GetGPUBusyTime() { return gpuBusyTime; };
    GLFWwindow   *GetWindow() { return window; };
+   void          PrintAntiAliasingCost();
+   unsigned int  GetDrawCalls() { return lastStats.drawCalls; };
+   const RenderStats &GetFrameStats() { return lastStats; };  // the last finished frame
+   int           GetAverageStats(RenderStats &total);         // returns the frames in total
+   void          PrintRenderStats();
 
   private:
    glm::vec3 color;
@@ -315,57 +742,301 @@ class RenderManager
    GLuint cylinderNumPrimitives;
    GLuint cubeVAO;
    GLuint cubeNumPrimitives;
-   GLuint mvploc;
+   glm::vec4 meshBounds[numShapeTypes]; // bounding sphere of each mesh, center and radius
+   GLuint instancedProgram;             // reads model and color per instance, for RenderIndirect
+   GLuint modelloc;
    GLuint colorloc;
-   GLuint camloc;
-   GLuint ldirloc;
-   glm::mat4 projection;
-   glm::mat4 view;
    GLuint shaderProgram;
+   GLuint vertexShader;
+   GLuint fragmentShader;
    GLFWwindow *window;
-
-   void SetUpWindowAndShaders();
-   void MakeModelView(glm::mat4 &);
+   StartupTimeline *timeline;
+
+   // every program built so far, by variant bits; a lighting change only
+   // compiles the variants it hasn't seen
+   std::vector<std::pair<unsigned int, GLuint> > programCache;
+   Lighting     lighting;
+   unsigned int lightingVariant;
+
+   // Counters for the frame being drawn, the last finished one, and a
+   // rolling sum over the last statsWindow frames
+   static const int statsWindow = 60;
+   RenderStats stats;
+   RenderStats lastStats;
+   RenderStats statsHistory[statsWindow];
+   RenderStats statsTotal;
+   int         statsFrames;       // frames ended so far
+
+   // Split screen: the window is divided into up to four views. Draw
+   // commands are recorded once per frame and replayed into every view's
+   // viewport; between views only the bound range of the view uniform
+   // block (view-projection matrix and camera position) changes.
+   static const int maxViews = 4;
+   struct ViewState
+   {
+      glm::mat4 projection;
+      glm::mat4 view;
+      glm::vec3 camera;
+   };
+   enum CommandType
+   {
+      CMD_DRAW,
+      CMD_PROXY,         // bounding volume, no color or depth writes
+      CMD_BEGIN_QUERY,   // occlusion queries only run in the first view
+      CMD_END_QUERY,
+      CMD_INDIRECT       // one multi-draw per shape from a GPU-written command buffer
+   };
+   struct DrawCommand
+   {
+      CommandType type;
+      ShapeType   shape;
+      int         query;
+      GLuint      indirect;  // CMD_INDIRECT command buffer
+      glm::vec3   color;
+      glm::mat4   model;
+   };
+   int       numViews;
+   ViewState views[maxViews];
+   GLuint    viewUBO;
+   int       viewUBOStride;  // bytes between views, honouring the offset alignment
+   std::vector<DrawCommand> drawList;
+
+   // Dynamic resolution: the scene is drawn into the lower-left
+   // renderWidth x renderHeight corner of an offscreen target as large as
+   // the window, then stretched over the window. The scale is picked to
+   // keep the GPU frame time, measured with timer queries, under budget.
+   static const int   numTimerQueries = 4;  // results are read a few frames late to avoid stalls
+   static const float minResolutionScale;
+
+   int    fbWidth, fbHeight;         // window framebuffer size in pixels
+   int    renderWidth, renderHeight; // size actually rendered this frame
+   bool   dynamicResolution;
+   double gpuBudget;                 // seconds
+   float  resolutionScale;
+   int    scaleCooldown;             // frames until the scale may change again
+   GLuint sceneFBO;
+   GLuint sceneColorTex;
+   GLuint sceneDepthRB;
+   GLuint timerQueries[numTimerQueries];
+   bool   timerPending[numTimerQueries];
+   int    timerSlot;                 // query used by the current frame
+   // copies of the GPU-written indirect commands, one per timer query: a
+   // frame's copy is read once its timer result is in, so it never stalls
+   GLuint indirectReadback[numTimerQueries];
+   int    indirectViews[numTimerQueries]; // views the copied commands were drawn in, 0 = none
+   double gpuFrameTime;              // smoothed, in seconds
+   double gpuBusyTime;               // sum of all measured frames, in seconds
+
+   // occlusion queries, indexed by caller-chosen ids
+   std::vector<GLuint> occlusionQueries;
+   std::vector<bool>   occlusionPending;
+   std::vector<bool>   occlusionDiscard;  // pending result predates a reset
+   std::vector<int>    occlusionResults;  // 1 visible, 0 hidden, -1 unknown
+
+   // FXAA: the offscreen target is drawn into the window by a full-screen
+   // pass that blends along the luma edges, instead of being blitted
+   AntiAliasing antiAliasing;
+   GLuint fxaaProgram;
+   GLuint fxaaVAO;                    // empty, the pass generates its vertices
+   GLint  fxaaTexelLoc;
+   GLint  fxaaUVScaleLoc;
+   GLint  fxaaUVMaxLoc;
+
+   // Crash debris: two buffers of debrisParticles x (posAge, velocity/size)
+   // that transform feedback ping-pongs between, per burst range. The
+   // draw pass reads whichever buffer holds a burst's latest state.
+   struct DebrisBurst
+   {
+      glm::vec3 origin;
+      glm::vec3 color;
+      uint32_t  seed;
+      float     age;       // seconds since the spawn
+      bool      spawn;     // initialise on the next update
+      int       current;   // buffer with the latest state
+   };
+   DebrisMode  debrisMode;
+   DebrisBurst bursts[debrisBursts];
+   int         nextBurst;
+   GLuint      debrisBuffers[2];
+   GLuint      debrisVAOs[2];
+   GLuint      debrisUpdateProgram;
+   GLuint      debrisDrawProgram;
+   GLint       debrisOriginLoc, debrisSpawnLoc, debrisSeedLoc, debrisDtLoc;
+   GLint       debrisColorLoc, debrisPointScaleLoc, debrisOffsetLoc;
+   glm::vec3   debrisOffset;           // debris moves with the players, see ViewScroll
+   DebrisSimulator   *debrisCPU;
+   std::vector<float> debrisStaging;   // one packed burst, CPU path only
+   double      debrisCPUSeconds;       // spent in UpdateDebris
+   int         debrisFrames;
+
+   // Sphere impostors: every SPHERE draw becomes one camera-facing quad
+   // that ray-casts the ellipsoid, drawn after the rest of each view
+   bool        sphereImpostors;
+   GLuint      impostorProgram;
+   GLuint      impostorVAO;            // no buffers, corners come from gl_VertexID
+   GLint       impostorModelLoc, impostorColorLoc;
+
+   void SetUpWindow();
+   void SetUpFXAA();
+   void DrawFXAA();
+   bool SetUpDebris();
+   void DrawDebris();
+   bool SetUpImpostors();
+   void DrawImpostors();
+   GLuint GetProgram(unsigned int variant);
+   void   SetUpProgram(GLuint program);
+   bool Offscreen() { return dynamicResolution || antiAliasing == AA_FXAA; };
+   void StartShaders();
+   void FinishShaders();
+   void ViewRect(int i, int &x, int &y, int &w, int &h);
+   void UpdateProjections();
+   void ReplayDrawList();
+   void Execute(const DrawCommand &, bool firstView);
+   void ResizeTargets();
+   void CollectTimerQueries();
+   void UpdateResolutionScale(double gpuSeconds);
 };
 
-RenderManager::RenderManager()
+const float RenderManager::minResolutionScale = 0.35f;
+
+// The cheapest variant that lights like l: terms with a 0 coefficient are left out
+unsigned int LightingVariant(const RenderManager::Lighting &l)
+{
+  unsigned int variant = 0;
+  if (l.coeff[0] != 0.0f)
+    variant |= RenderManager::VARIANT_AMBIENT;
+  if (l.coeff[1] != 0.0f)
+    variant |= RenderManager::VARIANT_DIFFUSE;
+  if (l.coeff[2] != 0.0f)
+    variant |= RenderManager::VARIANT_SPECULAR;
+  if (l.perFragment)
+    variant |= RenderManager::VARIANT_PER_FRAGMENT;
+  return variant;
+}
+
+// A shader body with the version, the variant's #defines and the shared declarations in front
+std::string VariantSource(unsigned int variant, const char *body)
+{
+  static const char *names[] = {"AMBIENT", "DIFFUSE", "SPECULAR", "PER_FRAGMENT", "INSTANCED", "IMPOSTOR"};
+  std::string source = "#version 400\n";
+  for (int i = 0; i < 6; i++) {
+    if (variant & (1u << i))
+      source += std::string("#define ") + names[i] + "\n";
+  }
+  return source + GetShaderPrelude() + body;
+}
+
+RenderManager::RenderManager(StartupTimeline *t, AntiAliasing aa)
 {
-  SetUpWindowAndShaders();
-  SetUpGeometry();
-  projection = glm::perspective(
-        glm::radians(45.0f), (float)1000 / (float)1000,  5.0f, 110.0f);
+  timeline = t;
+  antiAliasing = aa;
+  instancedProgram = 0;
+  lighting.dir = glm::normalize(glm::vec3(0, 6, -10));
+  lighting.coeff = glm::vec4(0.3, 0.7, 0, 50.5);
+  lighting.perFragment = false;
+  lightingVariant = LightingVariant(lighting);
+  stats.Clear();
+  lastStats.Clear();
+  statsTotal.Clear();
+  statsFrames = 0;
+  debrisMode = DEBRIS_OFF;
+  debrisCPU = NULL;
+  debrisUpdateProgram = 0;
+  nextBurst = 0;
+  debrisOffset = glm::vec3(0.0f);
+  debrisCPUSeconds = 0.0;
+  debrisFrames = 0;
+  sphereImpostors = false;
+  impostorVAO = 0;
+  for (int i = 0; i < debrisBursts; i++) {
+    bursts[i].age = debrisLifetime;
+    bursts[i].spawn = false;
+    bursts[i].current = 0;
+  }
+
+  // generate the meshes on worker threads while the window is created and
+  // the shaders compile; the driver may compile in the background too, so
+  // their status is only checked after the geometry is uploaded
+  MeshBuilder meshes(timeline);
+  meshes.Start();
+  SetUpWindow();
+  if (timeline)
+    timeline->Mark("window and context created");
+  StartShaders();
+  meshes.Wait();
+  SetUpGeometry(meshes);
+  if (timeline)
+    timeline->Mark("geometry uploaded");
+  FinishShaders();
+  if (antiAliasing == AA_FXAA)
+    SetUpFXAA();
+  if (timeline)
+    timeline->Mark("shaders compiled and linked");
+
+  dynamicResolution = false;
+  gpuBudget = 0.0;
+  resolutionScale = 1.0f;
+  scaleCooldown = 0;
+  gpuFrameTime = 0.0;
+  gpuBusyTime = 0.0;
+  sceneFBO = 0;
+  sceneColorTex = 0;
+  sceneDepthRB = 0;
+  glGenQueries(numTimerQueries, timerQueries);
+  for (int i = 0; i < numTimerQueries; i++) {
+    timerPending[i] = false;
+    indirectReadback[i] = 0;
+    indirectViews[i] = 0;
+  }
+  timerSlot = 0;
+  numViews = 1;
+  glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+  ResizeTargets();
 
-  // Get a handle for our MVP and color uniforms
-  mvploc = glGetUniformLocation(shaderProgram, "MVP");
+  // Get a handle for our model and color uniforms, bind the view block and set the lighting
+  modelloc = glGetUniformLocation(shaderProgram, "model");
   colorloc = glGetUniformLocation(shaderProgram, "color");
-  camloc = glGetUniformLocation(shaderProgram, "cameraloc");
-  ldirloc = glGetUniformLocation(shaderProgram, "lightdir");
+  SetUpProgram(shaderProgram);
+  programCache.push_back(std::make_pair(lightingVariant, shaderProgram));
+
+  GLint alignment = 256;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+  const int viewBlockSize = sizeof(glm::mat4) + sizeof(glm::vec4); // std140
+  viewUBOStride = (viewBlockSize + alignment - 1) / alignment * alignment;
+  glGenBuffers(1, &viewUBO);
+  glBindBuffer(GL_UNIFORM_BUFFER, viewUBO);
+  glBufferData(GL_UNIFORM_BUFFER, maxViews * viewUBOStride, NULL, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
 
-  glm::vec4 lightcoeff(0.3, 0.7, 0, 50.5); // Lighting coeff, Ka, Kd, Ks, alpha
-  GLuint lcoeloc = glGetUniformLocation(shaderProgram, "lightcoeff");
-  glUniform4fv(lcoeloc, 1, &lightcoeff[0]);
+// the GL objects go with the context
+RenderManager::~RenderManager()
+{
+  delete debrisCPU;
 }
 
 void
 RenderManager::SetView(glm::vec3 &camera, glm::vec3 &origin, glm::vec3 &up)
+{
+   SetView(0, camera, origin, up);
+}
+
+void
+RenderManager::SetView(int i, glm::vec3 &camera, glm::vec3 &origin, glm::vec3 &up)
 { 
    glm::mat4 v = glm::lookAt(
                        camera, // Camera in world space
                        origin, // looks at the origin
                        up      // and the head is up
                  );
-   view = v; 
-   glUniform3fv(camloc, 1, &camera[0]);
-   // Direction of light
-   // glm::vec3 lightdir = glm::normalize(camera - origin);   
-
-   glm::vec3 newLight(0, 6, -10);
-   glm::vec3 lightdir = glm::normalize(newLight);   
-   glUniform3fv(ldirloc, 1, &lightdir[0]);
+   if (i < 0 || i >= maxViews)
+      return;
+   views[i].view = v; 
+   views[i].camera = camera;
 };
 
 void
-RenderManager::SetUpWindowAndShaders()
+RenderManager::SetUpWindow()
 {
   // start GL context and O/S window using the GLFW helper library
   if (!glfwInit()) {
@@ -373,12 +1044,19 @@ RenderManager::SetUpWindowAndShaders()
     exit(EXIT_FAILURE);
   }
 
+  // 4.3 for the GPU culling compute pass where available, 4.0 is enough otherwise
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
   glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
   glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  if (antiAliasing == AA_MSAA4)
+    glfwWindowHint(GLFW_SAMPLES, 4);
 
   window = glfwCreateWindow(700, 700, "Game", NULL, NULL);
+  if (!window) {
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+    window = glfwCreateWindow(700, 700, "Game", NULL, NULL);
+  }
   if (!window) {
     fprintf(stderr, "ERROR: could not open window with GLFW3\n");
     glfwTerminate();
@@ -398,13 +1076,41 @@ RenderManager::SetUpWindowAndShaders()
   // tell GL to only draw onto a pixel if the shape is closer to the viewer
   glEnable(GL_DEPTH_TEST); // enable depth-testing
   glDepthFunc(GL_LESS); // depth-testing interprets a smaller value as "closer"
+  if (antiAliasing == AA_MSAA4)
+    glEnable(GL_MULTISAMPLE);
+}
 
-  const char* vertex_shader = GetVertexShader();
-  const char* fragment_shader = GetFragmentShader();
+// Issues the shader compile and link without waiting for the results
+void
+RenderManager::StartShaders()
+{
+  if (GLEW_ARB_parallel_shader_compile)
+    glMaxShaderCompilerThreadsARB(0xFFFFFFFF); // as many as the driver likes
 
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vs, 1, &vertex_shader, NULL);
-  glCompileShader(vs);
+  std::string vertexSource = VariantSource(lightingVariant, GetVertexShader());
+  std::string fragmentSource = VariantSource(lightingVariant, GetFragmentShader());
+  const char* vertex_shader = vertexSource.c_str();
+  const char* fragment_shader = fragmentSource.c_str();
+
+  vertexShader = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(vertexShader, 1, &vertex_shader, NULL);
+  glCompileShader(vertexShader);
+
+  fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fragmentShader, 1, &fragment_shader, NULL);
+  glCompileShader(fragmentShader);
+
+  shaderProgram = glCreateProgram();
+  glAttachShader(shaderProgram, fragmentShader);
+  glAttachShader(shaderProgram, vertexShader);
+  glLinkProgram(shaderProgram);
+}
+
+void
+RenderManager::FinishShaders()
+{
+  GLuint vs = vertexShader;
+  GLuint fs = fragmentShader;
   int params = -1;
   glGetShaderiv(vs, GL_COMPILE_STATUS, &params);
   if (GL_TRUE != params) {
@@ -413,9 +1119,6 @@ RenderManager::SetUpWindowAndShaders()
     exit(EXIT_FAILURE);
   }
 
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fs, 1, &fragment_shader, NULL);
-  glCompileShader(fs);
   glGetShaderiv(fs, GL_COMPILE_STATUS, &params);
   if (GL_TRUE != params) {
     fprintf(stderr, "ERROR: GL shader index %i did not compile\n", fs);
@@ -423,101 +1126,1020 @@ RenderManager::SetUpWindowAndShaders()
     exit(EXIT_FAILURE);
   }
 
-  shaderProgram = glCreateProgram();
-  glAttachShader(shaderProgram, fs);
-  glAttachShader(shaderProgram, vs);
-  glLinkProgram(shaderProgram);
   glUseProgram(shaderProgram);
 }
 
-void RenderManager::SetColor(double r, double g, double b)
+// Called whenever the window framebuffer changes size (and once at startup)
+void RenderManager::ResizeTargets()
 {
-   color[0] = r;
-   color[1] = g;
-   color[2] = b;
+  if (fbWidth <= 0 || fbHeight <= 0)
+    return; // minimized, keep the old targets around
+
+  UpdateProjections();
+
+  if (!Offscreen())
+    return;
+
+  if (sceneFBO == 0) {
+    glGenFramebuffers(1, &sceneFBO);
+    glGenTextures(1, &sceneColorTex);
+    glGenRenderbuffers(1, &sceneDepthRB);
+  }
+  glBindTexture(GL_TEXTURE_2D, sceneColorTex);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, fbWidth, fbHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindRenderbuffer(GL_RENDERBUFFER, sceneDepthRB);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, fbWidth, fbHeight);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColorTex, 0);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, sceneDepthRB);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "ERROR: offscreen render target is incomplete, disabling dynamic resolution and FXAA\n");
+    dynamicResolution = false;
+    resolutionScale = 1.0f;
+    if (antiAliasing == AA_FXAA)
+      antiAliasing = AA_NONE;
+  }
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-void RenderManager::MakeModelView(glm::mat4 &model)
+//
+// budgetMs is the GPU time allowed per frame; 0 turns dynamic resolution
+// off and renders straight into the window.
+//
+void RenderManager::SetDynamicResolution(double budgetMs)
 {
-   glm::mat4 modelview = projection * view * model;
-   glUniformMatrix4fv(mvploc, 1, GL_FALSE, &modelview[0][0]);
+  if (antiAliasing == AA_MSAA4 && budgetMs > 0.0) {
+    // the offscreen target is single-sampled and can't be blitted into a
+    // multisampled window
+    fprintf(stderr, "Dynamic resolution is not supported with 4x MSAA, ignoring --dynamic-res\n");
+    budgetMs = 0.0;
+  }
+  dynamicResolution = budgetMs > 0.0;
+  gpuBudget = budgetMs / 1000.0;
+  resolutionScale = 1.0f;
+  ResizeTargets();
 }
 
-void RenderManager::Render(ShapeType st, glm::mat4 model)
+//
+// Debris needs the buffers and the draw program in either mode; the
+// transform feedback update program is only built for the GPU mode.
+// Returns false when a shader fails to build.
+//
+bool RenderManager::SetUpDebris()
 {
-   int numPrimitives = 0;
-   if (st == SPHERE)
-   {
-      glBindVertexArray(sphereVAO);
-      numPrimitives = sphereNumPrimitives;
-   }
-   else if (st == CYLINDER)
-   {
-      glBindVertexArray(cylinderVAO);
-      numPrimitives = cylinderNumPrimitives;
-   }
-   else if (st == CUBE)
-   {
-      glBindVertexArray(cubeVAO);
-      numPrimitives = cubeNumPrimitives;
-   }
-   MakeModelView(model);
-   glUniform3fv(colorloc, 1, &color[0]);
-   glDrawElements(GL_TRIANGLES, numPrimitives, GL_UNSIGNED_INT, NULL);
+  const char *vertex_shader = GetDebrisVertexShader();
+  const char *fragment_shader = GetDebrisFragmentShader();
+  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(vs, 1, &vertex_shader, NULL);
+  glCompileShader(vs);
+  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fs, 1, &fragment_shader, NULL);
+  glCompileShader(fs);
+  GLuint shaders[3] = {vs, fs, 0};
+  int numShaders = 2;
+  if (debrisMode == DEBRIS_GPU) {
+    const char *update_shader = GetDebrisUpdateShader();
+    shaders[numShaders] = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(shaders[numShaders], 1, &update_shader, NULL);
+    glCompileShader(shaders[numShaders]);
+    numShaders++;
+  }
+
+  for (int i = 0; i < numShaders; i++) {
+    int ok = -1;
+    glGetShaderiv(shaders[i], GL_COMPILE_STATUS, &ok);
+    if (ok != GL_TRUE) {
+      fprintf(stderr, "ERROR: debris shader did not compile, disabling debris\n");
+      _print_shader_info_log(shaders[i]);
+      return false;
+    }
+  }
+
+  // the update pass only runs the vertex stage, capturing its outputs
+  if (debrisMode == DEBRIS_GPU) {
+    debrisUpdateProgram = glCreateProgram();
+    glAttachShader(debrisUpdateProgram, shaders[2]);
+    const char *varyings[2] = {"outPosAge", "outVelocity"};
+    glTransformFeedbackVaryings(debrisUpdateProgram, 2, varyings, GL_INTERLEAVED_ATTRIBS);
+    glLinkProgram(debrisUpdateProgram);
+    debrisOriginLoc = glGetUniformLocation(debrisUpdateProgram, "origin");
+    debrisSpawnLoc = glGetUniformLocation(debrisUpdateProgram, "spawn");
+    debrisSeedLoc = glGetUniformLocation(debrisUpdateProgram, "seed");
+    debrisDtLoc = glGetUniformLocation(debrisUpdateProgram, "dt");
+  }
+
+  debrisDrawProgram = glCreateProgram();
+  glAttachShader(debrisDrawProgram, fs);
+  glAttachShader(debrisDrawProgram, vs);
+  glLinkProgram(debrisDrawProgram);
+  glUniformBlockBinding(debrisDrawProgram, glGetUniformBlockIndex(debrisDrawProgram, "View"), 0);
+  debrisColorLoc = glGetUniformLocation(debrisDrawProgram, "color");
+  debrisPointScaleLoc = glGetUniformLocation(debrisDrawProgram, "pointScale");
+  debrisOffsetLoc = glGetUniformLocation(debrisDrawProgram, "offset");
+  glUseProgram(debrisDrawProgram);
+  glUniform1f(glGetUniformLocation(debrisDrawProgram, "lifetime"), debrisLifetime);
+  glUseProgram(shaderProgram);
+
+  // dead particles everywhere until the first spawn
+  std::vector<float> initial(debrisParticles * 8, 0.0f);
+  for (int i = 0; i < debrisParticles; i++)
+    initial[i * 8 + 3] = debrisLifetime;
+  int numBuffers = debrisMode == DEBRIS_GPU ? 2 : 1; // the CPU path only uploads into one
+  glGenBuffers(numBuffers, debrisBuffers);
+  glGenVertexArrays(numBuffers, debrisVAOs);
+  for (int b = 0; b < numBuffers; b++) {
+    glBindVertexArray(debrisVAOs[b]);
+    glBindBuffer(GL_ARRAY_BUFFER, debrisBuffers[b]);
+    glBufferData(GL_ARRAY_BUFFER, initial.size() * sizeof(float), &initial[0],
+                 debrisMode == DEBRIS_CPU ? GL_STREAM_DRAW : GL_DYNAMIC_COPY);
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), NULL);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *) (4 * sizeof(float)));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+  }
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glEnable(GL_PROGRAM_POINT_SIZE);
+  return true;
 }
 
-void SetUpVBOs(std::vector<float> &coords, std::vector<float> &normals,
-               GLuint &points_vbo, GLuint &normals_vbo, GLuint &index_vbo)
+void RenderManager::SetDebrisMode(DebrisMode mode)
 {
-  int numIndices = coords.size()/3;
-  std::vector<GLuint> indices(numIndices);
-  for(int i = 0; i < numIndices; i++)
-    indices[i] = i;
-
-  points_vbo = 0;
-  glGenBuffers(1, &points_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, points_vbo);
-  glBufferData(GL_ARRAY_BUFFER, coords.size() * sizeof(float), coords.data(), GL_STATIC_DRAW);
+  debrisMode = mode;
+  if (debrisMode == DEBRIS_OFF)
+    return;
+  if (!SetUpDebris()) {
+    debrisMode = DEBRIS_OFF;
+    return;
+  }
+  if (debrisMode == DEBRIS_CPU && debrisCPU == NULL) {
+    debrisCPU = new DebrisSimulator();
+    debrisStaging.resize(debrisPerBurst * 8);
+  }
+}
 
-  normals_vbo = 0;
-  glGenBuffers(1, &normals_vbo);
-  glBindBuffer(GL_ARRAY_BUFFER, normals_vbo);
-  glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float), normals.data(), GL_STATIC_DRAW);
+// impostors are always lit per pixel
+bool RenderManager::SetUpImpostors()
+{
+  impostorProgram = GetProgram((lightingVariant & ~VARIANT_PER_FRAGMENT) | VARIANT_IMPOSTOR);
+  if (impostorProgram == 0) {
+    fprintf(stderr, "Drawing sphere meshes instead of impostors\n");
+    return false;
+  }
+  impostorModelLoc = glGetUniformLocation(impostorProgram, "model");
+  impostorColorLoc = glGetUniformLocation(impostorProgram, "color");
+  if (impostorVAO == 0)
+    glGenVertexArrays(1, &impostorVAO);
+  return true;
+}
 
-  index_vbo = 0;    // Index buffer object
-  glGenBuffers(1, &index_vbo);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_vbo);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+void RenderManager::SetSphereImpostors(bool on)
+{
+  sphereImpostors = on && SetUpImpostors();
 }
 
-void RenderManager::SetUpGeometry()
+//
+// Switches every program in use to the variant for l, compiling the ones
+// not in the cache yet
+//
+void RenderManager::SetLighting(const Lighting &l)
 {
-  std::vector<float> sphereCoords;
-  std::vector<float> sphereNormals;
-  GetSphereData(sphereCoords, sphereNormals);
-  sphereNumPrimitives = sphereCoords.size() / 3;
-  GLuint sphere_points_vbo, sphere_normals_vbo, sphere_indices_vbo;
-  SetUpVBOs(sphereCoords, sphereNormals, 
-            sphere_points_vbo, sphere_normals_vbo, sphere_indices_vbo);
+  lighting = l;
+  lightingVariant = LightingVariant(l);
+  GLuint program = GetProgram(lightingVariant);
+  if (program != 0) {
+    shaderProgram = program;
+    modelloc = glGetUniformLocation(shaderProgram, "model");
+    colorloc = glGetUniformLocation(shaderProgram, "color");
+  }
+  if (instancedProgram != 0) {
+    program = GetProgram(lightingVariant | VARIANT_INSTANCED);
+    if (program != 0)
+      instancedProgram = program;
+  }
+  if (sphereImpostors)
+    sphereImpostors = SetUpImpostors();
+  // cached programs may have been built for other coefficients
+  SetUpProgram(shaderProgram);
+  if (instancedProgram != 0)
+    SetUpProgram(instancedProgram);
+  if (sphereImpostors)
+    SetUpProgram(impostorProgram);
+  glUseProgram(shaderProgram);
+}
 
-  std::vector<float> cylCoords;
-  std::vector<float> cylNormals;
-  GetCylinderData(cylCoords, cylNormals);
-  cylinderNumPrimitives = cylCoords.size() / 3;
-  GLuint cyl_points_vbo, cyl_normals_vbo, cyl_indices_vbo;
-  SetUpVBOs(cylCoords, cylNormals, 
-            cyl_points_vbo, cyl_normals_vbo, cyl_indices_vbo);
+// Returns the program for the variant bits, building it on first use; 0 if it doesn't build
+GLuint RenderManager::GetProgram(unsigned int variant)
+{
+  for (int i = 0; i < programCache.size(); i++) {
+    if (programCache[i].first == variant)
+      return programCache[i].second;
+  }
 
-  std::vector<float> cubeCoords;
-  std::vector<float> cubeNormals;
-  GetCubeData(cubeCoords, cubeNormals);
-  cubeNumPrimitives = cylCoords.size() / 3;
-  GLuint cube_points_vbo, cube_normals_vbo, cube_indices_vbo;
-  SetUpVBOs(cubeCoords, cubeNormals, 
-            cube_points_vbo, cube_normals_vbo, cube_indices_vbo);
+  bool impostor = (variant & VARIANT_IMPOSTOR) != 0;
+  std::string vertexSource = VariantSource(variant, impostor ? GetImpostorVertexShader() : GetVertexShader());
+  std::string fragmentSource = VariantSource(variant, impostor ? GetImpostorFragmentShader() : GetFragmentShader());
+  const char *vertex_shader = vertexSource.c_str();
+  const char *fragment_shader = fragmentSource.c_str();
+  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(vs, 1, &vertex_shader, NULL);
+  glCompileShader(vs);
+  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fs, 1, &fragment_shader, NULL);
+  glCompileShader(fs);
 
-  GLuint vao[3];
-  glGenVertexArrays(3, vao);
+  int vsOk = -1, fsOk = -1;
+  glGetShaderiv(vs, GL_COMPILE_STATUS, &vsOk);
+  glGetShaderiv(fs, GL_COMPILE_STATUS, &fsOk);
+  if (vsOk != GL_TRUE || fsOk != GL_TRUE) {
+    fprintf(stderr, "ERROR: shader variant 0x%x did not compile\n", variant);
+    _print_shader_info_log(vsOk != GL_TRUE ? vs : fs);
+    return 0;
+  }
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, fs);
+  glAttachShader(program, vs);
+  glLinkProgram(program);
+  SetUpProgram(program);
+  glUseProgram(shaderProgram);
+  programCache.push_back(std::make_pair(variant, program));
+  return program;
+}
+
+// Binds the view block and sets the lighting; leaves the program in use
+void RenderManager::SetUpProgram(GLuint program)
+{
+  glUseProgram(program);
+  glUniformBlockBinding(program, glGetUniformBlockIndex(program, "View"), 0);
+  glUniform3fv(glGetUniformLocation(program, "lightdir"), 1, &lighting.dir[0]);
+  glUniform4fv(glGetUniformLocation(program, "lightcoeff"), 1, &lighting.coeff[0]);
+  stats.programBinds++;
+  stats.uniformUploads += 2;
+  stats.bytesUploaded += sizeof(lighting.dir) + sizeof(lighting.coeff);
+}
+
+void RenderManager::PrintShaderVariants()
+{
+  fprintf(stderr, "Shader variants: lighting %s%s%s%s, %d programs built\n",
+          lightingVariant & VARIANT_AMBIENT ? "ambient " : "",
+          lightingVariant & VARIANT_DIFFUSE ? "diffuse " : "",
+          lightingVariant & VARIANT_SPECULAR ? "specular " : "",
+          lightingVariant & VARIANT_PER_FRAGMENT ? "per fragment" : "per vertex",
+          (int) programCache.size());
+}
+
+// Starts a burst at position, replacing the oldest one
+void RenderManager::SpawnDebris(glm::vec3 position, glm::vec3 color)
+{
+  if (debrisMode == DEBRIS_OFF)
+    return;
+  DebrisBurst &b = bursts[nextBurst];
+  b.origin = position;
+  b.color = color;
+  b.seed = 0x9e3779b9U * (uint32_t) (debrisFrames + nextBurst + 1);
+  b.age = 0.0f;
+  b.spawn = true;
+  if (debrisMode == DEBRIS_CPU)
+    debrisCPU->Spawn(nextBurst, position, b.seed);
+  nextBurst = (nextBurst + 1) % debrisBursts;
+}
+
+bool RenderManager::DebrisActive()
+{
+  for (int i = 0; i < debrisBursts; i++)
+    if (bursts[i].age < debrisLifetime)
+      return true;
+  return false;
+}
+
+//
+// Advances the live bursts by dt. On the GPU this is one transform
+// feedback draw per burst with rasterization off; the CPU only sets a few
+// uniforms. The CPU path simulates and uploads the same data instead.
+//
+void RenderManager::UpdateDebris(float dt)
+{
+  if (debrisMode == DEBRIS_OFF || !DebrisActive())
+    return;
+  double start = glfwGetTime();
+  dt = fmin(dt, 0.1f); // don't let a long stall throw everything through the road
+
+  if (debrisMode == DEBRIS_GPU) {
+    glUseProgram(debrisUpdateProgram);
+    glUniform1f(debrisDtLoc, dt);
+    glEnable(GL_RASTERIZER_DISCARD);
+    stats.programBinds++;
+    stats.uniformUploads++;
+    stats.bytesUploaded += sizeof(float);
+  }
+  for (int i = 0; i < debrisBursts; i++) {
+    DebrisBurst &b = bursts[i];
+    if (b.age >= debrisLifetime)
+      continue;
+    if (debrisMode == DEBRIS_GPU) {
+      int from = b.current, to = 1 - b.current;
+      glUniform3fv(debrisOriginLoc, 1, &b.origin[0]);
+      glUniform1i(debrisSpawnLoc, b.spawn ? 1 : 0);
+      glUniform1ui(debrisSeedLoc, b.seed);
+      glBindVertexArray(debrisVAOs[from]);
+      glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, debrisBuffers[to],
+                        i * debrisPerBurst * 8 * sizeof(float), debrisPerBurst * 8 * sizeof(float));
+      glBeginTransformFeedback(GL_POINTS);
+      glDrawArrays(GL_POINTS, i * debrisPerBurst, debrisPerBurst);
+      glEndTransformFeedback();
+      b.current = to;
+      stats.drawCalls++;
+      stats.vaoBinds++;
+      stats.stateChanges++;
+      stats.uniformUploads += 3;
+      stats.bytesUploaded += sizeof(b.origin) + sizeof(int) + sizeof(b.seed);
+    }
+    else {
+      debrisCPU->Update(i, dt);
+      debrisCPU->Pack(i, &debrisStaging[0]);
+      glBindBuffer(GL_ARRAY_BUFFER, debrisBuffers[0]);
+      glBufferSubData(GL_ARRAY_BUFFER, i * debrisPerBurst * 8 * sizeof(float),
+                      debrisStaging.size() * sizeof(float), &debrisStaging[0]);
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      stats.bytesUploaded += debrisStaging.size() * sizeof(float);
+    }
+    b.spawn = false;
+    b.age += dt;
+  }
+  if (debrisMode == DEBRIS_GPU) {
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glDisable(GL_RASTERIZER_DISCARD);
+    glUseProgram(shaderProgram);
+    stats.programBinds++;
+  }
+  debrisCPUSeconds += glfwGetTime() - start;
+  debrisFrames++;
+}
+
+// Draws the live bursts as points into the current view
+void RenderManager::DrawDebris()
+{
+  if (debrisMode == DEBRIS_OFF || !DebrisActive())
+    return;
+  glUseProgram(debrisDrawProgram);
+  // points keep their size relative to the scene when the resolution scales
+  glUniform1f(debrisPointScaleLoc, 0.08f * renderHeight);
+  glUniform3fv(debrisOffsetLoc, 1, &debrisOffset[0]);
+  stats.programBinds += 2;
+  stats.uniformUploads += 2;
+  stats.bytesUploaded += sizeof(float) + sizeof(debrisOffset);
+  for (int i = 0; i < debrisBursts; i++) {
+    DebrisBurst &b = bursts[i];
+    if (b.age >= debrisLifetime)
+      continue;
+    glUniform3fv(debrisColorLoc, 1, &b.color[0]);
+    glBindVertexArray(debrisVAOs[b.current]);
+    glDrawArrays(GL_POINTS, i * debrisPerBurst, debrisPerBurst);
+    stats.drawCalls++;
+    stats.points += debrisPerBurst;
+    stats.vaoBinds++;
+    stats.uniformUploads++;
+    stats.bytesUploaded += sizeof(b.color);
+  }
+  glUseProgram(shaderProgram);
+}
+
+void RenderManager::PrintDebrisCost()
+{
+  static const char *names[] = {"off", "gpu", "cpu"};
+  if (debrisMode == DEBRIS_OFF || debrisFrames == 0)
+    return;
+  fprintf(stderr, "Debris (%s, %d particles): %.3f ms CPU per updated frame\n",
+          names[debrisMode], debrisParticles, debrisCPUSeconds / debrisFrames * 1000.0);
+}
+
+void RenderManager::BeginFrame()
+{
+  int w, h;
+  glfwGetFramebufferSize(window, &w, &h);
+  if (w != fbWidth || h != fbHeight) {
+    fbWidth = w;
+    fbHeight = h;
+    ResizeTargets();
+  }
+
+  if (Offscreen()) {
+    renderWidth = (int) fmax(1.0, fbWidth * resolutionScale);
+    renderHeight = (int) fmax(1.0, fbHeight * resolutionScale);
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFBO);
+  }
+  else {
+    renderWidth = fbWidth;
+    renderHeight = fbHeight;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+  glViewport(0, 0, renderWidth, renderHeight);
+  drawList.clear();
+  stats.Clear();
+
+  glBeginQuery(GL_TIME_ELAPSED, timerQueries[timerSlot]);
+
+  // wipe the drawing surface clear
+  glClearColor(0.501, 0.819, 1, 1.0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void RenderManager::EndFrame()
+{
+  ReplayDrawList();
+
+  if (antiAliasing == AA_FXAA) {
+    DrawFXAA(); // also upscales
+  }
+  else if (dynamicResolution) {
+    // upscale into the window
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFBO);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, renderWidth, renderHeight, 0, 0, fbWidth, fbHeight,
+                      GL_COLOR_BUFFER_BIT, GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  }
+
+  glEndQuery(GL_TIME_ELAPSED);
+  timerPending[timerSlot] = true;
+  timerSlot = (timerSlot + 1) % numTimerQueries;
+  CollectTimerQueries();
+
+  // the oldest frame leaves the window as this one enters
+  RenderStats &slot = statsHistory[statsFrames % statsWindow];
+  if (statsFrames >= statsWindow)
+    statsTotal.Add(slot, -1);
+  slot = stats;
+  statsTotal.Add(stats);
+  statsFrames++;
+  lastStats = stats;
+}
+
+int RenderManager::GetAverageStats(RenderStats &total)
+{
+  total = statsTotal;
+  return statsFrames < statsWindow ? statsFrames : statsWindow;
+}
+
+// Per-frame averages over the last statsWindow frames
+void RenderManager::PrintRenderStats()
+{
+  static const char *shapeNames[numShapeTypes] = {"sphere", "cylinder", "cube"};
+  RenderStats total;
+  int frames = GetAverageStats(total);
+  if (frames == 0)
+    return;
+  double n = frames;
+  fprintf(stderr, "Render stats, per frame over the last %d: %.1f draw calls, %.1f VAO binds, %.1f program binds, "
+          "%.1f state changes, %.1f uniform uploads, %.1f KB uploaded\n",
+          frames, total.drawCalls / n, total.vaoBinds / n, total.programBinds / n,
+          total.stateChanges / n, total.uniformUploads / n, total.bytesUploaded / n / 1024.0);
+  for (int i = 0; i < numShapeTypes; i++) {
+    fprintf(stderr, "  %-8s %8.1f draws %10.1f triangles\n",
+            shapeNames[i], total.draws[i] / n, total.indices[i] / n / 3.0);
+  }
+  if (total.points > 0)
+    fprintf(stderr, "  debris   %8.1f points\n", total.points / n);
+}
+
+void RenderManager::SetUpFXAA()
+{
+  const char *vertex_shader = GetFXAAVertexShader();
+  const char *fragment_shader = GetFXAAFragmentShader();
+  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(vs, 1, &vertex_shader, NULL);
+  glCompileShader(vs);
+  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fs, 1, &fragment_shader, NULL);
+  glCompileShader(fs);
+
+  int vsOk = -1, fsOk = -1;
+  glGetShaderiv(vs, GL_COMPILE_STATUS, &vsOk);
+  glGetShaderiv(fs, GL_COMPILE_STATUS, &fsOk);
+  if (vsOk != GL_TRUE || fsOk != GL_TRUE) {
+    fprintf(stderr, "ERROR: FXAA shader did not compile, disabling FXAA\n");
+    _print_shader_info_log(vsOk != GL_TRUE ? vs : fs);
+    antiAliasing = AA_NONE;
+    return;
+  }
+
+  fxaaProgram = glCreateProgram();
+  glAttachShader(fxaaProgram, fs);
+  glAttachShader(fxaaProgram, vs);
+  glLinkProgram(fxaaProgram);
+  glUseProgram(fxaaProgram);
+  glUniform1i(glGetUniformLocation(fxaaProgram, "scene"), 0);
+  fxaaTexelLoc = glGetUniformLocation(fxaaProgram, "texel");
+  fxaaUVScaleLoc = glGetUniformLocation(fxaaProgram, "uvScale");
+  fxaaUVMaxLoc = glGetUniformLocation(fxaaProgram, "uvMax");
+  glUseProgram(shaderProgram);
+  glGenVertexArrays(1, &fxaaVAO);
+}
+
+// Draws the rendered part of the offscreen target over the whole window
+void RenderManager::DrawFXAA()
+{
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(0, 0, fbWidth, fbHeight);
+  glDisable(GL_DEPTH_TEST);
+  glUseProgram(fxaaProgram);
+  stats.programBinds += 2;
+  stats.vaoBinds++;
+  stats.drawCalls++;
+  stats.uniformUploads += 3;
+  stats.bytesUploaded += 3 * 2 * sizeof(float);
+  stats.stateChanges++;
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, sceneColorTex);
+  glUniform2f(fxaaTexelLoc, 1.0f / fbWidth, 1.0f / fbHeight);
+  glUniform2f(fxaaUVScaleLoc, (float) renderWidth / fbWidth, (float) renderHeight / fbHeight);
+  // keep the taps inside the rendered corner, half a texel in from its edge
+  glUniform2f(fxaaUVMaxLoc, (renderWidth - 0.5f) / fbWidth, (renderHeight - 0.5f) / fbHeight);
+  glBindVertexArray(fxaaVAO);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glUseProgram(shaderProgram);
+  glEnable(GL_DEPTH_TEST);
+}
+
+//
+// The extra render target memory of each anti-aliasing mode at the current
+// window size, to go with the GPU frame time. The MSAA figure is an
+// estimate: the driver owns the multisampled window buffers.
+//
+void RenderManager::PrintAntiAliasingCost()
+{
+  static const char *names[] = {"none", "fxaa", "msaa4"};
+  double pixels = (double) fbWidth * fbHeight;
+  double bytesPerSample = 4 + 4;                // RGBA8 color and 24-bit depth (+ padding)
+  double fxaaBytes = dynamicResolution ? 0.0    // reuses the dynamic resolution target
+                                       : pixels * bytesPerSample;
+  double msaaBytes = pixels * bytesPerSample * 3 + pixels * 4; // 3 more samples plus a resolve buffer
+  double mb = 1.0 / (1024.0 * 1024.0);
+  fprintf(stderr, "Anti-aliasing %s at %dx%d: extra target memory for FXAA %.1f MB, for 4x MSAA about %.1f MB\n",
+          names[antiAliasing], fbWidth, fbHeight, fxaaBytes * mb, msaaBytes * mb);
+}
+
+void RenderManager::CollectTimerQueries()
+{
+  // oldest first; stop at the first result that isn't ready so they are
+  // consumed in order
+  for (int i = 0; i < numTimerQueries; i++) {
+    int slot = (timerSlot + i) % numTimerQueries;
+    if (!timerPending[slot])
+      continue;
+    GLint available = 0;
+    glGetQueryObjectiv(timerQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      break;
+    GLuint64 elapsed = 0;
+    glGetQueryObjectui64v(timerQueries[slot], GL_QUERY_RESULT, &elapsed);
+    timerPending[slot] = false;
+    gpuBusyTime += elapsed * 1e-9;
+    UpdateResolutionScale(elapsed * 1e-9);
+    if (indirectViews[slot] > 0) {
+      // that frame's GPU work is done, so its copy is too; counted in this frame
+      GLuint commands[numShapeTypes * 5];
+      glBindBuffer(GL_COPY_READ_BUFFER, indirectReadback[slot]);
+      glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(commands), commands);
+      glBindBuffer(GL_COPY_READ_BUFFER, 0);
+      for (int st = 0; st < numShapeTypes; st++) {
+        stats.draws[st] += commands[st * 5 + 1] * indirectViews[slot];
+        stats.indices[st] += commands[st * 5] * commands[st * 5 + 1] * indirectViews[slot];
+      }
+      indirectViews[slot] = 0;
+    }
+  }
+  // a slot that is about to be reused can't be waited on any longer
+  timerPending[timerSlot] = false;
+  indirectViews[timerSlot] = 0;
+}
+
+void RenderManager::UpdateResolutionScale(double gpuSeconds)
+{
+  // exponential moving average so a single slow frame doesn't cause a jump
+  if (gpuFrameTime == 0.0)
+    gpuFrameTime = gpuSeconds;
+  else
+    gpuFrameTime = 0.9 * gpuFrameTime + 0.1 * gpuSeconds;
+
+  if (!dynamicResolution || --scaleCooldown > 0)
+    return;
+
+  double ratio = gpuBudget / gpuFrameTime;
+  float newScale = resolutionScale;
+  if (ratio < 1.0) {
+    // over budget: GPU time is roughly proportional to the pixel count,
+    // i.e. to the square of the scale
+    newScale = resolutionScale * fmax(sqrt(ratio), 0.8);
+  }
+  else if (ratio > 1.3) {
+    // comfortably under budget: creep back up
+    newScale = resolutionScale + 0.05f;
+  }
+  newScale = fmin(1.0f, fmax(minResolutionScale, newScale));
+  if (newScale != resolutionScale) {
+    resolutionScale = newScale;
+    scaleCooldown = 15; // let the average settle at the new size
+  }
+}
+
+//
+// Draws a shape against the depth buffer without touching the color or
+// depth buffers. Used inside an occlusion query to test a bounding volume.
+//
+void RenderManager::RenderProxy(ShapeType st, glm::mat4 model)
+{
+  Render(st, model);
+  drawList.back().type = CMD_PROXY;
+}
+
+// Picks up the result of the query for id if the GPU has finished it, and
+// returns the latest known result: 1 visible, 0 hidden, -1 unknown.
+// Never waits on the GPU.
+int RenderManager::PollOcclusionQuery(int id)
+{
+  if (id >= occlusionQueries.size())
+    return -1;
+  if (occlusionPending[id]) {
+    GLint available = 0;
+    glGetQueryObjectiv(occlusionQueries[id], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+      GLuint anySamples = 0;
+      glGetQueryObjectuiv(occlusionQueries[id], GL_QUERY_RESULT, &anySamples);
+      if (!occlusionDiscard[id])
+        occlusionResults[id] = anySamples ? 1 : 0;
+      occlusionPending[id] = false;
+      occlusionDiscard[id] = false;
+    }
+  }
+  return occlusionResults[id];
+}
+
+// Returns false (and starts nothing) while an earlier query for id is
+// still in flight.
+bool RenderManager::BeginOcclusionQuery(int id)
+{
+  while (id >= occlusionQueries.size()) {
+    GLuint q;
+    glGenQueries(1, &q);
+    occlusionQueries.push_back(q);
+    occlusionPending.push_back(false);
+    occlusionDiscard.push_back(false);
+    occlusionResults.push_back(-1);
+  }
+  if (occlusionPending[id])
+    return false;
+  DrawCommand cmd;
+  cmd.type = CMD_BEGIN_QUERY;
+  cmd.query = id;
+  drawList.push_back(cmd);
+  occlusionPending[id] = true;
+  return true;
+}
+
+void RenderManager::EndOcclusionQuery()
+{
+  DrawCommand cmd;
+  cmd.type = CMD_END_QUERY;
+  cmd.query = -1;
+  drawList.push_back(cmd);
+}
+
+// Forgets the result for id, e.g. after the object it tracks was respawned
+void RenderManager::ResetOcclusionQuery(int id)
+{
+  if (id < occlusionResults.size()) {
+    occlusionResults[id] = -1;
+    occlusionDiscard[id] = occlusionPending[id];
+  }
+}
+
+void RenderManager::SetColor(double r, double g, double b)
+{
+   color[0] = r;
+   color[1] = g;
+   color[2] = b;
+}
+
+void RenderManager::SetViewCount(int n)
+{
+   numViews = (int) fmax(1, fmin(maxViews, n));
+   UpdateProjections();
+}
+
+// One view fills the window, two are stacked, three or four share a 2x2
+// grid. The rectangle is within the renderWidth x renderHeight area.
+void RenderManager::ViewRect(int i, int &x, int &y, int &w, int &h)
+{
+   int cols = numViews > 2 ? 2 : 1;
+   int rows = numViews > 1 ? 2 : 1;
+   int col = i % cols;
+   int row = i / cols;
+   w = renderWidth / cols;
+   h = renderHeight / rows;
+   x = col * w;
+   y = (rows - 1 - row) * h; // first row at the top
+}
+
+void RenderManager::UpdateProjections()
+{
+   float cols = numViews > 2 ? 2 : 1;
+   float rows = numViews > 1 ? 2 : 1;
+   float aspect = (fbWidth / cols) / (fbHeight / rows);
+   for (int i = 0; i < maxViews; i++)
+      views[i].projection = glm::perspective(glm::radians(45.0f), aspect, 5.0f, 110.0f);
+}
+
+// Records a draw; it is issued once per view at the end of the frame
+void RenderManager::Render(ShapeType st, glm::mat4 model)
+{
+   DrawCommand cmd;
+   cmd.type = CMD_DRAW;
+   cmd.shape = st;
+   cmd.query = -1;
+   cmd.color = color;
+   cmd.model = model;
+   drawList.push_back(cmd);
+}
+
+void RenderManager::ReplayDrawList()
+{
+   std::vector<glm::vec4> blocks(maxViews * viewUBOStride / sizeof(glm::vec4));
+   for (int i = 0; i < numViews; i++) {
+      glm::mat4 vp = GetViewProjection(i);
+      glm::vec4 *block = &blocks[i * viewUBOStride / sizeof(glm::vec4)];
+      for (int c = 0; c < 4; c++)
+         block[c] = vp[c];
+      block[4] = glm::vec4(views[i].camera, 1.0f);
+   }
+   glBindBuffer(GL_UNIFORM_BUFFER, viewUBO);
+   glBufferSubData(GL_UNIFORM_BUFFER, 0, numViews * viewUBOStride, &blocks[0]);
+   glBindBuffer(GL_UNIFORM_BUFFER, 0);
+   stats.bytesUploaded += numViews * viewUBOStride;
+
+   for (int i = 0; i < numViews; i++) {
+      int x, y, w, h;
+      ViewRect(i, x, y, w, h);
+      glViewport(x, y, w, h);
+      glBindBufferRange(GL_UNIFORM_BUFFER, 0, viewUBO, i * viewUBOStride,
+                        sizeof(glm::mat4) + sizeof(glm::vec4));
+      stats.stateChanges += 2;
+      for (int k = 0; k < drawList.size(); k++)
+         Execute(drawList[k], i == 0);
+      DrawImpostors();
+      DrawDebris();
+   }
+}
+
+void RenderManager::Execute(const DrawCommand &cmd, bool firstView)
+{
+   if (cmd.type == CMD_BEGIN_QUERY) {
+      if (firstView)
+         glBeginQuery(GL_ANY_SAMPLES_PASSED, occlusionQueries[cmd.query]);
+      return;
+   }
+   if (cmd.type == CMD_END_QUERY) {
+      if (firstView)
+         glEndQuery(GL_ANY_SAMPLES_PASSED);
+      return;
+   }
+   if (cmd.type == CMD_INDIRECT) {
+      // commands are DrawElementsIndirectCommand, one per shape
+      glUseProgram(instancedProgram);
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cmd.indirect);
+      GLuint vaos[numShapeTypes] = {sphereVAO, cylinderVAO, cubeVAO};
+      for (int st = 0; st < numShapeTypes; st++) {
+         glBindVertexArray(vaos[st]);
+         glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void *) (st * 5 * sizeof(GLuint)), 1, 0);
+      }
+      glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+      glUseProgram(shaderProgram);
+      if (firstView && indirectReadback[timerSlot] != 0) {
+         // instance counts are only known on the GPU; CollectTimerQueries adds them later
+         glBindBuffer(GL_COPY_READ_BUFFER, cmd.indirect);
+         glBindBuffer(GL_COPY_WRITE_BUFFER, indirectReadback[timerSlot]);
+         glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, numShapeTypes * 5 * sizeof(GLuint));
+         glBindBuffer(GL_COPY_READ_BUFFER, 0);
+         glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+         indirectViews[timerSlot] = numViews;
+      }
+      stats.drawCalls += numShapeTypes;
+      stats.vaoBinds += numShapeTypes;
+      stats.programBinds += 2;
+      stats.stateChanges += 2;
+      return;
+   }
+
+   if (sphereImpostors && cmd.shape == SPHERE && cmd.type == CMD_DRAW)
+      return; // see DrawImpostors
+
+   int numPrimitives = 0;
+   if (cmd.shape == SPHERE)
+   {
+      glBindVertexArray(sphereVAO);
+      numPrimitives = sphereNumPrimitives;
+   }
+   else if (cmd.shape == CYLINDER)
+   {
+      glBindVertexArray(cylinderVAO);
+      numPrimitives = cylinderNumPrimitives;
+   }
+   else if (cmd.shape == CUBE)
+   {
+      glBindVertexArray(cubeVAO);
+      numPrimitives = cubeNumPrimitives;
+   }
+   if (cmd.type == CMD_PROXY) {
+      glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+      glDepthMask(GL_FALSE);
+      stats.stateChanges += 2;
+   }
+   glUniformMatrix4fv(modelloc, 1, GL_FALSE, &cmd.model[0][0]);
+   glUniform3fv(colorloc, 1, &cmd.color[0]);
+   glDrawElements(GL_TRIANGLES, numPrimitives, GL_UNSIGNED_INT, NULL);
+   stats.drawCalls++;
+   stats.draws[cmd.shape]++;
+   stats.indices[cmd.shape] += numPrimitives;
+   stats.vaoBinds++;
+   stats.uniformUploads += 2;
+   stats.bytesUploaded += sizeof(cmd.model) + sizeof(cmd.color);
+   if (cmd.type == CMD_PROXY) {
+      glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+      glDepthMask(GL_TRUE);
+      stats.stateChanges += 2;
+   }
+}
+
+//
+// The SPHERE draws Execute skipped, as two triangles each instead of the
+// whole mesh. All spheres go in one batch so the program switches once.
+//
+void RenderManager::DrawImpostors()
+{
+   if (!sphereImpostors)
+      return;
+   glUseProgram(impostorProgram);
+   glBindVertexArray(impostorVAO);
+   stats.programBinds += 2;
+   stats.vaoBinds++;
+   for (int k = 0; k < drawList.size(); k++) {
+      const DrawCommand &cmd = drawList[k];
+      if (cmd.type != CMD_DRAW || cmd.shape != SPHERE)
+         continue;
+      glUniformMatrix4fv(impostorModelLoc, 1, GL_FALSE, &cmd.model[0][0]);
+      glUniform3fv(impostorColorLoc, 1, &cmd.color[0]);
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+      stats.drawCalls++;
+      stats.draws[SPHERE]++;
+      stats.indices[SPHERE] += 6; // two triangles, counted like indexed ones
+      stats.uniformUploads += 2;
+      stats.bytesUploaded += sizeof(cmd.model) + sizeof(cmd.color);
+   }
+   glUseProgram(shaderProgram);
+}
+
+int RenderManager::GetIndexCount(ShapeType st)
+{
+   if (st == SPHERE)
+      return sphereNumPrimitives;
+   if (st == CYLINDER)
+      return cylinderNumPrimitives;
+   return cubeNumPrimitives;
+}
+
+//
+// Prepares RenderIndirect: gets the instanced program and adds the
+// per-instance model matrix (locations 2-5) and color (6) from
+// instanceBuffer to the shape VAOs. The plain program doesn't read those
+// locations, so the VAOs keep working for Render. Needs GL 4.3.
+//
+bool RenderManager::SetUpIndirect(GLuint instanceBuffer)
+{
+   instancedProgram = GetProgram(lightingVariant | VARIANT_INSTANCED);
+   if (instancedProgram == 0)
+      return false;
+
+   if (indirectReadback[0] == 0) {
+      glGenBuffers(numTimerQueries, indirectReadback);
+      for (int i = 0; i < numTimerQueries; i++) {
+         glBindBuffer(GL_COPY_WRITE_BUFFER, indirectReadback[i]);
+         glBufferData(GL_COPY_WRITE_BUFFER, numShapeTypes * 5 * sizeof(GLuint), NULL, GL_STREAM_READ);
+      }
+      glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+   }
+
+   const GLsizei stride = sizeof(glm::mat4) + sizeof(glm::vec4);
+   GLuint vaos[numShapeTypes] = {sphereVAO, cylinderVAO, cubeVAO};
+   for (int st = 0; st < numShapeTypes; st++) {
+      glBindVertexArray(vaos[st]);
+      glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+      for (int c = 0; c < 5; c++) {
+         glVertexAttribPointer(2 + c, 4, GL_FLOAT, GL_FALSE, stride, (void *) (c * sizeof(glm::vec4)));
+         glVertexAttribDivisor(2 + c, 1);
+         glEnableVertexAttribArray(2 + c);
+      }
+   }
+   glBindVertexArray(0);
+   glBindBuffer(GL_ARRAY_BUFFER, 0);
+   return true;
+}
+
+// Runs a compute program now (not deferred like drawing) and restores the
+// program the draw list expects
+void RenderManager::DispatchCompute(GLuint program, GLuint groups, GLbitfield barriers)
+{
+   glUseProgram(program);
+   glDispatchCompute(groups, 1, 1);
+   glMemoryBarrier(barriers);
+   glUseProgram(shaderProgram);
+   stats.programBinds += 2;
+}
+
+// Records a GPU-written set of draws, replayed into every view like Render
+void RenderManager::RenderIndirect(GLuint commandBuffer)
+{
+   DrawCommand cmd;
+   cmd.type = CMD_INDIRECT;
+   cmd.query = -1;
+   cmd.indirect = commandBuffer;
+   drawList.push_back(cmd);
+}
+
+// Center of the bounding box and the farthest vertex from it
+glm::vec4 MeshBounds(const std::vector<float> &coords)
+{
+  glm::vec3 lo(coords[0], coords[1], coords[2]), hi = lo;
+  for (int i = 0; i < coords.size(); i += 3) {
+    glm::vec3 p(coords[i], coords[i+1], coords[i+2]);
+    lo = glm::min(lo, p);
+    hi = glm::max(hi, p);
+  }
+  glm::vec3 center = 0.5f * (lo + hi);
+  float radius = 0.0f;
+  for (int i = 0; i < coords.size(); i += 3)
+    radius = fmax(radius, glm::length(glm::vec3(coords[i], coords[i+1], coords[i+2]) - center));
+  return glm::vec4(center, radius);
+}
+
+void SetUpVBOs(std::vector<float> &coords, std::vector<float> &normals,
+               GLuint &points_vbo, GLuint &normals_vbo, GLuint &index_vbo)
+{
+  int numIndices = coords.size()/3;
+  std::vector<GLuint> indices(numIndices);
+  for(int i = 0; i < numIndices; i++)
+    indices[i] = i;
+
+  points_vbo = 0;
+  glGenBuffers(1, &points_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, points_vbo);
+  glBufferData(GL_ARRAY_BUFFER, coords.size() * sizeof(float), coords.data(), GL_STATIC_DRAW);
+
+  normals_vbo = 0;
+  glGenBuffers(1, &normals_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, normals_vbo);
+  glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(float), normals.data(), GL_STATIC_DRAW);
+
+  index_vbo = 0;    // Index buffer object
+  glGenBuffers(1, &index_vbo);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_vbo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+}
+
+void RenderManager::SetUpGeometry(MeshBuilder &meshes)
+{
+  std::vector<float> &sphereCoords = meshes.Get(SPHERE).coords;
+  std::vector<float> &sphereNormals = meshes.Get(SPHERE).normals;
+  sphereNumPrimitives = sphereCoords.size() / 3;
+  GLuint sphere_points_vbo, sphere_normals_vbo, sphere_indices_vbo;
+  SetUpVBOs(sphereCoords, sphereNormals, 
+            sphere_points_vbo, sphere_normals_vbo, sphere_indices_vbo);
+
+  std::vector<float> &cylCoords = meshes.Get(CYLINDER).coords;
+  std::vector<float> &cylNormals = meshes.Get(CYLINDER).normals;
+  cylinderNumPrimitives = cylCoords.size() / 3;
+  GLuint cyl_points_vbo, cyl_normals_vbo, cyl_indices_vbo;
+  SetUpVBOs(cylCoords, cylNormals, 
+            cyl_points_vbo, cyl_normals_vbo, cyl_indices_vbo);
+
+  std::vector<float> &cubeCoords = meshes.Get(CUBE).coords;
+  std::vector<float> &cubeNormals = meshes.Get(CUBE).normals;
+  cubeNumPrimitives = cubeCoords.size() / 3;
+  GLuint cube_points_vbo, cube_normals_vbo, cube_indices_vbo;
+  SetUpVBOs(cubeCoords, cubeNormals, 
+            cube_points_vbo, cube_normals_vbo, cube_indices_vbo);
+
+  meshBounds[SPHERE] = MeshBounds(sphereCoords);
+  meshBounds[CYLINDER] = MeshBounds(cylCoords);
+  meshBounds[CUBE] = MeshBounds(cubeCoords);
+
+  GLuint vao[3];
+  glGenVertexArrays(3, vao);
 
   glBindVertexArray(vao[SPHERE]);
   sphereVAO = vao[SPHERE];
@@ -550,12 +2172,40 @@ void RenderManager::SetUpGeometry()
   glEnableVertexAttribArray(1);
 }
 
+//
+// Kinds of enemy obstacle. Each has its own model (see SetUpObstacle) and
+// collision size, and turns up weight times in every 20 obstacles.
+//
+enum ObstacleType
+{
+    OBSTACLE_CAR,
+    OBSTACLE_TRUCK,
+    OBSTACLE_CONE,
+    OBSTACLE_BARRIER
+};
+const int numObstacleTypes = 4;
+
+struct ObstacleInfo
+{
+    const char *name;
+    float       size[3]; // as GameObject::size
+    int         weight;
+};
+
+const ObstacleInfo obstacleTypes[numObstacleTypes] = {
+    {"car",     {1.0, 1.0, 2.0}, 14},
+    {"truck",   {1.0, 1.6, 4.0},  3},
+    {"cone",    {0.4, 0.6, 0.4},  2},
+    {"barrier", {1.2, 0.5, 0.3},  1}
+};
+
 class GameObject {
 public:
     float color[3];     // the RGB color
     float position[3];  // the xyz position
     float size[3];      // the size. used for collision detection
     bool  enabled;      // true = show the GameObject, false = hide it (don't render)
+    ObstacleType type;  // the model drawn for an enemy obstacle
 
     GameObject();
     GameObject(float, float, float, float, float, float, float, float, float);
@@ -566,6 +2216,7 @@ public:
     void setSize(float, float, float);
 
     bool willCollide(GameObject);
+    bool willCollideSwept(const GameObject &, float dx, float dz);
     void moveHorizontal(float);
     void moveForward(float);
 };
@@ -573,6 +2224,7 @@ GameObject::GameObject(void) {
     setRandomColor();
     setSize(1, 1, 1);
     enabled = true;
+    type = OBSTACLE_CAR;
 }
 GameObject::GameObject(float cx, float cy, float cz, 
                        float px, float py, float pz,
@@ -582,6 +2234,7 @@ GameObject::GameObject(float cx, float cy, float cz,
     setPosition(px, py, pz);
     setSize(sx, sy, sz);
     enabled = true;
+    type = OBSTACLE_CAR;
 }
 
 void GameObject::setColor(float r, float g, float b) {
@@ -621,6 +2274,35 @@ bool GameObject::willCollide(GameObject other) {
 
     return onRight && onLeft && onFront && onBack;
 }
+
+// Interval of t in [0, 1] during which a box starting at a with size sa,
+// moving by d, overlaps a box at b with size sb along one axis. Returns
+// false if they never overlap.
+bool sweptOverlap(float a, float sa, float d, float b, float sb, float &t0, float &t1) {
+    float lo = b - (a + sa); // offsets at which the boxes touch
+    float hi = (b + sb) - a;
+    if (d == 0.0) {
+        t0 = 0.0;
+        t1 = 1.0;
+        return lo <= 0.0 && 0.0 <= hi;
+    }
+    t0 = fmax(0.0, fmin(lo / d, hi / d));
+    t1 = fmin(1.0, fmax(lo / d, hi / d));
+    return t0 <= t1;
+}
+
+// Like willCollide, but true if the objects overlap at any point while this
+// object moves by (dx, dz) relative to other, starting from the current
+// positions. Unlike testing the end positions only, this can't step over
+// an obstacle no matter how far the objects move in one tick.
+bool GameObject::willCollideSwept(const GameObject &other, float dx, float dz) {
+    float tx0, tx1, tz0, tz1;
+    if (!sweptOverlap(position[0], size[0], dx, other.position[0], other.size[0], tx0, tx1))
+        return false;
+    if (!sweptOverlap(position[2], size[2], dz, other.position[2], other.size[2], tz0, tz1))
+        return false;
+    return fmax(tx0, tz0) <= fmin(tx1, tz1);
+}
 void GameObject::moveHorizontal(float dx) {
     if (dx > 0.0) {
         position[0] = fmin(1.4, position[0] + dx);
@@ -634,582 +2316,4823 @@ void GameObject::moveForward(float dz) {
     position[2] -= dz;
 }
 
-void resetEnemyCarRow(GameObject* cars[3], float moveBackAmount, bool lastRowEnabledStatus[3]) {
-    for (int i = 0; i < 3; i++) {
-        cars[i]->moveForward(moveBackAmount);
-        cars[i]->setRandomColor();
-        cars[i]->enabled = true;
-    }
-
-    // randomly choose one or two cars to be disabled
-    int randomIndex = rand() % 3;
-    int shouldDisableTwoCars = rand() % 4; // 25% there will be only one car for the row
+// the longest obstacle, which decides how far behind the player rows can
+// still be hit
+float MaxObstacleLength()
+{
+    float length = 0.0;
+    for (int t = 0; t < numObstacleTypes; t++)
+        length = fmax(length, obstacleTypes[t].size[2]);
+    return length;
+}
 
-    cars[randomIndex]->enabled = false;
-    if (shouldDisableTwoCars == 0) {
-        // disable the car to the right, including wraparound
-        cars[(randomIndex+1) % 3]->enabled = false;  
-    }
+ObstacleType RandomObstacleType()
+{
+    int total = 0;
+    for (int t = 0; t < numObstacleTypes; t++)
+        total += obstacleTypes[t].weight;
+    int r = rand() % total;
+    int t = 0;
+    while (r >= obstacleTypes[t].weight)
+        r -= obstacleTypes[t++].weight;
+    return (ObstacleType) t;
+}
 
-    // Make sure the new rows do not match the previous row's positions (enabled value)
-    int theSame = 0;
-    for (int i = 0; i < 3; i++) {
-        if (cars[i]->enabled == lastRowEnabledStatus[i]) {
-            theSame++;
-        }
+//
+// Pool of enemy obstacles.
+//
+// An obstacle is named by a handle: its slot and the generation of the
+// slot it was spawned in. Despawning bumps the generation, so a handle
+// kept after its obstacle is gone finds nothing rather than whatever was
+// spawned into the slot next. Free slots are kept on a list threaded
+// through the slots and reused most recent first; once the pool has
+// grown to the peak number of live obstacles, spawning and despawning
+// never allocate.
+//
+struct ObstacleHandle
+{
+    uint32_t index;
+    uint32_t generation;
+};
+
+const ObstacleHandle noObstacle = {0xFFFFFFFF, 0};
+
+class ObstaclePool
+{
+  public:
+                   ObstaclePool() : firstFree(-1), live(0) { }
+    void           Reserve(int n) { slots.reserve(n); };
+    ObstacleHandle Spawn(ObstacleType);
+    void           Despawn(ObstacleHandle);        // does nothing if it is already gone
+    GameObject    *Get(ObstacleHandle);            // NULL once despawned
+    void           Clear();                        // despawns everything, keeps the storage
+    int            LiveCount() { return live; };
+    int            Capacity() { return slots.capacity(); };
+
+  private:
+    struct Slot
+    {
+        GameObject object;
+        uint32_t   generation;
+        int        nextFree; // next slot on the free list, -1 = none
+        bool       live;
+    };
+    std::vector<Slot> slots;
+    int               firstFree; // -1 = the free list is empty
+    int               live;
+};
+
+// The obstacle gets a random color and its type's size, at the origin
+ObstacleHandle ObstaclePool::Spawn(ObstacleType type)
+{
+    int index = firstFree;
+    if (index >= 0) {
+        firstFree = slots[index].nextFree;
     }
-    if (theSame == 3) {
-        resetEnemyCarRow(cars, 0.0, lastRowEnabledStatus);
+    else {
+        index = slots.size();
+        slots.push_back(Slot());
+        slots[index].generation = 0;
     }
+    Slot &s = slots[index];
+    const float *size = obstacleTypes[type].size;
+    s.object.setRandomColor();
+    s.object.setPosition(0, 0, 0);
+    s.object.setSize(size[0], size[1], size[2]);
+    s.object.enabled = true;
+    s.object.type = type;
+    s.nextFree = -1;
+    s.live = true;
+    live++;
+
+    ObstacleHandle h = {(uint32_t) index, s.generation};
+    return h;
+}
 
-    // set lastRowEnabledStatus
-    for (int i = 0; i < 3; i++) {
-        lastRowEnabledStatus[i] = cars[i]->enabled;
+void ObstaclePool::Despawn(ObstacleHandle h)
+{
+    if (!Get(h))
+        return;
+    Slot &s = slots[h.index];
+    s.live = false;
+    s.generation++;
+    s.nextFree = firstFree;
+    firstFree = h.index;
+    live--;
+}
+
+GameObject *ObstaclePool::Get(ObstacleHandle h)
+{
+    if (h.index >= slots.size())
+        return NULL;
+    Slot &s = slots[h.index];
+    return s.live && s.generation == h.generation ? &s.object : NULL;
+}
+
+void ObstaclePool::Clear()
+{
+    for (int i = 0; i < slots.size(); i++) {
+        if (slots[i].live)
+            slots[i].generation++;
+        slots[i].live = false;
+        slots[i].nextFree = i + 1 < slots.size() ? i + 1 : -1;
     }
+    firstFree = slots.empty() ? -1 : 0;
+    live = 0;
 }
 
 
 //
-// PART3: main function
+// Telemetry module
+//
+// The game thread pushes one fixed-size TelemetryRecord per frame into a
+// lock-free single-producer/single-consumer ring. A background thread drains
+// the ring, echoes score changes to the terminal and batches the records to
+// an optional binary or CSV file, so no I/O ever happens on the frame path.
+// Records that start or end a game are never dropped, so a full ring cannot
+// swallow the final score. The MetricsServer gets the same records through
+// a ring of its own.
 //
 
-glm::mat4 RotateMatrix(float degrees, float x, float y, float z)
+enum TelemetryFlags
 {
-   glm::mat4 identity(1.0f);
-   glm::mat4 rotation = glm::rotate(identity, 
-                                    glm::radians(degrees), 
-                                    glm::vec3(x, y, z));
-   return rotation;
-}
+    TELEMETRY_NEW_GAME  = 1, // first frame of a new game
+    TELEMETRY_GAME_OVER = 2  // the player crashed on this frame
+};
 
-glm::mat4 ScaleMatrix(double x, double y, double z)
+struct TelemetryRecord
 {
-   glm::mat4 identity(1.0f);
-   glm::vec3 scale(x, y, z);
-   return glm::scale(identity, scale);
+    uint32_t frame;        // frame number within the current game
+    float    frameTime;    // seconds spent on the previous frame
+    int32_t  score;
+    float    forwardSpeed;
+    uint32_t collisions;   // obstacles hit since the previous record
+    uint32_t drawCalls;    // Render calls issued on this frame
+    uint32_t culled;       // enemy cars rejected by culling on this frame
+    uint32_t flags;        // TelemetryFlags
+    uint32_t ticks;        // simulation ticks run since the previous record
+    uint32_t allocations;  // operator new calls on the game thread since the previous record;
+                           // malloc and the driver's own allocations are not seen. The
+                           // counting operator new is always installed, not only for telemetry
+};
+
+// Heap allocations made by the calling thread, counted by the global
+// operator new; the frame loop reads its own count, so it needs no atomics.
+// The replacement is linked in for every run, with or without telemetry.
+thread_local uint32_t threadAllocations = 0;
+
+// As the standard one: retry after each call of the new-handler and throw
+// only when there is none
+void *operator new(size_t size)
+{
+    threadAllocations++;
+    if (size == 0)
+        size = 1;
+    while (true) {
+        void *p = malloc(size);
+        if (p != NULL)
+            return p;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == NULL)
+            throw std::bad_alloc();
+        handler();
+    }
 }
 
-glm::mat4 TranslateMatrix(double x, double y, double z)
+void operator delete(void *p) noexcept
 {
-   glm::mat4 identity(1.0f);
-   glm::vec3 translate(x, y, z);
-   return glm::translate(identity, translate);
+    free(p);
 }
 
-void SetUpWheel(glm::mat4 modelSoFar, RenderManager &rm) {
-    // tire
-    rm.SetColor(0, 0, 0);
-    glm::mat4 s1 = ScaleMatrix(1, 1, 0.5);
-    rm.Render(RenderManager::CYLINDER, modelSoFar*s1);
+template <typename T, unsigned int N>
+class SPSCRing
+{
+  public:
+    SPSCRing() : head(0), tail(0) { }
 
-    // rim
-    rm.SetColor(0.666, 0.666, 0.666);
-    glm::mat4 s2 = ScaleMatrix(0.6, 0.6, 0.51);
-    glm::mat4 t2 = TranslateMatrix(0, 0, -0.005);
-    rm.Render(RenderManager::CYLINDER, modelSoFar*t2*s2);
-}
+    // producer side: returns false (and drops the item) if the ring is full
+    bool Push(const T &item)
+    {
+        unsigned int h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == N)
+            return false;
+        items[h % N] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
 
-void SetUpCar(glm::mat4 modelSoFar, RenderManager &rm, float r, float g, float b) {
-    rm.SetColor(r, g, b);
+    // consumer side: returns false if the ring is empty
+    bool Pop(T &item)
+    {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return false;
+        item = items[t % N];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
 
-    // main rectangle for body
-    glm::mat4 t1 = TranslateMatrix(-0.5, 0, 0);
-    glm::mat4 s1 = ScaleMatrix(1, 0.05, 2);
-    rm.Render(RenderManager::CUBE, modelSoFar*t1*s1);
+  private:
+    T items[N];
+    std::atomic<unsigned int> head; // next slot to write, only advanced by the producer
+    std::atomic<unsigned int> tail; // next slot to read, only advanced by the consumer
+};
 
-    // bottom block between wheels
-    glm::mat4 s6 = ScaleMatrix(1, 0.3, 0.6);
-    glm::mat4 t6 = TranslateMatrix(-0.5, -0.2, 0.7);
-    rm.Render(RenderManager::CUBE, modelSoFar*t6*s6);
+//
+// Fixed-bin frame-time histogram: 0.25 ms bins up to 250 ms plus an
+// overflow bin, so adding a frame is O(1) and it never allocates.
+//
+class FrameTimeHistogram
+{
+  public:
+    FrameTimeHistogram() { Clear(); }
+    void   Clear();
+    void   Add(double seconds);
+    double Percentile(double p);
+    int    StutterCount();
+    void   Print();
 
-    // bumpers
-    glm::mat4 s7 = ScaleMatrix(1, 0.2, 0.2);
-    glm::mat4 t7 = TranslateMatrix(-0.5, -0.2, 1.8);
-    rm.Render(RenderManager::CUBE, modelSoFar*t7*s7);
-    glm::mat4 t8 = TranslateMatrix(-0.5, -0.2, 0);
-    rm.Render(RenderManager::CUBE, modelSoFar*t8*s7);
+  private:
+    static const int    numBins  = 1000;
+    static const double binWidth; // seconds
 
-    // wheel wells
-    glm::mat4 s9 = ScaleMatrix(1, 0.3, 0.1);
-    glm::mat4 t9 = TranslateMatrix(-0.5, -0.13, 0.05);
-    glm::mat4 r9 = RotateMatrix(45, 1, 0, 0);
-    rm.Render(RenderManager::CUBE, modelSoFar*t9*r9*s9);
-    glm::mat4 t10 = TranslateMatrix(-0.5, -0.13, 1.15);
-    rm.Render(RenderManager::CUBE, modelSoFar*t10*r9*s9);
-    glm::mat4 r11 = RotateMatrix(-45, 1, 0, 0);
-    glm::mat4 t11 = TranslateMatrix(-0.5, -0.2, 0.8);
-    rm.Render(RenderManager::CUBE, modelSoFar*t11*r11*s9);
-    glm::mat4 t12 = TranslateMatrix(-0.5, -0.2, 1.9);
-    rm.Render(RenderManager::CUBE, modelSoFar*t12*r11*s9);
+    unsigned int bins[numBins + 1];
+    unsigned int count;
+    double       max;
+};
 
-    // upper car body
-    glm::mat4 s13 = ScaleMatrix(1, 0.5, 0.9);
-    glm::mat4 t13 = TranslateMatrix(-0.5, 0, 0.6);
-    rm.Render(RenderManager::CUBE, modelSoFar*t13*s13);
-    // back side
-    glm::mat4 s14 = ScaleMatrix(1, 0.4, 0.2);
-    glm::mat4 t14 = TranslateMatrix(-0.5, 0.13, 0.44);
-    glm::mat4 r14 = RotateMatrix(20, 1, 0, 0);
-    rm.Render(RenderManager::CUBE, modelSoFar*t14*r14*s14);
-    // front side
-    glm::mat4 t15 = TranslateMatrix(-0.5, 0.06, 1.45);
-    glm::mat4 r15 = RotateMatrix(-20, 1, 0, 0);
-    rm.Render(RenderManager::CUBE, modelSoFar*t15*r15*s14);
-    // trunk
-    glm::mat4 s20 = ScaleMatrix(1, 0.12, 0.7);
-    glm::mat4 r20 = RotateMatrix(-10, 1, 0, 0);
-    glm::mat4 t20 = TranslateMatrix(-0.5, -0.06, 0.02);
-    rm.Render(RenderManager::CUBE, modelSoFar*t20*r20*s20);
-    // hood
-    glm::mat4 r21 = RotateMatrix(10, 1, 0, 0);
-    glm::mat4 t21 = TranslateMatrix(-0.5, 0.07, 1.29);
-    rm.Render(RenderManager::CUBE, modelSoFar*t21*r21*s20);
+const double FrameTimeHistogram::binWidth = 0.00025;
 
-    // windows
-    rm.SetColor(0, 0, 0);
-    // back
-    glm::mat4 s16 = ScaleMatrix(0.8, 0.3, 0.2);
-    glm::mat4 t16 = TranslateMatrix(-0.4, 0.19, 0.45);
-    rm.Render(RenderManager::CUBE, modelSoFar*t16*r14*s16);
-    // front
-    glm::mat4 t17 = TranslateMatrix(-0.4, 0.12, 1.43);
-    rm.Render(RenderManager::CUBE, modelSoFar*t17*r15*s16);
-    // front side
-    glm::mat4 s18 = ScaleMatrix(1.02, 0.3, 0.35);
-    glm::mat4 t18 = TranslateMatrix(-0.51, 0.15, 1.07);
-    rm.Render(RenderManager::CUBE, modelSoFar*t18*s18);
-    // back side
-    glm::mat4 t19 = TranslateMatrix(-0.51, 0.15, 0.64);
-    rm.Render(RenderManager::CUBE, modelSoFar*t19*s18);
+void FrameTimeHistogram::Clear()
+{
+    memset(bins, 0, sizeof(bins));
+    count = 0;
+    max = 0.0;
+}
 
-    // wheels
-    glm::mat4 s2 = ScaleMatrix(0.2, 0.2, 0.2);
-    glm::mat4 r2 = RotateMatrix(90, 0, 1, 0);
-    glm::mat4 t2 = TranslateMatrix(0.4, -0.2, 0.45);
-    glm::mat4 t4 = TranslateMatrix(-0.5, -0.2, 0.45);
-    glm::mat4 t3 = TranslateMatrix(0.4, -0.2, 1.55);
-    glm::mat4 t5 = TranslateMatrix(-0.5, -0.2, 1.55);
-    SetUpWheel(modelSoFar*t2*r2*s2, rm);
-    SetUpWheel(modelSoFar*t3*r2*s2, rm);
-    SetUpWheel(modelSoFar*t4*r2*s2, rm);
-    SetUpWheel(modelSoFar*t5*r2*s2, rm);
+void FrameTimeHistogram::Add(double seconds)
+{
+    int bin = (int) (seconds / binWidth);
+    if (bin < 0)
+        bin = 0;
+    if (bin > numBins)
+        bin = numBins;
+    bins[bin]++;
+    count++;
+    max = fmax(max, seconds);
+}
 
-    // taillights
-    rm.SetColor(0.784, 0, 0);
-    glm::mat4 s22 = ScaleMatrix(0.06, 0.09, 0.02);
-    glm::mat4 t22a = TranslateMatrix(-0.4, -0.07, 0);
-    rm.Render(RenderManager::SPHERE, modelSoFar*t22a*s22);
-    glm::mat4 t22b = TranslateMatrix(-0.25, -0.07, 0);
-    rm.Render(RenderManager::SPHERE, modelSoFar*t22b*s22);
-    glm::mat4 t23a = TranslateMatrix(0.4, -0.07, 0);
-    rm.Render(RenderManager::SPHERE, modelSoFar*t23a*s22);
-    glm::mat4 t23b = TranslateMatrix(0.25, -0.07, 0);
-    rm.Render(RenderManager::SPHERE, modelSoFar*t23b*s22);
+// p is in the range [0, 100]; returns the upper edge of the matching bin
+double FrameTimeHistogram::Percentile(double p)
+{
+    if (count == 0)
+        return 0.0;
+    unsigned int target = (unsigned int) ceil(p / 100.0 * count);
+    unsigned int seen = 0;
+    for (int i = 0; i < numBins; i++) {
+        seen += bins[i];
+        if (seen >= target && seen > 0)
+            return fmin((i + 1) * binWidth, max);
+    }
+    return max;
+}
 
-    // headlights
-    rm.SetColor(1, 1, 1);
-    glm::mat4 s24 = ScaleMatrix(0.1, 0.1, 0.02);
-    glm::mat4 t24 = TranslateMatrix(-0.33, -0.07, 1.99);
-    rm.Render(RenderManager::SPHERE, modelSoFar*t24*s24);
-    glm::mat4 t25 = TranslateMatrix(0.33, -0.07, 1.99);
-    rm.Render(RenderManager::SPHERE, modelSoFar*t25*s24);
+// a stutter is a frame that took more than twice the median frame time
+int FrameTimeHistogram::StutterCount()
+{
+    int firstBin = (int) (2.0 * Percentile(50) / binWidth) + 1;
+    int stutters = 0;
+    for (int i = firstBin; i <= numBins; i++)
+        stutters += bins[i];
+    return stutters;
 }
 
-void SetUpTree(glm::mat4 modelSoFar, RenderManager &rm) {
-    rm.SetColor(0.517, 0.270, 0);
+void FrameTimeHistogram::Print()
+{
+    if (count == 0)
+        return;
+    cerr << "Frame times (ms): p50 " << Percentile(50)*1000.0
+         << "  p95 " << Percentile(95)*1000.0
+         << "  p99 " << Percentile(99)*1000.0
+         << "  max " << max*1000.0
+         << "  stutters " << StutterCount() << "/" << count << "\n\n";
+}
 
-    // main trunk
-    glm::mat4 scaleTrunk = ScaleMatrix(0.15, 0.15, 3);
-    glm::mat4 rotateTrunk = RotateMatrix(90, 1, 0, 0);
-    glm::mat4 rotateTrunk2 = RotateMatrix(180, 0, 0, 1);
-    glm::mat4 translateTrunk = TranslateMatrix(0, 0, -3.0);
-    rm.Render(RenderManager::CYLINDER, modelSoFar*rotateTrunk*rotateTrunk2*translateTrunk*scaleTrunk);
+class TelemetryWriter
+{
+  public:
+                 TelemetryWriter();
+                ~TelemetryWriter();
+    bool         Start(const char *filename);
+    void         Push(const TelemetryRecord &);
+    void         Stop();
+    unsigned int GetDropped() { return dropped; };
 
-    // middle branches
-    glm::mat4 s1 = ScaleMatrix(0.05, 0.05, 0.7);
-    glm::mat4 t1 = TranslateMatrix(0, 1.5, -0.3);
-    rm.Render(RenderManager::CYLINDER, modelSoFar*t1*s1);
-    glm::mat4 s2 = ScaleMatrix(0.03, 0.03, 0.4);
-    glm::mat4 t2 = TranslateMatrix(0, 1.5, 0.4);
-    glm::mat4 r2 = RotateMatrix(-45, 1, 0, 0);
-    rm.Render(RenderManager::CYLINDER, modelSoFar*t2*r2*s2);
+  private:
+    static const unsigned int ringSize  = 4096;
+    static const unsigned int batchSize = 256;
+
+    SPSCRing<TelemetryRecord, ringSize> ring;
+    std::thread       thread;
+    std::atomic<bool> running;
+    unsigned int      dropped;   // only touched by the game thread
+    FILE             *file;
+    bool              csv;
+    int               lastScore;
+    FrameTimeHistogram frameTimes; // for the current game, only touched by the writer
+
+    void WriterLoop();
+    void WriteBatch(TelemetryRecord *, int);
+    void Echo(const TelemetryRecord &);
+};
 
-    // upper branches
-    glm::mat4 s3 = ScaleMatrix(0.05, 0.05, 0.5);
-    glm::mat4 t3 = TranslateMatrix(0, 2.2, 0);
-    glm::mat4 r3a = RotateMatrix(20, 1, 0, 0);
-    glm::mat4 r3b = RotateMatrix(160, 0, 1, 0);
-    rm.Render(RenderManager::CYLINDER, modelSoFar*t3*r3a*r3b*s3);
-    glm::mat4 s4 = ScaleMatrix(0.05, 0.05, 0.5);
-    glm::mat4 t4 = TranslateMatrix(0.15, 2.35, -0.42);
-    glm::mat4 r4 = RotateMatrix(-110, 1, 0, 0);
-    rm.Render(RenderManager::CYLINDER, modelSoFar*t4*r4*s4);
+TelemetryWriter::TelemetryWriter()
+{
+    running = false;
+    dropped = 0;
+    file = NULL;
+    csv = false;
+    lastScore = 0;
+}
 
-    // leaves
-    rm.SetColor(0.027, 0.611, 0);
-    glm::mat4 s5 = ScaleMatrix(1.2, 0.5, 1.2);
-    glm::mat4 t5 = TranslateMatrix(0, 3.5, 0);
-    rm.Render(RenderManager::SPHERE, modelSoFar*t5*s5);
-    glm::mat4 s6 = ScaleMatrix(0.7, 0.3, 0.7);
-    glm::mat4 t6 = TranslateMatrix(0, 2, 0.8);
-    rm.Render(RenderManager::SPHERE, modelSoFar*t6*s6);
-    glm::mat4 s7 = ScaleMatrix(0.7, 0.3, 0.7);
-    glm::mat4 t7 = TranslateMatrix(0, 2.9, -0.9);
-    rm.Render(RenderManager::SPHERE, modelSoFar*t7*s7);
+TelemetryWriter::~TelemetryWriter()
+{
+    Stop();
 }
 
-void SetUpGround(glm::mat4 modelSoFar, RenderManager &rm, GameObject ground) {
-    // road
-    rm.SetColor(0.286, 0.286, 0.286); // dark grey
-    glm::mat4 rTranslate = TranslateMatrix(ground.position[0]-2.25, ground.position[1]-6.0, ground.position[2]-1.0);
-    glm::mat4 rScale = ScaleMatrix(4.5, 0.5, 10.0);
-    rm.Render(RenderManager::CUBE, modelSoFar*rTranslate*rScale);
+// filename may be NULL, in which case only the terminal echo runs.
+// Files ending in ".csv" are written as text, anything else as packed
+// binary records preceded by a small header.
+bool TelemetryWriter::Start(const char *filename)
+{
+    if (filename != NULL) {
+        size_t len = strlen(filename);
+        csv = len > 4 && strcmp(filename + len - 4, ".csv") == 0;
+        file = fopen(filename, csv ? "w" : "wb");
+        if (file == NULL) {
+            fprintf(stderr, "ERROR: could not open telemetry file %s\n", filename);
+            return false;
+        }
+        if (csv) {
+            fprintf(file, "frame,frame_time,score,forward_speed,collisions,draw_calls,culled,flags,ticks,allocations\n");
+        }
+        else {
+            uint32_t header[3] = { 0x4c455447 /* "GTEL" */, 3, sizeof(TelemetryRecord) };
+            fwrite(header, sizeof(header), 1, file);
+        }
+    }
+    running = true;
+    thread = std::thread(&TelemetryWriter::WriterLoop, this);
+    return true;
+}
 
-    // grass
-    rm.SetColor(0.031, 0.749, 0); // green
-    glm::mat4 g1t = TranslateMatrix(ground.position[0]-7.25, ground.position[1]-5.8, ground.position[2]-1.0);
-    glm::mat4 g1s = ScaleMatrix(5.0, 0.5, 10.0);
-    rm.Render(RenderManager::CUBE, modelSoFar*g1t*g1s);
-    glm::mat4 g2t = TranslateMatrix(ground.position[0]+2.25, ground.position[1]-5.8, ground.position[2]-1.0);
-    glm::mat4 g2s = ScaleMatrix(5.0, 0.5, 10.0);
-    rm.Render(RenderManager::CUBE, modelSoFar*g2t*g2s);
+void TelemetryWriter::Push(const TelemetryRecord &rec)
+{
+    if (ring.Push(rec))
+        return;
+    if (rec.flags & (TELEMETRY_NEW_GAME | TELEMETRY_GAME_OVER)) {
+        // the echo needs these, so wait for the writer to make room
+        while (!ring.Push(rec))
+            std::this_thread::yield();
+    }
+    else
+        dropped++;
+}
 
-    // road lane markings
-    rm.SetColor(1, 0.913, 0); // yellow
-    glm::mat4 laneScale = ScaleMatrix(0.15, 0.5, 1.5);
-    for (int i = 0; i < 2; i++) {
-        glm::mat4 lt1 = TranslateMatrix(ground.position[0]-0.8, ground.position[1]-5.99, ground.position[2]-1.0+5.0*i);
-        rm.Render(RenderManager::CUBE, modelSoFar*lt1*laneScale);
-        glm::mat4 lt2 = TranslateMatrix(ground.position[0]+0.65, ground.position[1]-5.99, ground.position[2]-1.0+5.0*i);
-        rm.Render(RenderManager::CUBE, modelSoFar*lt2*laneScale);
+void TelemetryWriter::Stop()
+{
+    if (!running)
+        return;
+    running = false;
+    thread.join();
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+void TelemetryWriter::WriterLoop()
+{
+    TelemetryRecord batch[batchSize];
+    while (true) {
+        // read the flag before draining so nothing pushed before Stop() is lost
+        bool keepRunning = running;
+        int n = 0;
+        while (n < (int)batchSize && ring.Pop(batch[n]))
+            n++;
+        if (n > 0)
+            WriteBatch(batch, n);
+        if (n == (int)batchSize)
+            continue;
+        if (!keepRunning)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
+}
 
-    // fence beams
-    rm.SetColor(0.823, 0.615, 0.172); // light brown
-    glm::mat4 beamScale = ScaleMatrix(0.05, 0.05, 10.0);
-    for (int i = 0; i < 2; i++) {
-        glm::mat4 bt1 = TranslateMatrix(ground.position[0]-2.7, ground.position[1]-5.0+i*0.3, ground.position[2]-1.0);
-        rm.Render(RenderManager::CYLINDER, modelSoFar*bt1*beamScale);
-        glm::mat4 bt2 = TranslateMatrix(ground.position[0]+2.7, ground.position[1]-5.0+i*0.3, ground.position[2]-1.0);
-        rm.Render(RenderManager::CYLINDER, modelSoFar*bt2*beamScale);
+void TelemetryWriter::WriteBatch(TelemetryRecord *recs, int n)
+{
+    for (int i = 0; i < n; i++)
+        Echo(recs[i]);
+
+    if (file == NULL)
+        return;
+    if (csv) {
+        for (int i = 0; i < n; i++) {
+            fprintf(file, "%u,%.6f,%d,%.4f,%u,%u,%u,%u,%u,%u\n", recs[i].frame, recs[i].frameTime,
+                    recs[i].score, recs[i].forwardSpeed, recs[i].collisions,
+                    recs[i].drawCalls, recs[i].culled, recs[i].flags, recs[i].ticks,
+                    recs[i].allocations);
+        }
     }
-    
-    // fence poles
-    rm.SetColor(0.6, 0.388, 0); // brown
-    glm::mat4 poleScale = ScaleMatrix(0.1, 0.6, 0.1);
-    for (int i = 0; i < 5; i++) {
-        glm::mat4 pt1 = TranslateMatrix(ground.position[0]-2.75, ground.position[1]-5.2, ground.position[2]-1.1+i*2.0);
-        rm.Render(RenderManager::CUBE, modelSoFar*pt1*poleScale);
-        glm::mat4 pt2 = TranslateMatrix(ground.position[0]+2.65, ground.position[1]-5.2, ground.position[2]-1.1+i*2.0);
-        rm.Render(RenderManager::CUBE, modelSoFar*pt2*poleScale);
+    else {
+        fwrite(recs, sizeof(TelemetryRecord), n, file);
     }
+}
 
-    // trees
-    glm::mat4 treeScale = ScaleMatrix(0.7, 0.7, 0.7);
-    glm::mat4 treeTrans = TranslateMatrix(ground.position[0] + 3.5, ground.position[1]-5.0, ground.position[2]);
-    glm::mat4 treeRotate = RotateMatrix(90, 0, 1, 0);
-    SetUpTree(modelSoFar*treeTrans*treeRotate*treeScale, rm);
-    glm::mat4 treeTrans2 = TranslateMatrix(ground.position[0] - 3.5, ground.position[1]-5.0, ground.position[2] + 5.0);
-    SetUpTree(modelSoFar*treeTrans2*treeRotate*treeScale, rm);
+void TelemetryWriter::Echo(const TelemetryRecord &rec)
+{
+    if (rec.flags & TELEMETRY_NEW_GAME) {
+        cerr << "\n\n----------------------------------------\n";
+        lastScore = 0;
+        frameTimes.Clear();
+    }
+    else {
+        frameTimes.Add(rec.frameTime);
+    }
+    if (rec.score != lastScore) {
+        cerr << "\rScore: " << rec.score << "\t\t\t";
+        lastScore = rec.score;
+    }
+    if (rec.flags & TELEMETRY_GAME_OVER) {
+        cerr << "\rFinal score: " << rec.score << "\t\t\t\n\n";
+        frameTimes.Print();
+        cerr << "- Press SPACE to play again!\n";
+        cerr << "- Close the window to exit.\n";
+    }
+}
+
+//
+// Live metrics endpoint. A server thread drains its ring into a rolling
+// window of the last frames and answers each connection, on a Unix domain
+// socket or a TCP port on 127.0.0.1, with a text snapshot of one
+// "name value" line per counter, so a running game can be watched with
+// nc, socat or curl. Clients that send an HTTP GET get an HTTP response.
+// The frame loop only pushes a record; the counters are only ever touched
+// by the server thread.
+//
+class MetricsServer
+{
+  public:
+                 MetricsServer();
+                ~MetricsServer();
+    bool         Start(const char *address); // a TCP port number, anything else is a socket path
+    void         Push(const TelemetryRecord &);
+    void         Stop();
+
+  private:
+    static const unsigned int ringSize   = 4096;
+    static const int          windowSize = 600; // frames, 10 seconds at 60 fps
+
+    SPSCRing<TelemetryRecord, ringSize> ring;
+    std::thread           thread;
+    std::atomic<bool>     running;
+    std::atomic<uint32_t> dropped;  // only written by the game thread
+    int                   listenFd;
+    std::string           socketPath; // removed again by Stop, empty for TCP
+
+    // only touched by the server thread
+    TelemetryRecord window[windowSize];
+    uint64_t        frames;
+    uint64_t        allocations;
+
+    void ServerLoop();
+    void Answer(int client);
+    void Snapshot(std::string &text);
+};
 
+MetricsServer::MetricsServer()
+{
+    running = false;
+    dropped = 0;
+    listenFd = -1;
+    frames = 0;
+    allocations = 0;
 }
 
-void SetUpGame(int counter, RenderManager &rm, GameObject mpCar,
-               std::vector<GameObject> cars, std::vector<GameObject> grounds)
+MetricsServer::~MetricsServer()
 {
-    glm::mat4 identity(1.0f);
-    glm::mat4 roadTrans = TranslateMatrix(0, 0.5, 0);
+    Stop();
+}
 
-    double var = (counter%10)/9.0; // oscillates between 0 and 1
-    if ((counter/10 % 2) == 1)
-       var=1-var; 
+bool MetricsServer::Start(const char *address)
+{
+#ifdef HAVE_SOCKETS
+    char *end;
+    long port = strtol(address, &end, 10);
+    bool tcp = *address != '\0' && *end == '\0';
+    if (tcp) {
+        listenFd = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenFd < 0) {
+            fprintf(stderr, "ERROR: could not serve metrics on port %s\n", address);
+            return false;
+        }
+        int one = 1;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(port);
+        if (port < 0 || port > 65535 || bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "ERROR: could not serve metrics on port %s\n", address);
+            close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(listenFd, (struct sockaddr *) &addr, &len); // port 0 picks a free one
+        port = ntohs(addr.sin_port);
+    }
+    else {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "ERROR: metrics socket path %s is too long\n", address);
+            return false;
+        }
+        strcpy(addr.sun_path, address);
+        // replace a socket left behind by an earlier run, but nothing else
+        struct stat st;
+        if (stat(address, &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(address);
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0) {
+            fprintf(stderr, "ERROR: could not create metrics socket %s\n", address);
+            return false;
+        }
+        if (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+            fprintf(stderr, "ERROR: could not create metrics socket %s\n", address);
+            close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+    }
+    if (listen(listenFd, 8) != 0) {
+        fprintf(stderr, "ERROR: could not listen for metrics on %s\n", address);
+        close(listenFd);
+        listenFd = -1;
+        if (!tcp)
+            unlink(address);
+        return false;
+    }
+    if (!tcp)
+        socketPath = address;
+    if (tcp)
+        fprintf(stderr, "Metrics: serving on http://127.0.0.1:%ld/\n", port);
+    else
+        fprintf(stderr, "Metrics: serving on %s\n", address);
+    running = true;
+    thread = std::thread(&MetricsServer::ServerLoop, this);
+    return true;
+#else
+    fprintf(stderr, "ERROR: --metrics needs sockets, which this build doesn't have\n");
+    return false;
+#endif
+}
+
+// called by the game thread; does nothing unless Start succeeded
+void MetricsServer::Push(const TelemetryRecord &rec)
+{
+    if (listenFd < 0)
+        return;
+    if (!ring.Push(rec))
+        dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void MetricsServer::Stop()
+{
+    if (!running)
+        return;
+    running = false;
+    thread.join();
+#ifdef HAVE_SOCKETS
+    close(listenFd);
+    listenFd = -1;
+    if (!socketPath.empty())
+        unlink(socketPath.c_str());
+#endif
+}
+
+void MetricsServer::ServerLoop()
+{
+#ifdef HAVE_SOCKETS
+    while (running) {
+        TelemetryRecord rec;
+        while (ring.Pop(rec)) {
+            window[frames % windowSize] = rec;
+            frames++;
+            allocations += rec.allocations;
+        }
+        // wake up as often as the telemetry writer does
+        struct pollfd p = {listenFd, POLLIN, 0};
+        if (poll(&p, 1, 10) > 0 && (p.revents & POLLIN)) {
+            int client = accept(listenFd, NULL, NULL);
+            if (client >= 0) {
+                Answer(client);
+                close(client);
+            }
+        }
+    }
+#endif
+}
+
+void MetricsServer::Answer(int client)
+{
+#ifdef HAVE_SOCKETS
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    // give an HTTP client a moment to send its request; nc sends nothing
+    char request[1024];
+    int received = 0;
+    struct pollfd p = {client, POLLIN, 0};
+    if (poll(&p, 1, 100) > 0 && (p.revents & POLLIN))
+        received = recv(client, request, sizeof(request) - 1, 0);
+    bool http = received >= 4 && memcmp(request, "GET ", 4) == 0;
+
+    std::string body;
+    Snapshot(body);
+    std::string reply;
+    if (http) {
+        char header[128];
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %u\r\n\r\n", (unsigned int) body.size());
+        reply = header;
+    }
+    reply += body;
+    for (size_t sent = 0; sent < reply.size(); ) {
+        ssize_t n = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+#endif
+}
+
+void MetricsServer::Snapshot(std::string &text)
+{
+    int n = frames < windowSize ? frames : windowSize;
+    float times[windowSize];
+    double seconds = 0.0, ticks = 0.0, draws = 0.0, culled = 0.0, allocs = 0.0;
+    uint32_t maxAllocs = 0;
+    for (int i = 0; i < n; i++) {
+        const TelemetryRecord &r = window[i];
+        times[i] = r.frameTime;
+        seconds += r.frameTime;
+        ticks += r.ticks;
+        draws += r.drawCalls;
+        culled += r.culled;
+        allocs += r.allocations;
+        maxAllocs = r.allocations > maxAllocs ? r.allocations : maxAllocs;
+    }
+    std::sort(times, times + n);
+    const double quantiles[3] = {0.5, 0.95, 0.99};
+    double frameMs[3] = {0.0, 0.0, 0.0};
+    for (int q = 0; q < 3 && n > 0; q++)
+        frameMs[q] = times[(int) fmin(n - 1, ceil(quantiles[q] * n) - 1)] * 1000.0;
+    const TelemetryRecord *last = n > 0 ? &window[(frames - 1) % windowSize] : NULL;
+
+    char buf[2048];
+    int len = snprintf(buf, sizeof(buf),
+        "# averages and quantiles are over the last %d frames\n"
+        "game_frames_total %llu\n"
+        "game_frame_time_ms{quantile=\"0.5\"} %.3f\n"
+        "game_frame_time_ms{quantile=\"0.95\"} %.3f\n"
+        "game_frame_time_ms{quantile=\"0.99\"} %.3f\n"
+        "game_frame_time_ms_max %.3f\n"
+        "game_fps %.1f\n"
+        "game_tick_rate_hz %.1f\n"
+        "game_draw_calls %.1f\n"
+        "game_culled %.1f\n"
+        "game_allocations_per_frame %.2f\n"
+        "game_allocations_per_frame_max %u\n"
+        "game_allocations_total %llu\n"
+        "game_score %d\n"
+        "game_forward_speed %.3f\n"
+        "game_metrics_dropped_total %u\n",
+        n, (unsigned long long) frames, frameMs[0], frameMs[1], frameMs[2],
+        n > 0 ? times[n - 1] * 1000.0 : 0.0,
+        seconds > 0.0 ? n / seconds : 0.0,
+        seconds > 0.0 ? ticks / seconds : 0.0,
+        n > 0 ? draws / n : 0.0,
+        n > 0 ? culled / n : 0.0,
+        n > 0 ? allocs / n : 0.0,
+        maxAllocs, (unsigned long long) allocations,
+        last ? last->score : 0, last ? last->forwardSpeed : 0.0,
+        dropped.load(std::memory_order_relaxed));
+    if (len < 0)
+        len = 0;
+    if (len > (int) sizeof(buf) - 1)
+        len = sizeof(buf) - 1; // snprintf's length is what it would have written
+    text.assign(buf, len);
+}
+
+
+//
+// Input module
+//
+// Key presses are delivered by a GLFW key callback, stamped with the time
+// they were received and queued, so taps that start and end between two
+// frames are never lost. The simulation drains the queue once per tick.
+// Synthetic events can be pushed into the same queue, either directly or
+// from an input script, to drive the game without a keyboard.
+//
+
+enum InputAction
+{
+    INPUT_LEFT,
+    INPUT_RIGHT,
+    INPUT_RESTART
+};
+
+struct InputEvent
+{
+    InputAction action;
+    int         player; // 0 for the first player
+    double      time;   // glfwGetTime() when the event was received
+};
+
+class InputQueue
+{
+  public:
+    void Push(InputAction action, double time, int player = 0);
+    bool Pop(InputEvent &ev) { return ring.Pop(ev); };
+
+  private:
+    SPSCRing<InputEvent, 256> ring;
+};
+
+void InputQueue::Push(InputAction action, double time, int player)
+{
+    InputEvent ev;
+    ev.action = action;
+    ev.player = player;
+    ev.time = time;
+    ring.Push(ev); // a full queue means 256 unconsumed presses, drop the rest
+}
+
+void KeyCallback(GLFWwindow *window, int key, int scancode, int action, int mods)
+{
+    // GLFW has no event timestamps, so this is the time the event was polled
+    InputQueue *input = (InputQueue *) glfwGetWindowUserPointer(window);
+    if (input == NULL || action != GLFW_PRESS)
+        return;
+
+    // left and right keys of each split-screen player
+    static const int keys[4][2] = {{GLFW_KEY_LEFT, GLFW_KEY_RIGHT},
+                                   {GLFW_KEY_A, GLFW_KEY_D},
+                                   {GLFW_KEY_J, GLFW_KEY_L},
+                                   {GLFW_KEY_KP_4, GLFW_KEY_KP_6}};
+    for (int p = 0; p < 4; p++) {
+        if (key == keys[p][0])
+            input->Push(INPUT_LEFT, glfwGetTime(), p);
+        else if (key == keys[p][1])
+            input->Push(INPUT_RIGHT, glfwGetTime(), p);
+    }
+    if (key == GLFW_KEY_SPACE)
+        input->Push(INPUT_RESTART, glfwGetTime());
+}
+
+//
+// An input script is a text file with one "<tick> <left|right|restart> [player]"
+// entry per line, played back into an InputQueue as the ticks come up.
+// Players are numbered from 1; the default is the first player.
+// Ticks count from the start of the program and are not reset by a restart.
+//
+class InputScript
+{
+  public:
+    InputScript() : next(0) { }
+    bool Load(const char *filename);
+    void Inject(int tick, InputQueue &, double time);
+    bool Finished() { return next >= entries.size(); };
+
+  private:
+    struct Entry
+    {
+        int         tick;
+        InputAction action;
+        int         player;
+    };
+    std::vector<Entry> entries;
+    unsigned int       next;
+};
+
+bool InputScript::Load(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open input script %s\n", filename);
+        return false;
+    }
+    int tick, player;
+    char name[32];
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        player = 1;
+        if (sscanf(line, "%d %31s %d", &tick, name, &player) < 2)
+            continue;
+        if (player < 1) {
+            fprintf(stderr, "ERROR: bad player number %d in input script %s\n", player, filename);
+            fclose(f);
+            return false;
+        }
+        Entry e;
+        e.tick = tick;
+        e.player = player - 1;
+        if (strcmp(name, "left") == 0)
+            e.action = INPUT_LEFT;
+        else if (strcmp(name, "right") == 0)
+            e.action = INPUT_RIGHT;
+        else if (strcmp(name, "restart") == 0)
+            e.action = INPUT_RESTART;
+        else {
+            fprintf(stderr, "ERROR: unknown action \"%s\" in input script %s\n", name, filename);
+            fclose(f);
+            return false;
+        }
+        entries.push_back(e);
+    }
+    fclose(f);
+    return true;
+}
+
+void InputScript::Inject(int tick, InputQueue &input, double time)
+{
+    while (next < entries.size() && entries[next].tick <= tick) {
+        input.Push(entries[next].action, time, entries[next].player);
+        next++;
+    }
+}
+
+//
+// Collects latency samples (in seconds) and reports percentiles.
+//
+class LatencyStats
+{
+  public:
+    LatencyStats() { samples.reserve(4096); }
+    void   Add(double seconds) { samples.push_back(seconds); };
+    int    Count() { return samples.size(); };
+    double Percentile(double p);
+    void   Print(const char *name);
+
+  private:
+    std::vector<double> samples;
+};
+
+// p is in the range [0, 100]
+double LatencyStats::Percentile(double p)
+{
+    if (samples.empty())
+        return 0.0;
+    std::vector<double> sorted(samples);
+    size_t idx = (size_t) (p / 100.0 * (sorted.size() - 1) + 0.5);
+    std::nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+    return sorted[idx];
+}
+
+void LatencyStats::Print(const char *name)
+{
+    if (samples.empty())
+        return;
+    fprintf(stderr, "%s (ms, %d samples): p50 %.2f  p95 %.2f  p99 %.2f  max %.2f\n",
+            name, Count(), Percentile(50)*1000.0, Percentile(95)*1000.0,
+            Percentile(99)*1000.0, Percentile(100)*1000.0);
+}
+
+//
+// Frame pacing module
+//
+// Rendering runs once per frame at whatever rate the pacing mode allows,
+// while the simulation always advances in fixed ticks (see --tick-rate),
+// so the game plays at the same speed regardless of the frame rate.
+//
+
+enum PacingMode
+{
+    PACING_UNCAPPED,  // swap as fast as possible
+    PACING_VSYNC,     // wait for the vertical blank
+    PACING_FIXED,     // hold a target frame rate by sleeping, then spinning
+    PACING_ADAPTIVE   // vsync, but swap immediately (tear) when a frame is late
+};
+
+class FramePacer
+{
+  public:
+                FramePacer(PacingMode, double targetFps);
+    void        Start();
+    void        WaitForNextFrame();
+    const char *GetModeName();
+
+  private:
+    // sleep_for can overshoot by a scheduler quantum, so stop sleeping
+    // this long before the deadline and spin for the remainder
+    static const double spinMargin;
+
+    PacingMode mode;
+    double     period;
+    double     nextDeadline;
+};
+
+const double FramePacer::spinMargin = 0.002;
+
+FramePacer::FramePacer(PacingMode m, double targetFps)
+{
+    mode = m;
+    period = 1.0 / targetFps;
+    nextDeadline = 0.0;
+}
+
+// must be called once the GL context is current
+void FramePacer::Start()
+{
+    if (mode == PACING_VSYNC) {
+        glfwSwapInterval(1);
+    }
+    else if (mode == PACING_ADAPTIVE) {
+        if (glfwExtensionSupported("WGL_EXT_swap_control_tear") ||
+            glfwExtensionSupported("GLX_EXT_swap_control_tear")) {
+            glfwSwapInterval(-1);
+        }
+        else {
+            fprintf(stderr, "Adaptive vsync is not supported, using vsync\n");
+            glfwSwapInterval(1);
+        }
+    }
+    else {
+        glfwSwapInterval(0);
+    }
+    nextDeadline = glfwGetTime() + period;
+}
+
+// call right before glfwSwapBuffers
+void FramePacer::WaitForNextFrame()
+{
+    if (mode != PACING_FIXED)
+        return;
+
+    double now = glfwGetTime();
+    if (now > nextDeadline) {
+        // the frame was late; start the schedule over rather than rushing
+        // the following frames to catch up
+        nextDeadline = now + period;
+        return;
+    }
+    double sleepTime = nextDeadline - now - spinMargin;
+    if (sleepTime > 0.0)
+        std::this_thread::sleep_for(std::chrono::duration<double>(sleepTime));
+    while (glfwGetTime() < nextDeadline)
+        ;
+    nextDeadline += period;
+}
+
+const char *FramePacer::GetModeName()
+{
+    switch (mode) {
+        case PACING_UNCAPPED: return "uncapped";
+        case PACING_VSYNC:    return "vsync";
+        case PACING_FIXED:    return "fixed";
+        case PACING_ADAPTIVE: return "adaptive";
+    }
+    return "unknown";
+}
+
+//
+// Splits wall-clock, process CPU and GPU time between the loop iterations
+// spent playing and those spent idle (game over, unfocused or minimized),
+// to show what the idle mode saves. CPU time is for all threads.
+//
+class UtilizationMeter
+{
+  public:
+         UtilizationMeter();
+    void Sample(bool idle, double gpuBusyTime, bool rendered);
+    void Print();
+
+  private:
+    struct Bucket
+    {
+        double wall, cpu, gpu;
+        int    iterations, frames;
+    };
+    Bucket  buckets[2];  // playing, idle
+    double  lastWall, lastGPU;
+    clock_t lastCPU;
+};
+
+UtilizationMeter::UtilizationMeter()
+{
+    memset(buckets, 0, sizeof(buckets));
+    lastWall = glfwGetTime();
+    lastCPU = clock();
+    lastGPU = 0.0;
+}
+
+// call once per loop iteration; idle describes the iteration just finished
+void UtilizationMeter::Sample(bool idle, double gpuBusyTime, bool rendered)
+{
+    double wall = glfwGetTime();
+    clock_t cpu = clock();
+    Bucket &b = buckets[idle ? 1 : 0];
+    b.wall += wall - lastWall;
+    b.cpu += (double)(cpu - lastCPU) / CLOCKS_PER_SEC;
+    b.gpu += gpuBusyTime - lastGPU; // timer results lag a few frames behind
+    b.iterations++;
+    b.frames += rendered ? 1 : 0;
+    lastWall = wall;
+    lastCPU = cpu;
+    lastGPU = gpuBusyTime;
+}
+
+void UtilizationMeter::Print()
+{
+    static const char *names[2] = {"playing", "idle"};
+    for (int i = 0; i < 2; i++) {
+        Bucket &b = buckets[i];
+        if (b.wall <= 0.0)
+            continue;
+        fprintf(stderr, "Utilization %-7s: %.1f s, CPU %.1f%%, GPU %.1f%%, %d frames drawn in %d iterations\n",
+                names[i], b.wall, 100.0 * b.cpu / b.wall, 100.0 * b.gpu / b.wall, b.frames, b.iterations);
+    }
+}
+
+
+//
+// Capture module
+//
+// Records gameplay without stalling the pipeline. Each frame is read into
+// one of a ring of pixel buffer objects and a fence is inserted after the
+// read; a buffer is only mapped once its fence has signalled, a few frames
+// later. If every buffer is still in flight the frame is skipped rather
+// than waited for. Mapped frames are copied out and handed to an encoder
+// thread that writes a raw Y4M stream or a numbered PNG sequence.
+//
+
+struct CapturedFrame
+{
+    int                  width, height;
+    std::vector<uint8_t> rgba;   // bottom row first, as GL returns it
+};
+
+class FrameCapture
+{
+  public:
+                FrameCapture();
+    bool        Start(const char *target, int width, int height, double fps);
+    void        Capture(float frameTime);  // call after the frame is drawn, before the swap
+    void        Stop();
+    void        PrintOverhead();
+
+  private:
+    static const int numPBOs = 3;
+    static const int numFrames = 8;  // copies queued for, or being written by, the encoder
+
+    bool        active;
+    bool        y4m;             // otherwise a PNG sequence
+    const char *target;          // .y4m file, or the prefix for PNG files
+    FILE       *file;
+    int         width, height;
+    GLuint      pbos[numPBOs];
+    GLsync      fences[numPBOs]; // 0 = buffer not in flight
+    int         nextPBO;         // buffer for the next read, pending ones follow it
+    int         pngIndex;
+
+    CapturedFrame                  frames[numFrames];
+    SPSCRing<CapturedFrame *, 16>  toEncoder;
+    SPSCRing<CapturedFrame *, 16>  freeFrames;
+    std::thread                    encoder;
+    std::atomic<bool>              running;
+
+    // overhead
+    unsigned int captured, skipped, dropped;
+    std::atomic<unsigned int> encoded;
+    double captureSeconds;       // main thread time spent in Capture()
+    double frameSeconds;         // total frame time while capturing
+    std::atomic<uint64_t> encodeMicros;
+
+    void CollectFinished(bool wait);
+    void EncoderLoop();
+    void WriteY4M(const CapturedFrame &);
+    void WritePNG(const CapturedFrame &);
+};
+
+FrameCapture::FrameCapture() : running(false), encoded(0), encodeMicros(0)
+{
+    active = false;
+    file = NULL;
+    captured = skipped = dropped = 0;
+    captureSeconds = frameSeconds = 0.0;
+}
+
+bool FrameCapture::Start(const char *t, int w, int h, double fps)
+{
+    if (t == NULL)
+        return true;
+    target = t;
+    width = w;
+    height = h;
+    size_t len = strlen(target);
+    y4m = len > 4 && strcmp(target + len - 4, ".y4m") == 0;
+    pngIndex = 0;
+    if (y4m) {
+        file = fopen(target, "wb");
+        if (file == NULL) {
+            fprintf(stderr, "ERROR: could not open capture file %s\n", target);
+            return false;
+        }
+        // 4:4:4 so no chroma has to be resampled
+        fprintf(file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, (int)(fps + 0.5));
+    }
+
+    glGenBuffers(numPBOs, pbos);
+    for (int i = 0; i < numPBOs; i++) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, NULL, GL_STREAM_READ);
+        fences[i] = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    nextPBO = 0;
+
+    for (int i = 0; i < numFrames; i++) {
+        frames[i].rgba.resize(width * height * 4);
+        freeFrames.Push(&frames[i]);
+    }
+    running = true;
+    encoder = std::thread(&FrameCapture::EncoderLoop, this);
+    active = true;
+    return true;
+}
+
+void FrameCapture::Capture(float frameTime)
+{
+    if (!active)
+        return;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    frameSeconds += frameTime;
+
+    CollectFinished(false);
+
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(glfwGetCurrentContext(), &fbWidth, &fbHeight);
+    if (fences[nextPBO] != 0 || fbWidth != width || fbHeight != height) {
+        // the GPU is behind (or the window was resized): skip, don't wait
+        skipped++;
+    }
+    else {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glReadBuffer(GL_BACK);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[nextPBO]);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        fences[nextPBO] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        nextPBO = (nextPBO + 1) % numPBOs;
+    }
+
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    captureSeconds += d.count();
+}
+
+// Maps the buffers whose reads have completed, oldest first, and queues
+// them for the encoder. Only blocks on the fences when wait is set.
+void FrameCapture::CollectFinished(bool wait)
+{
+    for (int i = 0; i < numPBOs; i++) {
+        int slot = (nextPBO + i) % numPBOs;
+        if (fences[slot] == 0)
+            continue;
+        GLenum status = glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                         wait ? 1000000000 : 0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+            break; // keep them in order
+        glDeleteSync(fences[slot]);
+        fences[slot] = 0;
+
+        CapturedFrame *frame;
+        if (!freeFrames.Pop(frame)) {
+            dropped++; // the encoder is falling behind
+            continue;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[slot]);
+        void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, width * height * 4, GL_MAP_READ_BIT);
+        if (pixels != NULL) {
+            frame->width = width;
+            frame->height = height;
+            memcpy(&frame->rgba[0], pixels, width * height * 4);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            toEncoder.Push(frame);
+            captured++;
+        }
+        else {
+            freeFrames.Push(frame);
+            dropped++;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+}
+
+void FrameCapture::Stop()
+{
+    if (!active)
+        return;
+    CollectFinished(true);
+    running = false;
+    encoder.join();
+    glDeleteBuffers(numPBOs, pbos);
+    if (file != NULL)
+        fclose(file);
+    file = NULL;
+    active = false;
+}
+
+void FrameCapture::PrintOverhead()
+{
+    if (captured + skipped + dropped == 0)
+        return;
+    unsigned int frames = captured + skipped + dropped;
+    double perFrame = captureSeconds / frames;
+    fprintf(stderr, "Capture: %u frames written to %s, %u skipped (GPU behind or resized), %u dropped (encoder behind)\n",
+            encoded.load(), target, skipped, dropped);
+    fprintf(stderr, "Capture: main thread %.3f ms/frame (%.1f%% of the %.2f ms average frame), encoder %.2f ms/frame\n",
+            perFrame * 1000.0, 100.0 * captureSeconds / fmax(frameSeconds, 1e-9),
+            frameSeconds / frames * 1000.0,
+            encoded > 0 ? encodeMicros / 1000.0 / encoded : 0.0);
+}
+
+void FrameCapture::EncoderLoop()
+{
+    while (true) {
+        // read the flag before draining so nothing queued before Stop() is lost
+        bool keepRunning = running;
+        CapturedFrame *frame;
+        bool any = false;
+        while (toEncoder.Pop(frame)) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (y4m)
+                WriteY4M(*frame);
+            else
+                WritePNG(*frame);
+            std::chrono::duration<double, std::micro> d = std::chrono::steady_clock::now() - start;
+            encodeMicros += (uint64_t) d.count();
+            encoded++;
+            freeFrames.Push(frame);
+            any = true;
+        }
+        if (!keepRunning)
+            break;
+        if (!any)
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+}
+
+// BT.601 studio range, rows flipped to top first
+void FrameCapture::WriteY4M(const CapturedFrame &f)
+{
+    std::vector<uint8_t> planes(f.width * f.height * 3);
+    uint8_t *yp = &planes[0];
+    uint8_t *up = yp + f.width * f.height;
+    uint8_t *vp = up + f.width * f.height;
+    for (int row = 0; row < f.height; row++) {
+        const uint8_t *src = &f.rgba[(f.height - 1 - row) * f.width * 4];
+        for (int x = 0; x < f.width; x++, src += 4) {
+            int r = src[0], g = src[1], b = src[2];
+            int i = row * f.width + x;
+            yp[i] = (uint8_t)((  66*r + 129*g +  25*b + 128) / 256 +  16);
+            up[i] = (uint8_t)(( -38*r -  74*g + 112*b + 128) / 256 + 128);
+            vp[i] = (uint8_t)(( 112*r -  94*g -  18*b + 128) / 256 + 128);
+        }
+    }
+    fputs("FRAME\n", file);
+    fwrite(&planes[0], 1, planes.size(), file);
+}
+
+static uint32_t Crc32(uint32_t crc, const uint8_t *data, size_t n)
+{
+    static uint32_t table[256];
+    static bool haveTable = false;
+    if (!haveTable) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        haveTable = true;
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void PutBE32(std::vector<uint8_t> &out, uint32_t v)
+{
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+static void WritePNGChunk(FILE *f, const char *type, const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> chunk;
+    PutBE32(chunk, data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    PutBE32(chunk, Crc32(0, &chunk[4], chunk.size() - 4));
+    fwrite(&chunk[0], 1, chunk.size(), f);
+}
+
+// 8-bit RGB, stored (uncompressed) deflate blocks: fast to write and needs
+// no compression library. rgba is bottom row first, as GL returns it.
+bool WritePNGFile(const char *name, int width, int height, const uint8_t *rgba)
+{
+    FILE *out = fopen(name, "wb");
+    if (out == NULL)
+        return false;
+
+    std::vector<uint8_t> raw;
+    raw.reserve(height * (1 + width * 3));
+    for (int row = 0; row < height; row++) {
+        const uint8_t *src = &rgba[(height - 1 - row) * width * 4];
+        raw.push_back(0); // no filter
+        for (int x = 0; x < width; x++, src += 4)
+            raw.insert(raw.end(), src, src + 3);
+    }
+
+    std::vector<uint8_t> zlib;
+    zlib.push_back(0x78);
+    zlib.push_back(0x01);
+    uint32_t a = 1, b = 0;
+    for (size_t pos = 0; pos < raw.size(); ) {
+        size_t n = std::min<size_t>(65535, raw.size() - pos);
+        zlib.push_back(pos + n == raw.size() ? 1 : 0);
+        zlib.push_back(n & 0xff);
+        zlib.push_back(n >> 8);
+        zlib.push_back(~n & 0xff);
+        zlib.push_back((~n >> 8) & 0xff);
+        zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + n);
+        for (size_t i = pos; i < pos + n; i++) {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        pos += n;
+    }
+    PutBE32(zlib, (b << 16) | a);
+
+    std::vector<uint8_t> header;
+    PutBE32(header, width);
+    PutBE32(header, height);
+    header.push_back(8); // bit depth
+    header.push_back(2); // RGB
+    header.push_back(0);
+    header.push_back(0);
+    header.push_back(0);
+
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    fwrite(signature, 1, sizeof(signature), out);
+    WritePNGChunk(out, "IHDR", header);
+    WritePNGChunk(out, "IDAT", zlib);
+    WritePNGChunk(out, "IEND", std::vector<uint8_t>());
+    fclose(out);
+    return true;
+}
+
+void FrameCapture::WritePNG(const CapturedFrame &f)
+{
+    char name[1024];
+    snprintf(name, sizeof(name), "%s%05d.png", target, pngIndex++);
+    WritePNGFile(name, f.width, f.height, &f.rgba[0]);
+}
+
+
+//
+// Software rasterizer module
+//
+// Draws the same frames as RenderManager entirely on the CPU, for machines
+// without a GPU and for image diffs. Draws are recorded like the GL path's
+// draw list. At EndFrame worker threads each take a share of the draws,
+// transform and light their vertices (always per vertex, as
+// GetVertexShader does), clip them against the near plane and bin the
+// triangles into screen tiles. Then the workers take tiles and rasterize
+// every triangle binned there, in draw order, four pixels at a time with
+// SSE2 where available, into an RGBA color buffer and a float depth
+// buffer. The workers are started once and wait for each pass.
+//
+class SoftwareRasterizer : public Renderer
+{
+  public:
+                 SoftwareRasterizer(int width, int height, int threads = 0);
+                ~SoftwareRasterizer();
+   void          SetLighting(const RenderManager::Lighting &); // per vertex whatever perFragment says
+   void          SetView(int i, glm::vec3 &c, glm::vec3 &, glm::vec3 &);
+   void          SetViewCount(int n);
+   int           GetViewCount() { return numViews; };
+   glm::mat4     GetViewProjection(int i = 0) { return views[i].projection * views[i].view; };
+   void          SetColor(double r, double g, double b);
+   void          Render(ShapeType, glm::mat4 model);
+   void          BeginFrame();
+   void          EndFrame();
+   // no occlusion queries: results are always unknown and proxies skipped
+   void          RenderProxy(ShapeType, glm::mat4) {};
+   int           PollOcclusionQuery(int) { return -1; };
+   bool          BeginOcclusionQuery(int) { return false; };
+   void          EndOcclusionQuery() {};
+   void          ResetOcclusionQuery(int) {};
+   bool          WritePNG(const char *filename);
+   void          PrintStats();
+
+  private:
+   static const int maxViews = 4;
+   static const int tileSize = 64;
+   struct ViewState
+   {
+      glm::mat4 projection;
+      glm::mat4 view;
+      glm::vec3 camera;
+   };
+   struct DrawCommand
+   {
+      ShapeType shape;
+      glm::vec3 color;
+      glm::mat4 model;
+   };
+   // a plane a*x + b*y + c over window coordinates
+   struct Plane
+   {
+      float a, b, c;
+   };
+   struct ScreenTriangle
+   {
+      Plane     edges[3];    // >= 0 inside
+      Plane     depth;       // window depth, 0..1
+      Plane     invW;        // 1/w, for perspective correct shading
+      Plane     shadeOverW;  // shading amount / w
+      glm::vec3 color;
+      int       x0, y0, x1, y1;  // pixel bounds, inclusive, within the view
+   };
+   // one worker's triangles and, per tile, the ones touching it
+   struct Bin
+   {
+      std::vector<ScreenTriangle>     triangles;
+      std::vector<std::vector<int> >  tiles;
+   };
+   enum Job
+   {
+      JOB_SET_UP_DRAWS,
+      JOB_RASTERIZE,
+      JOB_QUIT
+   };
+
+   int         width, height, numThreads;
+   int         tilesX, tilesY;
+   int         numViews;
+   ViewState   views[maxViews];
+   glm::vec3   color;
+   glm::vec3   lightdir;
+   glm::vec4   lightcoeff;
+   std::vector<float> meshCoords[numShapeTypes];
+   std::vector<float> meshNormals[numShapeTypes];
+   std::vector<float> meshShade[maxViews][numShapeTypes]; // per vertex, for this frame's cameras
+   std::vector<DrawCommand> drawList;
+   std::vector<Bin>         bins;        // per worker
+   std::vector<uint32_t>    colorBuffer; // 0xAABBGGRR, bottom row first
+   std::vector<float>       depthBuffer;
+   std::atomic<int>         nextTile;
+
+   // the worker pool; job, jobSerial, busy and drawRanges are guarded by poolLock
+   std::vector<std::thread> workers;
+   std::mutex               poolLock;
+   std::condition_variable  poolWake;   // a new job was posted
+   std::condition_variable  poolDone;   // the last worker finished it
+   Job                      job;
+   unsigned int             jobSerial;  // counts the jobs posted
+   int                      busy;       // workers still on the current job
+   std::vector<int>         drawRanges; // first and last draw per worker, for JOB_SET_UP_DRAWS
+
+   // totals for PrintStats
+   int      frames;
+   double   setupSeconds, rasterSeconds;
+   uint64_t trianglesIn, trianglesOut;
+
+   void ViewRect(int i, int &x, int &y, int &w, int &h);
+   void Worker(int worker);
+   void RunWorkers(Job);
+   void ShadeMeshes();
+   void SetUpDraws(int worker, int first, int last);
+   void AddTriangle(Bin &bin, const glm::vec4 *clip, const float *shade, glm::vec3 color,
+                    int vx, int vy, int vw, int vh);
+   void RasterizeWorker();
+   void RasterizeTile(int tile);
+   void Rasterize(const ScreenTriangle &t, int x0, int y0, int x1, int y1);
+   static Plane PlaneThrough(const float *x, const float *y, const float *v, float area);
+};
+
+SoftwareRasterizer::SoftwareRasterizer(int w, int h, int threads)
+{
+  width = w;
+  height = h;
+  numThreads = threads > 0 ? threads : (int) fmax(1, std::thread::hardware_concurrency());
+  tilesX = (width + tileSize - 1) / tileSize;
+  tilesY = (height + tileSize - 1) / tileSize;
+  numViews = 1;
+  bins.resize(numThreads);
+  for (int i = 0; i < numThreads; i++)
+    bins[i].tiles.resize(tilesX * tilesY);
+  colorBuffer.resize(width * height);
+  depthBuffer.resize(width * height);
+  lightdir = glm::normalize(glm::vec3(0, 6, -10));
+  lightcoeff = glm::vec4(0.3, 0.7, 0, 50.5); // until SetLighting, as RenderManager
+  frames = 0;
+  setupSeconds = rasterSeconds = 0.0;
+  trianglesIn = trianglesOut = 0;
+  SetViewCount(1);
+
+  MeshBuilder meshes(NULL);
+  meshes.Start();
+  meshes.Wait();
+  for (int i = 0; i < numShapeTypes; i++) {
+    meshCoords[i].swap(meshes.Get(i).coords);
+    meshNormals[i].swap(meshes.Get(i).normals);
+  }
+
+  job = JOB_QUIT;
+  jobSerial = 0;
+  busy = 0;
+  drawRanges.resize(2 * numThreads);
+  for (int i = 0; i < numThreads; i++)
+    workers.push_back(std::thread(&SoftwareRasterizer::Worker, this, i));
+}
+
+SoftwareRasterizer::~SoftwareRasterizer()
+{
+  {
+    std::lock_guard<std::mutex> guard(poolLock);
+    job = JOB_QUIT;
+    jobSerial++;
+  }
+  poolWake.notify_all();
+  for (int i = 0; i < numThreads; i++)
+    workers[i].join();
+}
+
+// Runs each job posted by RunWorkers until told to quit
+void SoftwareRasterizer::Worker(int worker)
+{
+  unsigned int done = 0;
+  while (true) {
+    Job next;
+    {
+      std::unique_lock<std::mutex> guard(poolLock);
+      while (jobSerial == done)
+        poolWake.wait(guard);
+      done = jobSerial;
+      next = job;
+    }
+    if (next == JOB_QUIT)
+      return;
+    if (next == JOB_SET_UP_DRAWS)
+      SetUpDraws(worker, drawRanges[2 * worker], drawRanges[2 * worker + 1]);
+    else
+      RasterizeWorker();
+    std::lock_guard<std::mutex> guard(poolLock);
+    if (--busy == 0)
+      poolDone.notify_one();
+  }
+}
+
+// Hands the job to every worker and waits until all of them are done
+void SoftwareRasterizer::RunWorkers(Job j)
+{
+  std::unique_lock<std::mutex> guard(poolLock);
+  job = j;
+  jobSerial++;
+  busy = numThreads;
+  poolWake.notify_all();
+  while (busy > 0)
+    poolDone.wait(guard);
+}
+
+void SoftwareRasterizer::SetLighting(const RenderManager::Lighting &l)
+{
+  lightdir = l.dir;
+  lightcoeff = l.coeff;
+}
+
+void SoftwareRasterizer::SetView(int i, glm::vec3 &camera, glm::vec3 &origin, glm::vec3 &up)
+{
+  if (i < 0 || i >= maxViews)
+    return;
+  views[i].view = glm::lookAt(camera, origin, up);
+  views[i].camera = camera;
+}
+
+// Same layout and projection as RenderManager
+void SoftwareRasterizer::SetViewCount(int n)
+{
+  numViews = (int) fmax(1, fmin(maxViews, n));
+  float cols = numViews > 2 ? 2 : 1;
+  float rows = numViews > 1 ? 2 : 1;
+  float aspect = (width / cols) / (height / rows);
+  for (int i = 0; i < maxViews; i++)
+    views[i].projection = glm::perspective(glm::radians(45.0f), aspect, 5.0f, 110.0f);
+}
+
+void SoftwareRasterizer::ViewRect(int i, int &x, int &y, int &w, int &h)
+{
+  int cols = numViews > 2 ? 2 : 1;
+  int rows = numViews > 1 ? 2 : 1;
+  w = width / cols;
+  h = height / rows;
+  x = (i % cols) * w;
+  y = (rows - 1 - i / cols) * h;
+}
+
+void SoftwareRasterizer::SetColor(double r, double g, double b)
+{
+  color = glm::vec3(r, g, b);
+}
+
+void SoftwareRasterizer::Render(ShapeType st, glm::mat4 model)
+{
+  DrawCommand cmd;
+  cmd.shape = st;
+  cmd.color = color;
+  cmd.model = model;
+  drawList.push_back(cmd);
+}
+
+void SoftwareRasterizer::BeginFrame()
+{
+  drawList.clear();
+}
+
+void SoftwareRasterizer::EndFrame()
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  ShadeMeshes();
+
+  // draws are split into contiguous runs so that reading the workers' bins
+  // in order keeps the draw order
+  int perWorker = (drawList.size() + numThreads - 1) / numThreads;
+  {
+    std::lock_guard<std::mutex> guard(poolLock);
+    for (int i = 0; i < numThreads; i++) {
+      drawRanges[2 * i] = std::min<int>(drawList.size(), i * perWorker);
+      drawRanges[2 * i + 1] = std::min<int>(drawList.size(), drawRanges[2 * i] + perWorker);
+    }
+  }
+  RunWorkers(JOB_SET_UP_DRAWS);
+  std::chrono::steady_clock::time_point binned = std::chrono::steady_clock::now();
+
+  nextTile = 0;
+  RunWorkers(JOB_RASTERIZE);
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+  std::chrono::duration<double> setup = binned - start, raster = end - binned;
+  setupSeconds += setup.count();
+  rasterSeconds += raster.count();
+  for (int i = 0; i < numThreads; i++)
+    trianglesOut += bins[i].triangles.size();
+  for (int d = 0; d < drawList.size(); d++)
+    trianglesIn += meshCoords[drawList[d].shape].size() / 9 * numViews;
+  frames++;
+}
+
+//
+// The lighting of GetVertexShader. It uses the untransformed vertex
+// position and normal with the view's camera position, so it is the same
+// for every draw of a shape and is done once per shape and view.
+//
+void SoftwareRasterizer::ShadeMeshes()
+{
+  for (int v = 0; v < numViews; v++) {
+    glm::vec3 camera = views[v].camera;
+    for (int st = 0; st < numShapeTypes; st++) {
+      const std::vector<float> &coords = meshCoords[st];
+      const std::vector<float> &normals = meshNormals[st];
+      std::vector<float> &shade = meshShade[v][st];
+      shade.resize(coords.size() / 3);
+      for (int i = 0; i < shade.size(); i++) {
+        glm::vec3 p(coords[3*i], coords[3*i+1], coords[3*i+2]);
+        glm::vec3 n(normals[3*i], normals[3*i+1], normals[3*i+2]);
+        glm::vec3 viewdir = glm::normalize(camera - p);
+        float diffuse = fmax(0.0f, glm::dot(lightdir, n));
+        glm::vec3 r = glm::normalize((2.0f * diffuse) * n - lightdir);
+        float specular = powf(fmax(0.0f, glm::dot(r, viewdir)), lightcoeff[3]);
+        shade[i] = lightcoeff[0] + lightcoeff[1] * diffuse + lightcoeff[2] * specular;
+      }
+    }
+  }
+}
+
+//
+// The vertex stage for draws [first, last): the vertices are transformed
+// to clip space, and the triangles clipped, set up and binned into this
+// worker's bin.
+//
+void SoftwareRasterizer::SetUpDraws(int worker, int first, int last)
+{
+  Bin &bin = bins[worker];
+  bin.triangles.clear();
+  for (int t = 0; t < bin.tiles.size(); t++)
+    bin.tiles[t].clear();
+
+  std::vector<glm::vec4> clip;
+  for (int v = 0; v < numViews; v++) {
+    int vx, vy, vw, vh;
+    ViewRect(v, vx, vy, vw, vh);
+    glm::mat4 vp = GetViewProjection(v);
+    for (int d = first; d < last; d++) {
+      const DrawCommand &cmd = drawList[d];
+      const std::vector<float> &coords = meshCoords[cmd.shape];
+      const float *shade = &meshShade[v][cmd.shape][0];
+      int numVertices = coords.size() / 3;
+      glm::mat4 mvp = vp * cmd.model;
+      clip.resize(numVertices);
+      for (int i = 0; i < numVertices; i++)
+        clip[i] = mvp * glm::vec4(coords[3*i], coords[3*i+1], coords[3*i+2], 1.0f);
+      for (int i = 0; i + 2 < numVertices; i += 3)
+        AddTriangle(bin, &clip[i], &shade[i], cmd.color, vx, vy, vw, vh);
+    }
+  }
+}
+
+
+// The plane through values v at the three window positions; area is the
+// triangle's doubled signed area
+SoftwareRasterizer::Plane
+SoftwareRasterizer::PlaneThrough(const float *x, const float *y, const float *v, float area)
+{
+  Plane p;
+  p.a = ((v[1] - v[0]) * (y[2] - y[0]) - (v[2] - v[0]) * (y[1] - y[0])) / area;
+  p.b = ((v[2] - v[0]) * (x[1] - x[0]) - (v[1] - v[0]) * (x[2] - x[0])) / area;
+  p.c = v[0] - p.a * x[0] - p.b * y[0];
+  return p;
+}
+
+void SoftwareRasterizer::AddTriangle(Bin &bin, const glm::vec4 *clip, const float *shade, glm::vec3 color,
+                                     int vx, int vy, int vw, int vh)
+{
+  // all three vertices outside the same side plane
+  for (int axis = 0; axis < 3; axis++) {
+    if (clip[0][axis] > clip[0].w && clip[1][axis] > clip[1].w && clip[2][axis] > clip[2].w)
+      return;
+    if (clip[0][axis] < -clip[0].w && clip[1][axis] < -clip[1].w && clip[2][axis] < -clip[2].w)
+      return;
+  }
+
+  // clip against the near plane, z >= -w, which leaves three or four
+  // vertices; the other planes are handled by the pixel bounds and depth test
+  glm::vec4 poly[4];
+  float polyShade[4];
+  int n = 0;
+  for (int i = 0; i < 3; i++) {
+    int j = (i + 1) % 3;
+    float di = clip[i].z + clip[i].w;
+    float dj = clip[j].z + clip[j].w;
+    if (di >= 0.0f) {
+      poly[n] = clip[i];
+      polyShade[n++] = shade[i];
+    }
+    if ((di >= 0.0f) != (dj >= 0.0f)) {
+      float t = di / (di - dj);
+      poly[n] = clip[i] + t * (clip[j] - clip[i]);
+      polyShade[n++] = shade[i] + t * (shade[j] - shade[i]);
+    }
+  }
+
+  float x[4], y[4], z[4], invW[4], s[4];
+  for (int i = 0; i < n; i++) {
+    invW[i] = 1.0f / poly[i].w;
+    x[i] = vx + (poly[i].x * invW[i] * 0.5f + 0.5f) * vw;
+    y[i] = vy + (poly[i].y * invW[i] * 0.5f + 0.5f) * vh;
+    z[i] = poly[i].z * invW[i] * 0.5f + 0.5f;
+    s[i] = polyShade[i] * invW[i];
+  }
+
+  for (int k = 1; k + 1 < n; k++) {
+    int idx[3] = {0, k, k + 1};
+    float area = (x[idx[1]] - x[idx[0]]) * (y[idx[2]] - y[idx[0]])
+               - (x[idx[2]] - x[idx[0]]) * (y[idx[1]] - y[idx[0]]);
+    if (fabs(area) < 1e-6f)
+      continue;
+    if (area < 0.0f) {
+      // no face culling in the GL path either: turn it counter-clockwise
+      std::swap(idx[1], idx[2]);
+      area = -area;
+    }
+    float tx[3], ty[3], tz[3], tw[3], ts[3];
+    for (int i = 0; i < 3; i++) {
+      tx[i] = x[idx[i]];
+      ty[i] = y[idx[i]];
+      tz[i] = z[idx[i]];
+      tw[i] = invW[idx[i]];
+      ts[i] = s[idx[i]];
+    }
+
+    ScreenTriangle t;
+    t.x0 = (int) fmax(vx, floorf(fmin(tx[0], fmin(tx[1], tx[2]))));
+    t.x1 = (int) fmin(vx + vw - 1, ceilf(fmax(tx[0], fmax(tx[1], tx[2]))));
+    t.y0 = (int) fmax(vy, floorf(fmin(ty[0], fmin(ty[1], ty[2]))));
+    t.y1 = (int) fmin(vy + vh - 1, ceilf(fmax(ty[0], fmax(ty[1], ty[2]))));
+    if (t.x0 > t.x1 || t.y0 > t.y1)
+      continue;
+    for (int i = 0; i < 3; i++) {
+      int j = (i + 1) % 3;
+      t.edges[i].a = ty[i] - ty[j];
+      t.edges[i].b = tx[j] - tx[i];
+      t.edges[i].c = -(t.edges[i].a * tx[i] + t.edges[i].b * ty[i]);
+    }
+    t.depth = PlaneThrough(tx, ty, tz, area);
+    t.invW = PlaneThrough(tx, ty, tw, area);
+    t.shadeOverW = PlaneThrough(tx, ty, ts, area);
+    t.color = color;
+
+    int index = bin.triangles.size();
+    bin.triangles.push_back(t);
+    for (int row = t.y0 / tileSize; row <= t.y1 / tileSize; row++)
+      for (int col = t.x0 / tileSize; col <= t.x1 / tileSize; col++)
+        bin.tiles[row * tilesX + col].push_back(index);
+  }
+}
+
+// Takes tiles until there are none left
+void SoftwareRasterizer::RasterizeWorker()
+{
+  int tile;
+  while ((tile = nextTile++) < tilesX * tilesY)
+    RasterizeTile(tile);
+}
+
+static inline uint32_t PackColor(float r, float g, float b)
+{
+  return (uint32_t) (r * 255.0f + 0.5f) | (uint32_t) (g * 255.0f + 0.5f) << 8
+       | (uint32_t) (b * 255.0f + 0.5f) << 16 | 0xff000000u;
+}
+
+void SoftwareRasterizer::RasterizeTile(int tile)
+{
+  int x0 = (tile % tilesX) * tileSize;
+  int y0 = (tile / tilesX) * tileSize;
+  int x1 = std::min(width, x0 + tileSize) - 1;
+  int y1 = std::min(height, y0 + tileSize) - 1;
+
+  uint32_t clearColor = PackColor(0.501f, 0.819f, 1.0f);
+  for (int y = y0; y <= y1; y++) {
+    std::fill(&colorBuffer[y * width + x0], &colorBuffer[y * width + x1] + 1, clearColor);
+    std::fill(&depthBuffer[y * width + x0], &depthBuffer[y * width + x1] + 1, 1.0f);
+  }
+
+  // the workers' bins hold consecutive runs of draws, so this is draw order
+  for (int b = 0; b < numThreads; b++) {
+    const Bin &bin = bins[b];
+    const std::vector<int> &list = bin.tiles[tile];
+    for (int k = 0; k < list.size(); k++) {
+      const ScreenTriangle &t = bin.triangles[list[k]];
+      Rasterize(t, std::max(x0, t.x0), std::max(y0, t.y0), std::min(x1, t.x1), std::min(y1, t.y1));
+    }
+  }
+}
+
+//
+// Samples at pixel centers; a pixel is covered when all three edge
+// functions are >= 0, and written when its depth is less than the
+// buffer's (GL_LESS). Shading is interpolated perspective correctly and
+// applied as in GetFragmentShader.
+//
+void SoftwareRasterizer::Rasterize(const ScreenTriangle &t, int x0, int y0, int x1, int y1)
+{
+  const Plane *e = t.edges;
+  for (int y = y0; y <= y1; y++) {
+    float py = y + 0.5f;
+    uint32_t *colorRow = &colorBuffer[y * width];
+    float *depthRow = &depthBuffer[y * width];
+    float rowE[3], rowZ, rowW, rowS;
+    for (int i = 0; i < 3; i++)
+      rowE[i] = e[i].b * py + e[i].c;
+    rowZ = t.depth.b * py + t.depth.c;
+    rowW = t.invW.b * py + t.invW.c;
+    rowS = t.shadeOverW.b * py + t.shadeOverW.c;
+    int x = x0;
+#ifdef HAVE_SSE2
+    // whole groups of four only: the pixels past x1 belong to other tiles
+    const __m128 lane = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 r = _mm_set1_ps(t.color[0]), g = _mm_set1_ps(t.color[1]), b = _mm_set1_ps(t.color[2]);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    for (; x + 3 <= x1; x += 4) {
+      __m128 px = _mm_add_ps(_mm_set1_ps((float) x), lane);
+      __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(e[0].a), px), _mm_set1_ps(rowE[0])), zero);
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(e[1].a), px), _mm_set1_ps(rowE[1])), zero));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(e[2].a), px), _mm_set1_ps(rowE[2])), zero));
+      if (_mm_movemask_ps(inside) == 0)
+        continue;
+      __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.depth.a), px), _mm_set1_ps(rowZ));
+      __m128 d = _mm_loadu_ps(depthRow + x);
+      __m128 pass = _mm_and_ps(inside, _mm_cmplt_ps(z, d));
+      if (_mm_movemask_ps(pass) == 0)
+        continue;
+      _mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, d)));
+
+      __m128 w = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.invW.a), px), _mm_set1_ps(rowW));
+      __m128 s = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.shadeOverW.a), px), _mm_set1_ps(rowS));
+      s = _mm_div_ps(s, w);
+      __m128i ri = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(one, _mm_mul_ps(r, s)), scale), half));
+      __m128i gi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(one, _mm_mul_ps(g, s)), scale), half));
+      __m128i bi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_min_ps(one, _mm_mul_ps(b, s)), scale), half));
+      __m128i packed = _mm_or_si128(_mm_or_si128(ri, _mm_slli_epi32(gi, 8)),
+                                    _mm_or_si128(_mm_slli_epi32(bi, 16), alpha));
+      __m128i mask = _mm_castps_si128(pass);
+      __m128i old = _mm_loadu_si128((const __m128i *) (colorRow + x));
+      _mm_storeu_si128((__m128i *) (colorRow + x),
+                       _mm_or_si128(_mm_and_si128(mask, packed), _mm_andnot_si128(mask, old)));
+    }
+#endif
+    for (; x <= x1; x++) {
+      float px = x + 0.5f;
+      if (e[0].a * px + rowE[0] < 0.0f || e[1].a * px + rowE[1] < 0.0f || e[2].a * px + rowE[2] < 0.0f)
+        continue;
+      float z = t.depth.a * px + rowZ;
+      if (!(z < depthRow[x]))
+        continue;
+      depthRow[x] = z;
+      float s = (t.shadeOverW.a * px + rowS) / (t.invW.a * px + rowW);
+      colorRow[x] = PackColor(fmin(1.0f, t.color[0] * s), fmin(1.0f, t.color[1] * s), fmin(1.0f, t.color[2] * s));
+    }
+  }
+}
+
+bool SoftwareRasterizer::WritePNG(const char *filename)
+{
+  std::vector<uint8_t> rgba(width * height * 4);
+  for (int i = 0; i < width * height; i++) {
+    uint32_t c = colorBuffer[i];
+    rgba[4*i] = c & 0xff;
+    rgba[4*i+1] = (c >> 8) & 0xff;
+    rgba[4*i+2] = (c >> 16) & 0xff;
+    rgba[4*i+3] = c >> 24;
+  }
+  return WritePNGFile(filename, width, height, &rgba[0]);
+}
+
+void SoftwareRasterizer::PrintStats()
+{
+  if (frames == 0)
+    return;
+#ifdef HAVE_SSE2
+  const char *simd = " with SSE2";
+#else
+  const char *simd = "";
+#endif
+  fprintf(stderr, "Software rasterizer, %dx%d on %d threads%s: %.2f ms per frame "
+          "(vertices and binning %.2f ms, rasterization %.2f ms), %.0f of %.0f triangles per frame reached the bins\n",
+          width, height, numThreads, simd,
+          (setupSeconds + rasterSeconds) / frames * 1000.0, setupSeconds / frames * 1000.0,
+          rasterSeconds / frames * 1000.0, (double) trianglesOut / frames, (double) trianglesIn / frames);
+}
+
+
+//
+// Command stream module
+//
+// RecordingRenderer is a Renderer that only appends what it is asked to
+// draw to a compact byte stream and never touches GL, so the cost of
+// building frames can be measured on its own. When it is kept whole, the
+// stream can be saved and replayed later into RenderManager to measure the
+// GL side alone; otherwise each frame reuses the same buffer.
+//
+// Stream format: the 8-byte header "GCMD" + uint32 version, then commands
+// of one type byte followed by their payload (native byte order):
+//   CMD_FRAME       -, always followed by CMD_VIEW_COUNT
+//   CMD_VIEW_COUNT  uint8 n
+//   CMD_VIEW        uint8 view, float eye[3], target[3], up[3]
+//   CMD_COLOR       float rgb[3], only when the color changes
+//   CMD_DRAW        uint8 shape, float model[16]
+//
+class RecordingRenderer : public Renderer
+{
+  public:
+   enum CommandType
+   {
+      CMD_FRAME = 1,
+      CMD_VIEW_COUNT,
+      CMD_VIEW,
+      CMD_COLOR,
+      CMD_DRAW
+   };
+   static const uint32_t version;
+   static const int maxViews = 4;
+
+                 RecordingRenderer(bool keepStream = true);
+   void          SetView(int i, glm::vec3 &c, glm::vec3 &, glm::vec3 &);
+   void          SetViewCount(int n);
+   int           GetViewCount() { return numViews; };
+   glm::mat4     GetViewProjection(int i = 0) { return projection * views[i]; };
+   void          SetColor(double r, double g, double b);
+   void          Render(ShapeType, glm::mat4 model);
+   void          BeginFrame();
+   void          EndFrame() {};
+   // no occlusion queries: results are always unknown and proxies skipped
+   void          RenderProxy(ShapeType, glm::mat4) {};
+   int           PollOcclusionQuery(int) { return -1; };
+   bool          BeginOcclusionQuery(int) { return false; };
+   void          EndOcclusionQuery() {};
+   void          ResetOcclusionQuery(int) {};
+   bool          Save(const char *filename); // only with keepStream
+   uint64_t      GetBytes() { return bytes; };    // recorded so far, kept or not
+   unsigned int  GetDraws() { return draws; };
+
+  private:
+   int          numViews;
+   glm::mat4    projection;         // only for the culler, not recorded
+   glm::mat4    views[maxViews];
+   glm::vec3    color;
+   bool         colorRecorded;      // color is already in this frame's stream
+   unsigned int draws;
+   bool         keepStream;         // else the stream only holds the current frame
+   uint64_t     bytes;
+   std::vector<uint8_t> stream;
+
+   void Put(const void *data, size_t n);
+};
+
+const uint32_t RecordingRenderer::version = 1;
+
+RecordingRenderer::RecordingRenderer(bool keep)
+{
+  numViews = 1;
+  colorRecorded = false;
+  draws = 0;
+  keepStream = keep;
+  bytes = 0;
+  stream.reserve(1 << 20);
+  Put("GCMD", 4);
+  Put(&version, sizeof(version));
+  SetViewCount(1);
+}
+
+void RecordingRenderer::Put(const void *data, size_t n)
+{
+  const uint8_t *p = (const uint8_t *) data;
+  stream.insert(stream.end(), p, p + n);
+  bytes += n;
+}
+
+void RecordingRenderer::SetView(int i, glm::vec3 &camera, glm::vec3 &origin, glm::vec3 &up)
+{
+  if (i < 0 || i >= maxViews)
+    return;
+  views[i] = glm::lookAt(camera, origin, up);
+  uint8_t cmd[2] = {CMD_VIEW, (uint8_t) i};
+  Put(cmd, sizeof(cmd));
+  Put(&camera[0], sizeof(camera));
+  Put(&origin[0], sizeof(origin));
+  Put(&up[0], sizeof(up));
+}
+
+// Same layout and projection as RenderManager, assuming a square window
+void RecordingRenderer::SetViewCount(int n)
+{
+  numViews = (int) fmax(1, fmin(maxViews, n));
+  float cols = numViews > 2 ? 2 : 1;
+  float rows = numViews > 1 ? 2 : 1;
+  projection = glm::perspective(glm::radians(45.0f), rows / cols, 5.0f, 110.0f);
+  uint8_t cmd[2] = {CMD_VIEW_COUNT, (uint8_t) numViews};
+  Put(cmd, sizeof(cmd));
+}
+
+void RecordingRenderer::SetColor(double r, double g, double b)
+{
+  glm::vec3 c(r, g, b);
+  if (colorRecorded && c == color)
+    return;
+  color = c;
+  colorRecorded = true;
+  uint8_t cmd = CMD_COLOR;
+  Put(&cmd, 1);
+  Put(&color[0], sizeof(color));
+}
+
+void RecordingRenderer::Render(ShapeType st, glm::mat4 model)
+{
+  uint8_t cmd[2] = {CMD_DRAW, (uint8_t) st};
+  Put(cmd, sizeof(cmd));
+  Put(&model[0][0], sizeof(model));
+  draws++;
+}
+
+void RecordingRenderer::BeginFrame()
+{
+  if (!keepStream)
+    stream.clear(); // keeps the capacity, so a frame costs no reallocation
+  uint8_t cmd[3] = {CMD_FRAME, CMD_VIEW_COUNT, (uint8_t) numViews};
+  Put(cmd, sizeof(cmd));
+  colorRecorded = false; // so every frame can be replayed on its own
+}
+
+bool RecordingRenderer::Save(const char *filename)
+{
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL)
+    return false;
+  bool ok = fwrite(&stream[0], 1, stream.size(), f) == stream.size();
+  return fclose(f) == 0 && ok;
+}
+
+//
+// Reads a saved stream and issues each frame's commands to a Renderer
+//
+class CommandStreamPlayer
+{
+  public:
+    bool Load(const char *filename);
+    int  GetFrameCount() { return frameStarts.size(); };
+    void Replay(int frame, Renderer &);
+
+  private:
+    std::vector<uint8_t> stream;
+    std::vector<size_t>  frameStarts;  // offset just after each CMD_FRAME
+
+    bool Skip(size_t &pos);
+};
+
+// Moves pos past the command at pos; false if it is unknown or truncated
+bool CommandStreamPlayer::Skip(size_t &pos)
+{
+  size_t size;
+  switch (stream[pos]) {
+    case RecordingRenderer::CMD_FRAME:      size = 1; break;
+    case RecordingRenderer::CMD_VIEW_COUNT: size = 2; break;
+    case RecordingRenderer::CMD_VIEW:       size = 2 + 9 * sizeof(float); break;
+    case RecordingRenderer::CMD_COLOR:      size = 1 + 3 * sizeof(float); break;
+    case RecordingRenderer::CMD_DRAW:       size = 2 + 16 * sizeof(float); break;
+    default: return false;
+  }
+  if (pos + size > stream.size())
+    return false;
+  pos += size;
+  return true;
+}
+
+bool CommandStreamPlayer::Load(const char *filename)
+{
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "ERROR: could not open command stream %s\n", filename);
+    return false;
+  }
+  uint8_t buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    stream.insert(stream.end(), buffer, buffer + n);
+  fclose(f);
+
+  uint32_t fileVersion = 0;
+  if (stream.size() >= 8)
+    memcpy(&fileVersion, &stream[4], sizeof(fileVersion));
+  if (stream.size() < 8 || memcmp(&stream[0], "GCMD", 4) != 0
+      || fileVersion != RecordingRenderer::version) {
+    fprintf(stderr, "ERROR: %s is not a version %u command stream\n", filename, RecordingRenderer::version);
+    return false;
+  }
+  for (size_t pos = 8; pos < stream.size(); ) {
+    bool frame = stream[pos] == RecordingRenderer::CMD_FRAME;
+    // Replay indexes with these, so out of range values are as bad as a truncated stream
+    bool badOperand = pos + 1 < stream.size()
+      && ((stream[pos] == RecordingRenderer::CMD_DRAW && stream[pos + 1] >= numShapeTypes)
+          || (stream[pos] == RecordingRenderer::CMD_VIEW && stream[pos + 1] >= RecordingRenderer::maxViews)
+          || (stream[pos] == RecordingRenderer::CMD_VIEW_COUNT && stream[pos + 1] == 0));
+    if (badOperand || !Skip(pos)) {
+      fprintf(stderr, "ERROR: bad command at offset %zu of %s\n", pos, filename);
+      return false;
+    }
+    if (frame)
+      frameStarts.push_back(pos);
+  }
+  return true;
+}
+
+// Issues the draws of one frame, between the caller's BeginFrame and EndFrame
+void CommandStreamPlayer::Replay(int frame, Renderer &r)
+{
+  size_t pos = frameStarts[frame];
+  while (pos < stream.size() && stream[pos] != RecordingRenderer::CMD_FRAME) {
+    const uint8_t *cmd = &stream[pos];
+    float v[9];
+    switch (cmd[0]) {
+      case RecordingRenderer::CMD_VIEW_COUNT:
+        r.SetViewCount(cmd[1]);
+        break;
+      case RecordingRenderer::CMD_VIEW: {
+        memcpy(v, cmd + 2, 9 * sizeof(float));
+        glm::vec3 eye(v[0], v[1], v[2]), target(v[3], v[4], v[5]), up(v[6], v[7], v[8]);
+        r.SetView(cmd[1], eye, target, up);
+        break;
+      }
+      case RecordingRenderer::CMD_COLOR:
+        memcpy(v, cmd + 1, 3 * sizeof(float));
+        r.SetColor(v[0], v[1], v[2]);
+        break;
+      case RecordingRenderer::CMD_DRAW: {
+        glm::mat4 model;
+        memcpy(&model[0][0], cmd + 2, sizeof(model));
+        r.Render((Renderer::ShapeType) cmd[1], model);
+        break;
+      }
+    }
+    Skip(pos);
+  }
+}
+
+
+//
+// PART3: main function
+//
+
+glm::mat4 RotateMatrix(float degrees, float x, float y, float z)
+{
+   glm::mat4 identity(1.0f);
+   glm::mat4 rotation = glm::rotate(identity, 
+                                    glm::radians(degrees), 
+                                    glm::vec3(x, y, z));
+   return rotation;
+}
+
+glm::mat4 ScaleMatrix(double x, double y, double z)
+{
+   glm::mat4 identity(1.0f);
+   glm::vec3 scale(x, y, z);
+   return glm::scale(identity, scale);
+}
+
+glm::mat4 TranslateMatrix(double x, double y, double z)
+{
+   glm::mat4 identity(1.0f);
+   glm::vec3 translate(x, y, z);
+   return glm::translate(identity, translate);
+}
+
+const float laneWidth = 1.5; // distance between lane centres
+
+// x of the centre of lane i; lane 0 is at +x, on the left of the screen
+float LaneX(int numLanes, int i)
+{
+    return (numLanes - 1) * laneWidth / 2 - i * laneWidth;
+}
+
+//
+// Scene graph module
+//
+// Transforms are kept in flat arrays ordered so that every node comes
+// after its parent and every subtree occupies a contiguous range. Local
+// matrices are set once; a node's world matrix is only re-multiplied when
+// it or one of its ancestors was changed since the last Update.
+//
+class SceneGraph
+{
+  public:
+                     SceneGraph() : multiplies(0) { }
+    int              AddNode(int parent, const glm::mat4 &local);
+    void             SetLocal(int node, const glm::mat4 &local);
+    void             Update();
+    void             Clear();
+    const glm::mat4 &GetWorld(int node) { return worlds[node]; };
+    int              Size() { return locals.size(); };
+    unsigned int     GetMultiplies() { return multiplies; }; // world matrices computed so far
+
+  private:
+    std::vector<int>       parents;     // -1 for roots
+    std::vector<int>       subtreeEnds; // one past the last descendant
+    std::vector<glm::mat4> locals;
+    std::vector<glm::mat4> worlds;
+    std::vector<char>      dirty;
+    std::vector<int>       dirtyNodes;
+    unsigned int           multiplies;
+};
+
+//
+// Nodes must be added depth first (a node's children right after it), which
+// is what keeps every subtree contiguous.
+//
+int SceneGraph::AddNode(int parent, const glm::mat4 &local)
+{
+    int node = locals.size();
+    parents.push_back(parent);
+    subtreeEnds.push_back(node + 1);
+    locals.push_back(local);
+    worlds.push_back(local);
+    dirty.push_back(1);
+    dirtyNodes.push_back(node);
+    for (int p = parent; p >= 0; p = parents[p])
+        subtreeEnds[p] = node + 1;
+    return node;
+}
+
+void SceneGraph::SetLocal(int node, const glm::mat4 &local)
+{
+    if (locals[node] == local)
+        return;
+    locals[node] = local;
+    if (!dirty[node]) {
+        dirty[node] = 1;
+        dirtyNodes.push_back(node);
+    }
+}
+
+void SceneGraph::Update()
+{
+    std::sort(dirtyNodes.begin(), dirtyNodes.end());
+    int upToDate = 0; // end of the last subtree recomputed
+    for (int k = 0; k < dirtyNodes.size(); k++) {
+        int first = dirtyNodes[k];
+        if (first < upToDate)
+            continue; // already covered by a dirty ancestor
+        int end = subtreeEnds[first];
+        for (int i = first; i < end; i++) {
+            int p = parents[i];
+            worlds[i] = p < 0 ? locals[i] : worlds[p] * locals[i];
+            dirty[i] = 0;
+        }
+        multiplies += end - first;
+        upToDate = end;
+    }
+    dirtyNodes.clear();
+}
+
+void SceneGraph::Clear()
+{
+    parents.clear();
+    subtreeEnds.clear();
+    locals.clear();
+    worlds.clear();
+    dirty.clear();
+    dirtyNodes.clear();
+}
+
+//
+// A prefab is a model built from basic shapes, stored as parts relative to
+// the root of each instance. Parts are in depth-first order.
+//
+struct PrefabPart
+{
+    int                      parent;        // index of the parent part, -1 = instance root
+    glm::mat4                local;
+    bool                     drawn;         // false for group nodes
+    RenderManager::ShapeType shape;
+    glm::vec3                color;
+    bool                     instanceColor; // draw with the instance's color instead
+};
+
+typedef std::vector<PrefabPart> Prefab;
+
+//
+// Records a prefab with the same SetColor/Render calls used for drawing;
+// BeginGroup/EndGroup nest the following parts under an extra transform.
+//
+class PrefabBuilder
+{
+  public:
+         PrefabBuilder(Prefab &p) : prefab(p), useInstanceColor(false) { }
+    void SetColor(double r, double g, double b);
+    void SetInstanceColor() { useInstanceColor = true; };
+    void Render(RenderManager::ShapeType, glm::mat4 local);
+    void BeginGroup(glm::mat4 local);
+    void EndGroup() { groups.pop_back(); };
+
+  private:
+    Prefab          &prefab;
+    std::vector<int> groups; // open groups, innermost last
+    glm::vec3        color;
+    bool             useInstanceColor;
+
+    int AddPart(glm::mat4 local, bool drawn, RenderManager::ShapeType);
+};
+
+void PrefabBuilder::SetColor(double r, double g, double b)
+{
+    color = glm::vec3(r, g, b);
+    useInstanceColor = false;
+}
+
+void PrefabBuilder::Render(RenderManager::ShapeType st, glm::mat4 local)
+{
+    AddPart(local, true, st);
+}
+
+void PrefabBuilder::BeginGroup(glm::mat4 local)
+{
+    groups.push_back(AddPart(local, false, RenderManager::CUBE));
+}
+
+int PrefabBuilder::AddPart(glm::mat4 local, bool drawn, RenderManager::ShapeType st)
+{
+    PrefabPart part;
+    part.parent = groups.empty() ? -1 : groups.back();
+    part.local = local;
+    part.drawn = drawn;
+    part.shape = st;
+    part.color = color;
+    part.instanceColor = useInstanceColor;
+    prefab.push_back(part);
+    return prefab.size() - 1;
+}
+
+// Adds an instance of the prefab to the scene graph; returns its root node.
+// Part k of the prefab ends up at node root+1+k.
+int InstantiatePrefab(SceneGraph &graph, const Prefab &prefab, const glm::mat4 &rootLocal)
+{
+    int root = graph.AddNode(-1, rootLocal);
+    for (int k = 0; k < prefab.size(); k++) {
+        int parent = prefab[k].parent < 0 ? root : root + 1 + prefab[k].parent;
+        graph.AddNode(parent, prefab[k].local);
+    }
+    return root;
+}
+
+void SetUpWheel(PrefabBuilder &pb) {
+    // tire
+    pb.SetColor(0, 0, 0);
+    glm::mat4 s1 = ScaleMatrix(1, 1, 0.5);
+    pb.Render(RenderManager::CYLINDER, s1);
+
+    // rim
+    pb.SetColor(0.666, 0.666, 0.666);
+    glm::mat4 s2 = ScaleMatrix(0.6, 0.6, 0.51);
+    glm::mat4 t2 = TranslateMatrix(0, 0, -0.005);
+    pb.Render(RenderManager::CYLINDER, t2*s2);
+}
+
+void SetUpCar(PrefabBuilder &pb) {
+    pb.SetInstanceColor();
+
+    // main rectangle for body
+    glm::mat4 t1 = TranslateMatrix(-0.5, 0, 0);
+    glm::mat4 s1 = ScaleMatrix(1, 0.05, 2);
+    pb.Render(RenderManager::CUBE, t1*s1);
+
+    // bottom block between wheels
+    glm::mat4 s6 = ScaleMatrix(1, 0.3, 0.6);
+    glm::mat4 t6 = TranslateMatrix(-0.5, -0.2, 0.7);
+    pb.Render(RenderManager::CUBE, t6*s6);
+
+    // bumpers
+    glm::mat4 s7 = ScaleMatrix(1, 0.2, 0.2);
+    glm::mat4 t7 = TranslateMatrix(-0.5, -0.2, 1.8);
+    pb.Render(RenderManager::CUBE, t7*s7);
+    glm::mat4 t8 = TranslateMatrix(-0.5, -0.2, 0);
+    pb.Render(RenderManager::CUBE, t8*s7);
+
+    // wheel wells
+    glm::mat4 s9 = ScaleMatrix(1, 0.3, 0.1);
+    glm::mat4 t9 = TranslateMatrix(-0.5, -0.13, 0.05);
+    glm::mat4 r9 = RotateMatrix(45, 1, 0, 0);
+    pb.Render(RenderManager::CUBE, t9*r9*s9);
+    glm::mat4 t10 = TranslateMatrix(-0.5, -0.13, 1.15);
+    pb.Render(RenderManager::CUBE, t10*r9*s9);
+    glm::mat4 r11 = RotateMatrix(-45, 1, 0, 0);
+    glm::mat4 t11 = TranslateMatrix(-0.5, -0.2, 0.8);
+    pb.Render(RenderManager::CUBE, t11*r11*s9);
+    glm::mat4 t12 = TranslateMatrix(-0.5, -0.2, 1.9);
+    pb.Render(RenderManager::CUBE, t12*r11*s9);
+
+    // upper car body
+    glm::mat4 s13 = ScaleMatrix(1, 0.5, 0.9);
+    glm::mat4 t13 = TranslateMatrix(-0.5, 0, 0.6);
+    pb.Render(RenderManager::CUBE, t13*s13);
+    // back side
+    glm::mat4 s14 = ScaleMatrix(1, 0.4, 0.2);
+    glm::mat4 t14 = TranslateMatrix(-0.5, 0.13, 0.44);
+    glm::mat4 r14 = RotateMatrix(20, 1, 0, 0);
+    pb.Render(RenderManager::CUBE, t14*r14*s14);
+    // front side
+    glm::mat4 t15 = TranslateMatrix(-0.5, 0.06, 1.45);
+    glm::mat4 r15 = RotateMatrix(-20, 1, 0, 0);
+    pb.Render(RenderManager::CUBE, t15*r15*s14);
+    // trunk
+    glm::mat4 s20 = ScaleMatrix(1, 0.12, 0.7);
+    glm::mat4 r20 = RotateMatrix(-10, 1, 0, 0);
+    glm::mat4 t20 = TranslateMatrix(-0.5, -0.06, 0.02);
+    pb.Render(RenderManager::CUBE, t20*r20*s20);
+    // hood
+    glm::mat4 r21 = RotateMatrix(10, 1, 0, 0);
+    glm::mat4 t21 = TranslateMatrix(-0.5, 0.07, 1.29);
+    pb.Render(RenderManager::CUBE, t21*r21*s20);
+
+    // windows
+    pb.SetColor(0, 0, 0);
+    // back
+    glm::mat4 s16 = ScaleMatrix(0.8, 0.3, 0.2);
+    glm::mat4 t16 = TranslateMatrix(-0.4, 0.19, 0.45);
+    pb.Render(RenderManager::CUBE, t16*r14*s16);
+    // front
+    glm::mat4 t17 = TranslateMatrix(-0.4, 0.12, 1.43);
+    pb.Render(RenderManager::CUBE, t17*r15*s16);
+    // front side
+    glm::mat4 s18 = ScaleMatrix(1.02, 0.3, 0.35);
+    glm::mat4 t18 = TranslateMatrix(-0.51, 0.15, 1.07);
+    pb.Render(RenderManager::CUBE, t18*s18);
+    // back side
+    glm::mat4 t19 = TranslateMatrix(-0.51, 0.15, 0.64);
+    pb.Render(RenderManager::CUBE, t19*s18);
+
+    // wheels
+    glm::mat4 s2 = ScaleMatrix(0.2, 0.2, 0.2);
+    glm::mat4 r2 = RotateMatrix(90, 0, 1, 0);
+    glm::mat4 t2 = TranslateMatrix(0.4, -0.2, 0.45);
+    glm::mat4 t4 = TranslateMatrix(-0.5, -0.2, 0.45);
+    glm::mat4 t3 = TranslateMatrix(0.4, -0.2, 1.55);
+    glm::mat4 t5 = TranslateMatrix(-0.5, -0.2, 1.55);
+    glm::mat4 wheels[4] = {t2, t3, t4, t5};
+    for (int i = 0; i < 4; i++) {
+        pb.BeginGroup(wheels[i]*r2*s2);
+        SetUpWheel(pb);
+        pb.EndGroup();
+    }
+
+    // taillights
+    pb.SetColor(0.784, 0, 0);
+    glm::mat4 s22 = ScaleMatrix(0.06, 0.09, 0.02);
+    glm::mat4 t22a = TranslateMatrix(-0.4, -0.07, 0);
+    pb.Render(RenderManager::SPHERE, t22a*s22);
+    glm::mat4 t22b = TranslateMatrix(-0.25, -0.07, 0);
+    pb.Render(RenderManager::SPHERE, t22b*s22);
+    glm::mat4 t23a = TranslateMatrix(0.4, -0.07, 0);
+    pb.Render(RenderManager::SPHERE, t23a*s22);
+    glm::mat4 t23b = TranslateMatrix(0.25, -0.07, 0);
+    pb.Render(RenderManager::SPHERE, t23b*s22);
+
+    // headlights
+    pb.SetColor(1, 1, 1);
+    glm::mat4 s24 = ScaleMatrix(0.1, 0.1, 0.02);
+    glm::mat4 t24 = TranslateMatrix(-0.33, -0.07, 1.99);
+    pb.Render(RenderManager::SPHERE, t24*s24);
+    glm::mat4 t25 = TranslateMatrix(0.33, -0.07, 1.99);
+    pb.Render(RenderManager::SPHERE, t25*s24);
+}
+
+// A box truck four units long, 1.6 high from the road, with a white cargo
+// box and a cab in the instance color
+void SetUpTruck(PrefabBuilder &pb) {
+    // chassis
+    pb.SetColor(0.2, 0.2, 0.2);
+    glm::mat4 s1 = ScaleMatrix(1, 0.1, 4);
+    glm::mat4 t1 = TranslateMatrix(-0.5, -0.25, 0);
+    pb.Render(RenderManager::CUBE, t1*s1);
+
+    // cargo box
+    pb.SetColor(0.9, 0.9, 0.9);
+    glm::mat4 s2 = ScaleMatrix(1, 1.35, 2.8);
+    glm::mat4 t2 = TranslateMatrix(-0.5, -0.15, 0);
+    pb.Render(RenderManager::CUBE, t2*s2);
+
+    // cab
+    pb.SetInstanceColor();
+    glm::mat4 s3 = ScaleMatrix(1, 0.9, 1.1);
+    glm::mat4 t3 = TranslateMatrix(-0.5, -0.15, 2.9);
+    pb.Render(RenderManager::CUBE, t3*s3);
+
+    // windows
+    pb.SetColor(0, 0, 0);
+    glm::mat4 s4 = ScaleMatrix(0.8, 0.3, 0.04);
+    glm::mat4 t4 = TranslateMatrix(-0.4, 0.35, 3.98);
+    pb.Render(RenderManager::CUBE, t4*s4);
+    glm::mat4 s5 = ScaleMatrix(1.02, 0.3, 0.5);
+    glm::mat4 t5 = TranslateMatrix(-0.51, 0.35, 3.3);
+    pb.Render(RenderManager::CUBE, t5*s5);
+
+    // wheels, on three axles
+    glm::mat4 s6 = ScaleMatrix(0.2, 0.2, 0.2);
+    glm::mat4 r6 = RotateMatrix(90, 0, 1, 0);
+    const float axles[3] = {0.45, 1.35, 3.45};
+    for (int i = 0; i < 6; i++) {
+        glm::mat4 t6 = TranslateMatrix(i % 2 ? 0.4 : -0.5, -0.2, axles[i / 2]);
+        pb.BeginGroup(t6*r6*s6);
+        SetUpWheel(pb);
+        pb.EndGroup();
+    }
+
+    // taillights
+    pb.SetColor(0.784, 0, 0);
+    glm::mat4 s7 = ScaleMatrix(0.06, 0.09, 0.02);
+    glm::mat4 t7a = TranslateMatrix(-0.4, -0.1, 0);
+    pb.Render(RenderManager::SPHERE, t7a*s7);
+    glm::mat4 t7b = TranslateMatrix(0.4, -0.1, 0);
+    pb.Render(RenderManager::SPHERE, t7b*s7);
+}
+
+// A traffic cone, 0.4 wide and 0.6 high
+void SetUpCone(PrefabBuilder &pb) {
+    // base
+    pb.SetColor(0.2, 0.2, 0.2);
+    glm::mat4 s1 = ScaleMatrix(0.4, 0.05, 0.4);
+    glm::mat4 t1 = TranslateMatrix(-0.2, -0.4, 0);
+    pb.Render(RenderManager::CUBE, t1*s1);
+
+    // body, as stacked cylinders standing on end
+    const float radii[3]   = {0.17, 0.13, 0.1};
+    const float bottoms[3] = {-0.35, -0.1, 0.0};
+    const float heights[3] = {0.25, 0.1, 0.2};
+    glm::mat4 upright = RotateMatrix(-90, 1, 0, 0);
+    for (int i = 0; i < 3; i++) {
+        if (i == 1)
+            pb.SetColor(1, 1, 1);   // reflective band
+        else
+            pb.SetColor(1, 0.4, 0); // orange
+        glm::mat4 s = ScaleMatrix(radii[i], radii[i], heights[i]);
+        glm::mat4 t = TranslateMatrix(0, bottoms[i], 0.2);
+        pb.Render(RenderManager::CYLINDER, t*upright*s);
+    }
+}
+
+// A road barrier, 1.2 wide: a red and white board on two feet
+void SetUpBarrier(PrefabBuilder &pb) {
+    // feet
+    pb.SetColor(0.5, 0.5, 0.5);
+    glm::mat4 s1 = ScaleMatrix(0.15, 0.1, 0.3);
+    glm::mat4 t1a = TranslateMatrix(-0.55, -0.4, 0);
+    pb.Render(RenderManager::CUBE, t1a*s1);
+    glm::mat4 t1b = TranslateMatrix(0.4, -0.4, 0);
+    pb.Render(RenderManager::CUBE, t1b*s1);
+
+    // board
+    glm::mat4 s2 = ScaleMatrix(0.3, 0.4, 0.1);
+    for (int i = 0; i < 4; i++) {
+        if (i % 2 == 0)
+            pb.SetColor(0.85, 0.1, 0.1);
+        else
+            pb.SetColor(1, 1, 1);
+        glm::mat4 t2 = TranslateMatrix(-0.6 + 0.3*i, -0.3, 0.1);
+        pb.Render(RenderManager::CUBE, t2*s2);
+    }
+}
+
+// The model of an obstacle is centred on x = 0 and starts at z = 0, with
+// the road at y = -0.4
+void SetUpObstacle(PrefabBuilder &pb, ObstacleType type) {
+    switch (type) {
+    case OBSTACLE_CAR:     SetUpCar(pb); break;
+    case OBSTACLE_TRUCK:   SetUpTruck(pb); break;
+    case OBSTACLE_CONE:    SetUpCone(pb); break;
+    case OBSTACLE_BARRIER: SetUpBarrier(pb); break;
+    }
+}
+
+void SetUpTree(PrefabBuilder &pb) {
+    pb.SetColor(0.517, 0.270, 0);
+
+    // main trunk
+    glm::mat4 scaleTrunk = ScaleMatrix(0.15, 0.15, 3);
+    glm::mat4 rotateTrunk = RotateMatrix(90, 1, 0, 0);
+    glm::mat4 rotateTrunk2 = RotateMatrix(180, 0, 0, 1);
+    glm::mat4 translateTrunk = TranslateMatrix(0, 0, -3.0);
+    pb.Render(RenderManager::CYLINDER, rotateTrunk*rotateTrunk2*translateTrunk*scaleTrunk);
+
+    // middle branches
+    glm::mat4 s1 = ScaleMatrix(0.05, 0.05, 0.7);
+    glm::mat4 t1 = TranslateMatrix(0, 1.5, -0.3);
+    pb.Render(RenderManager::CYLINDER, t1*s1);
+    glm::mat4 s2 = ScaleMatrix(0.03, 0.03, 0.4);
+    glm::mat4 t2 = TranslateMatrix(0, 1.5, 0.4);
+    glm::mat4 r2 = RotateMatrix(-45, 1, 0, 0);
+    pb.Render(RenderManager::CYLINDER, t2*r2*s2);
+
+    // upper branches
+    glm::mat4 s3 = ScaleMatrix(0.05, 0.05, 0.5);
+    glm::mat4 t3 = TranslateMatrix(0, 2.2, 0);
+    glm::mat4 r3a = RotateMatrix(20, 1, 0, 0);
+    glm::mat4 r3b = RotateMatrix(160, 0, 1, 0);
+    pb.Render(RenderManager::CYLINDER, t3*r3a*r3b*s3);
+    glm::mat4 s4 = ScaleMatrix(0.05, 0.05, 0.5);
+    glm::mat4 t4 = TranslateMatrix(0.15, 2.35, -0.42);
+    glm::mat4 r4 = RotateMatrix(-110, 1, 0, 0);
+    pb.Render(RenderManager::CYLINDER, t4*r4*s4);
+
+    // leaves
+    pb.SetColor(0.027, 0.611, 0);
+    glm::mat4 s5 = ScaleMatrix(1.2, 0.5, 1.2);
+    glm::mat4 t5 = TranslateMatrix(0, 3.5, 0);
+    pb.Render(RenderManager::SPHERE, t5*s5);
+    glm::mat4 s6 = ScaleMatrix(0.7, 0.3, 0.7);
+    glm::mat4 t6 = TranslateMatrix(0, 2, 0.8);
+    pb.Render(RenderManager::SPHERE, t6*s6);
+    glm::mat4 s7 = ScaleMatrix(0.7, 0.3, 0.7);
+    glm::mat4 t7 = TranslateMatrix(0, 2.9, -0.9);
+    pb.Render(RenderManager::SPHERE, t7*s7);
+}
+
+// One 10-unit tile of road for numLanes lanes, with grass, fences and trees
+// on both sides
+void SetUpGround(PrefabBuilder &pb, int numLanes) {
+    float half = numLanes * laneWidth / 2; // half the road width, 2.25 for three lanes
+
+    // road
+    pb.SetColor(0.286, 0.286, 0.286); // dark grey
+    glm::mat4 rTranslate = TranslateMatrix(-half, -6.0, -1.0);
+    glm::mat4 rScale = ScaleMatrix(2*half, 0.5, 10.0);
+    pb.Render(RenderManager::CUBE, rTranslate*rScale);
+
+    // grass
+    pb.SetColor(0.031, 0.749, 0); // green
+    glm::mat4 g1t = TranslateMatrix(-half-5.0, -5.8, -1.0);
+    glm::mat4 g1s = ScaleMatrix(5.0, 0.5, 10.0);
+    pb.Render(RenderManager::CUBE, g1t*g1s);
+    glm::mat4 g2t = TranslateMatrix(half, -5.8, -1.0);
+    glm::mat4 g2s = ScaleMatrix(5.0, 0.5, 10.0);
+    pb.Render(RenderManager::CUBE, g2t*g2s);
+
+    // road lane markings, between each pair of lanes
+    pb.SetColor(1, 0.913, 0); // yellow
+    glm::mat4 laneScale = ScaleMatrix(0.15, 0.5, 1.5);
+    for (int i = 0; i < 2; i++) {
+        for (int b = 1; b < numLanes; b++) {
+            glm::mat4 lt = TranslateMatrix(-half + b*laneWidth - 0.075, -5.99, -1.0+5.0*i);
+            pb.Render(RenderManager::CUBE, lt*laneScale);
+        }
+    }
+
+    // fence beams
+    pb.SetColor(0.823, 0.615, 0.172); // light brown
+    glm::mat4 beamScale = ScaleMatrix(0.05, 0.05, 10.0);
+    for (int i = 0; i < 2; i++) {
+        glm::mat4 bt1 = TranslateMatrix(-half-0.45, -5.0+i*0.3, -1.0);
+        pb.Render(RenderManager::CYLINDER, bt1*beamScale);
+        glm::mat4 bt2 = TranslateMatrix(half+0.45, -5.0+i*0.3, -1.0);
+        pb.Render(RenderManager::CYLINDER, bt2*beamScale);
+    }
+    
+    // fence poles
+    pb.SetColor(0.6, 0.388, 0); // brown
+    glm::mat4 poleScale = ScaleMatrix(0.1, 0.6, 0.1);
+    for (int i = 0; i < 5; i++) {
+        glm::mat4 pt1 = TranslateMatrix(-half-0.5, -5.2, -1.1+i*2.0);
+        pb.Render(RenderManager::CUBE, pt1*poleScale);
+        glm::mat4 pt2 = TranslateMatrix(half+0.4, -5.2, -1.1+i*2.0);
+        pb.Render(RenderManager::CUBE, pt2*poleScale);
+    }
+
+    // trees
+    glm::mat4 treeScale = ScaleMatrix(0.7, 0.7, 0.7);
+    glm::mat4 treeTrans = TranslateMatrix(half+1.25, -5.0, 0);
+    glm::mat4 treeRotate = RotateMatrix(90, 0, 1, 0);
+    pb.BeginGroup(treeTrans*treeRotate*treeScale);
+    SetUpTree(pb);
+    pb.EndGroup();
+    glm::mat4 treeTrans2 = TranslateMatrix(-half-1.25, -5.0, 5.0);
+    pb.BeginGroup(treeTrans2*treeRotate*treeScale);
+    SetUpTree(pb);
+    pb.EndGroup();
+
+}
+
+//
+// The drawable state of the world: one prefab instance in the scene graph
+// for the player, each obstacle type in each enemy car slot and each
+// ground tile. Sync copies the GameObject positions into the instance
+// roots, so only the instances that actually moved get their part
+// matrices recomputed. A slot enables the instance of its obstacle's type,
+// so a respawn with another type doesn't change the graph.
+//
+class GameScene
+{
+  public:
+                GameScene(int numLanes);
+    void        Sync(const std::vector<GameObject> &players, const std::vector<GameObject> &cars,
+                     const std::vector<GameObject> &grounds);
+    void        DrawPlayer(Renderer &rm, int i) { Draw(rm, players[i]); };
+    void        DrawCar(Renderer &rm, int i);
+    void        DrawGround(Renderer &rm, int i) { Draw(rm, grounds[i]); };
+    SceneGraph &GetGraph() { return graph; };
+
+    struct Instance
+    {
+        const Prefab *prefab;
+        int           root;
+        glm::vec3     color;
+        bool          enabled;
+    };
+    // all instances, players then cars (numObstacleTypes per slot) then
+    // grounds, for GPUCuller
+    int             GetInstanceCount() { return players.size() + cars.size() + grounds.size(); };
+    const Instance &GetInstance(int i);
+    int             GetLayoutVersion() { return layoutVersion; }; // changes when instances are rebuilt
+
+  private:
+
+    SceneGraph            graph;
+    Prefab                obstaclePrefabs[numObstacleTypes];
+    Prefab                groundPrefab;
+    std::vector<Instance> players;
+    std::vector<Instance> cars;
+    std::vector<Instance> grounds;
+    int                   layoutVersion;
+
+    void Rebuild(int numPlayers, int numCars, int numGrounds);
+    void Draw(Renderer &, const Instance &);
+};
+
+GameScene::GameScene(int numLanes)
+{
+    for (int t = 0; t < numObstacleTypes; t++) {
+        PrefabBuilder obstacleBuilder(obstaclePrefabs[t]);
+        SetUpObstacle(obstacleBuilder, (ObstacleType) t);
+    }
+    PrefabBuilder groundBuilder(groundPrefab);
+    SetUpGround(groundBuilder, numLanes);
+    layoutVersion = 0;
+    Rebuild(0, 0, 0);
+}
+
+const GameScene::Instance &GameScene::GetInstance(int i)
+{
+    if (i < players.size())
+        return players[i];
+    i -= players.size();
+    if (i < cars.size())
+        return cars[i];
+    return grounds[i - cars.size()];
+}
+
+void GameScene::Rebuild(int numPlayers, int numCars, int numGrounds)
+{
+    glm::mat4 identity(1.0f);
+    graph.Clear();
+    layoutVersion++;
+    players.resize(numPlayers);
+    for (int i = 0; i < numPlayers; i++) {
+        players[i].prefab = &obstaclePrefabs[OBSTACLE_CAR];
+        players[i].root = InstantiatePrefab(graph, obstaclePrefabs[OBSTACLE_CAR], identity);
+    }
+    cars.resize(numCars * numObstacleTypes);
+    for (int i = 0; i < cars.size(); i++) {
+        const Prefab &prefab = obstaclePrefabs[i % numObstacleTypes];
+        cars[i].prefab = &prefab;
+        cars[i].root = InstantiatePrefab(graph, prefab, identity);
+        cars[i].enabled = false;
+    }
+    grounds.resize(numGrounds);
+    for (int i = 0; i < numGrounds; i++) {
+        grounds[i].prefab = &groundPrefab;
+        grounds[i].root = InstantiatePrefab(graph, groundPrefab, identity);
+    }
+}
+
+// The collision box of an obstacle starts half a unit right of its model's
+// centre, as for the player's car
+glm::mat4 ObstacleModelMatrix(const GameObject &obstacle)
+{
+    return TranslateMatrix(obstacle.position[0] + obstacle.size[0] / 2 - 0.5, 0.4, obstacle.position[2]);
+}
+
+void GameScene::Sync(const std::vector<GameObject> &playerObjects, const std::vector<GameObject> &carObjects,
+                     const std::vector<GameObject> &groundObjects)
+{
+    if (playerObjects.size() != players.size() || carObjects.size() * numObstacleTypes != cars.size()
+        || groundObjects.size() != grounds.size())
+        Rebuild(playerObjects.size(), carObjects.size(), groundObjects.size());
+
+    for (int i = 0; i < players.size(); i++) {
+        const GameObject &mpCar = playerObjects[i];
+        graph.SetLocal(players[i].root, TranslateMatrix(mpCar.position[0], 0.41, mpCar.position[2]));
+        players[i].color = glm::vec3(mpCar.color[0], mpCar.color[1], mpCar.color[2]);
+        players[i].enabled = true;
+    }
+
+    for (int i = 0; i < carObjects.size(); i++) {
+        const GameObject &car = carObjects[i];
+        for (int t = 0; t < numObstacleTypes; t++)
+            cars[numObstacleTypes*i + t].enabled = false;
+        Instance &inst = cars[numObstacleTypes*i + car.type];
+        graph.SetLocal(inst.root, ObstacleModelMatrix(car));
+        inst.color = glm::vec3(car.color[0], car.color[1], car.color[2]);
+        inst.enabled = car.enabled;
+    }
+
+    glm::mat4 roadTrans = TranslateMatrix(0, 0.5, 0);
+    for (int i = 0; i < grounds.size(); i++) {
+        const GameObject &ground = groundObjects[i];
+        graph.SetLocal(grounds[i].root, roadTrans*TranslateMatrix(ground.position[0], ground.position[1], ground.position[2]));
+        grounds[i].enabled = ground.enabled;
+    }
+
+    graph.Update();
+}
+
+// draws the obstacle in car slot i
+void GameScene::DrawCar(Renderer &rm, int i)
+{
+    for (int t = 0; t < numObstacleTypes; t++) {
+        if (cars[numObstacleTypes*i + t].enabled)
+            Draw(rm, cars[numObstacleTypes*i + t]);
+    }
+}
+
+void GameScene::Draw(Renderer &rm, const Instance &inst)
+{
+    const Prefab &prefab = *inst.prefab;
+    for (int k = 0; k < prefab.size(); k++) {
+        if (!prefab[k].drawn)
+            continue;
+        const glm::vec3 &c = prefab[k].instanceColor ? inst.color : prefab[k].color;
+        rm.SetColor(c[0], c[1], c[2]);
+        rm.Render(prefab[k].shape, graph.GetWorld(inst.root + 1 + k));
+    }
+}
+
+//
+// Measures the per-frame cost of computing the car part matrices for
+// increasing numbers of cars: rebuilding every Translate*Rotate*Scale chain
+// from scratch (as the game used to) versus the scene graph with all, 10%
+// or none of the cars moving.
+//
+double BenchmarkSeconds(std::chrono::steady_clock::time_point start, int frames)
+{
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    return d.count() / frames;
+}
+
+void RunTransformBenchmark()
+{
+    Prefab carPrefab;
+    PrefabBuilder builder(carPrefab);
+    SetUpCar(builder);
+
+    printf("Per-frame transform cost (microseconds)\n");
+    printf("%8s %8s %12s %12s %12s %12s\n", "cars", "nodes", "rebuild", "all moved", "10% moved", "none moved");
+
+    const int counts[] = {100, 1000, 10000, 50000};
+    for (int c = 0; c < 4; c++) {
+        int numCars = counts[c];
+        int frames = fmax(5, 200000 / numCars);
+        float checksum = 0.0f;
+
+        SceneGraph graph;
+        std::vector<int> roots(numCars);
+        for (int i = 0; i < numCars; i++)
+            roots[i] = InstantiatePrefab(graph, carPrefab, TranslateMatrix(1.5*(i%3), 0.4, i));
+        graph.Update();
+
+        // rebuild: run the car builder and multiply every chain again, per car
+        Prefab scratch;
+        std::vector<glm::mat4> worlds(carPrefab.size());
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int f = 0; f < frames; f++) {
+            for (int i = 0; i < numCars; i++) {
+                scratch.clear();
+                PrefabBuilder b(scratch);
+                SetUpCar(b);
+                glm::mat4 root = TranslateMatrix(1.5*(i%3), 0.4, i - f);
+                for (int k = 0; k < scratch.size(); k++)
+                    worlds[k] = (scratch[k].parent < 0 ? root : worlds[scratch[k].parent]) * scratch[k].local;
+                checksum += worlds.back()[3][2];
+            }
+        }
+        double rebuild = BenchmarkSeconds(start, frames);
+
+        double moved[3];
+        const int moveEvery[3] = {1, 10, 0}; // 0 = nothing moves
+        for (int m = 0; m < 3; m++) {
+            start = std::chrono::steady_clock::now();
+            for (int f = 0; f < frames; f++) {
+                if (moveEvery[m] > 0) {
+                    for (int i = 0; i < numCars; i += moveEvery[m])
+                        graph.SetLocal(roots[i], TranslateMatrix(1.5*(i%3), 0.4, i - f - 1 - m));
+                }
+                graph.Update();
+                checksum += graph.GetWorld(graph.Size() - 1)[3][2];
+            }
+            moved[m] = BenchmarkSeconds(start, frames);
+        }
+
+        printf("%8d %8d %12.1f %12.1f %12.1f %12.1f\n", numCars, graph.Size(),
+               rebuild*1e6, moved[0]*1e6, moved[1]*1e6, moved[2]*1e6);
+        if (checksum == 12345.0f)
+            printf(" "); // keeps the work from being optimized away
+    }
+}
+
+//
+// Measures spawning and despawning obstacles at random with tens of
+// thousands alive, in the ObstaclePool versus one new and delete per
+// obstacle, and the cost of looking an obstacle up by its handle.
+//
+void RunObstacleBenchmark()
+{
+    printf("Obstacle churn cost (nanoseconds)\n");
+    printf("%8s %16s %16s %12s %12s\n", "live", "pool spawn+free", "new+delete", "pool lookup", "pool grew");
+
+    uint32_t seed = 2463534242u; // xorshift32, so picking a victim is cheap next to the work measured
+    const int counts[] = {1000, 10000, 50000};
+    for (int c = 0; c < 3; c++) {
+        int live = counts[c];
+        int churns = 2000000;
+        float checksum = 0.0f;
+
+        ObstaclePool pool;
+        std::vector<ObstacleHandle> handles(live);
+        for (int i = 0; i < live; i++)
+            handles[i] = pool.Spawn(RandomObstacleType());
+        int capacity = pool.Capacity();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int n = 0; n < churns; n++) {
+            seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+            ObstacleHandle &h = handles[seed % live];
+            pool.Despawn(h);
+            h = pool.Spawn((ObstacleType) (n % numObstacleTypes));
+        }
+        double poolChurn = BenchmarkSeconds(start, churns);
+
+        start = std::chrono::steady_clock::now();
+        for (int n = 0; n < churns; n++) {
+            seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+            GameObject *o = pool.Get(handles[seed % live]);
+            checksum += o->size[2];
+        }
+        double lookup = BenchmarkSeconds(start, churns);
+
+        std::vector<GameObject *> objects(live);
+        for (int i = 0; i < live; i++)
+            objects[i] = new GameObject();
+        start = std::chrono::steady_clock::now();
+        for (int n = 0; n < churns; n++) {
+            seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+            GameObject *&o = objects[seed % live];
+            delete o;
+            o = new GameObject();
+            const float *size = obstacleTypes[n % numObstacleTypes].size;
+            o->setSize(size[0], size[1], size[2]);
+            o->type = (ObstacleType) (n % numObstacleTypes);
+        }
+        double heapChurn = BenchmarkSeconds(start, churns);
+        for (int i = 0; i < live; i++) {
+            checksum += objects[i]->size[2];
+            delete objects[i];
+        }
+
+        printf("%8d %16.1f %16.1f %12.1f %12s\n", live, poolChurn*1e9, heapChurn*1e9, lookup*1e9,
+               pool.Capacity() == capacity && pool.LiveCount() == live ? "no" : "YES");
+        if (checksum == 12345.0f)
+            printf(" "); // keeps the work from being optimized away
+    }
+
+    // a handle kept past its despawn must not find the obstacle that reused the slot
+    ObstaclePool pool;
+    ObstacleHandle old = pool.Spawn(OBSTACLE_CAR);
+    pool.Despawn(old);
+    ObstacleHandle reused = pool.Spawn(OBSTACLE_TRUCK);
+    printf("stale handle check: %s\n", reused.index == old.index && !pool.Get(old) && pool.Get(reused)
+                                        ? "passed" : "FAILED");
+}
+
+//
+// Occlusion culling for the enemy cars.
+//
+// Every car is first tested against the view frustum. The rest are tested
+// lane by lane, nearest first, against the screen rectangles covered by a
+// solid face of the nearer obstacles in the same lane. This software test
+// is conservative: it only rejects a car whose whole bounding box is
+// behind an occluder. Optionally, GL occlusion queries are used on top:
+// a car whose query from an earlier frame found it hidden is replaced by
+// a bounding box drawn without color or depth writes, which keeps its
+// query running so the car comes back as soon as it is visible again.
+//
+
+struct CullStats
+{
+    unsigned int tested;            // enabled enemy cars considered
+    unsigned int frustumRejected;
+    unsigned int occlusionRejected; // by the software lane test
+    unsigned int queryRejected;     // by a GL occlusion query
+
+    unsigned int Rejected() { return frustumRejected + occlusionRejected + queryRejected; };
+};
+
+// A screen-space rectangle in normalized device coordinates, with the
+// distance from the camera (clip w) of its nearest or farthest point
+struct ScreenRect
+{
+    float x0, y0, x1, y1;
+    float w;
+};
+
+class OcclusionCuller
+{
+  public:
+              OcclusionCuller();
+    void      SetUseQueries(bool u) { useQueries = u; };
+    void      SetLaneCount(int n) { numLanes = n; };
+    void      DrawCars(Renderer &, GameScene &, const std::vector<GameObject> &cars);
+    CullStats GetFrameStats() { return frameStats; };
+    CullStats GetTotalStats() { return totalStats; };
+
+  private:
+    bool               useQueries;
+    int                numLanes;  // cars come in rows of this many
+    CullStats          frameStats;
+    CullStats          totalStats;
+    std::vector<float> lastZ;  // to notice cars that were respawned since the last frame
+
+    struct Shape;
+    bool OutsideFrustum(const glm::mat4 &vp, const glm::mat4 &model, const Shape &);
+    bool OccludeeRect(const glm::mat4 &vp, const glm::mat4 &model, const Shape &, ScreenRect &);
+    bool OccluderRect(const glm::mat4 &vp, const glm::mat4 &model, const Shape &, ScreenRect &);
+
+    static const Shape shapes[numObstacleTypes];
+};
+
+// The bounding box of an obstacle model built by SetUpObstacle, in model
+// coordinates, and the rectangle at z = occluderMin.z of a face of a
+// solid part of it; the occluder is empty for a type that hides nothing
+struct OcclusionCuller::Shape
+{
+    glm::vec3 boundsMin, boundsMax;
+    glm::vec3 occluderMin, occluderMax;
+};
+
+const OcclusionCuller::Shape OcclusionCuller::shapes[numObstacleTypes] = {
+    // car: the back face of the upper car body, which is a solid cube
+    {glm::vec3(-0.52, -0.42, -0.03), glm::vec3(0.52, 0.62, 2.03),
+     glm::vec3(-0.5, 0.0, 0.6), glm::vec3(0.5, 0.5, 0.6)},
+    // truck: the back of the cargo box
+    {glm::vec3(-0.52, -0.42, -0.03), glm::vec3(0.52, 1.22, 4.03),
+     glm::vec3(-0.5, -0.15, 0.0), glm::vec3(0.5, 1.2, 0.0)},
+    // cone
+    {glm::vec3(-0.22, -0.42, -0.02), glm::vec3(0.22, 0.22, 0.42),
+     glm::vec3(0.0, 0.0, 0.0), glm::vec3(0.0, 0.0, 0.0)},
+    // barrier: the back of the board
+    {glm::vec3(-0.62, -0.42, -0.02), glm::vec3(0.62, 0.12, 0.32),
+     glm::vec3(-0.6, -0.3, 0.1), glm::vec3(0.6, 0.1, 0.1)}
+};
+
+OcclusionCuller::OcclusionCuller()
+{
+    useQueries = false;
+    numLanes = 3;
+    memset(&frameStats, 0, sizeof(frameStats));
+    memset(&totalStats, 0, sizeof(totalStats));
+}
+
+bool OcclusionCuller::OutsideFrustum(const glm::mat4 &vp, const glm::mat4 &model, const Shape &s)
+{
+    // the box is outside if all eight corners are outside the same clip plane
+    int outside[6] = {0, 0, 0, 0, 0, 0};
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner((i & 1) ? s.boundsMax.x : s.boundsMin.x,
+                         (i & 2) ? s.boundsMax.y : s.boundsMin.y,
+                         (i & 4) ? s.boundsMax.z : s.boundsMin.z);
+        glm::vec4 c = vp * model * glm::vec4(corner, 1.0f);
+        outside[0] += c.x < -c.w;
+        outside[1] += c.x >  c.w;
+        outside[2] += c.y < -c.w;
+        outside[3] += c.y >  c.w;
+        outside[4] += c.z < -c.w;
+        outside[5] += c.z >  c.w;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (outside[i] == 8)
+            return true;
+    }
+    return false;
+}
+
+// Screen rectangle enclosing the whole obstacle; w is the nearest distance.
+// Fails if any part of it is behind the camera.
+bool OcclusionCuller::OccludeeRect(const glm::mat4 &vp, const glm::mat4 &model, const Shape &s, ScreenRect &r)
+{
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner((i & 1) ? s.boundsMax.x : s.boundsMin.x,
+                         (i & 2) ? s.boundsMax.y : s.boundsMin.y,
+                         (i & 4) ? s.boundsMax.z : s.boundsMin.z);
+        glm::vec4 c = vp * model * glm::vec4(corner, 1.0f);
+        if (c.w <= 0.01f)
+            return false;
+        float x = c.x / c.w;
+        float y = c.y / c.w;
+        if (i == 0) {
+            r.x0 = r.x1 = x;
+            r.y0 = r.y1 = y;
+            r.w = c.w;
+        }
+        r.x0 = fmin(r.x0, x);
+        r.x1 = fmax(r.x1, x);
+        r.y0 = fmin(r.y0, y);
+        r.y1 = fmax(r.y1, y);
+        r.w = fmin(r.w, c.w);
+    }
+    return true;
+}
+
+// Screen rectangle guaranteed to be covered by the obstacle's occluder
+// face; w is the farthest distance. Fails if the face is empty or behind
+// the camera.
+bool OcclusionCuller::OccluderRect(const glm::mat4 &vp, const glm::mat4 &model, const Shape &s, ScreenRect &r)
+{
+    // corners in the order bottom-left, bottom-right, top-left, top-right
+    glm::vec2 p[4];
+    float maxW = 0.0;
+    for (int i = 0; i < 4; i++) {
+        glm::vec3 corner((i & 1) ? s.occluderMax.x : s.occluderMin.x,
+                         (i & 2) ? s.occluderMax.y : s.occluderMin.y,
+                         s.occluderMin.z);
+        glm::vec4 c = vp * model * glm::vec4(corner, 1.0f);
+        if (c.w <= 0.01f)
+            return false;
+        p[i] = glm::vec2(c.x / c.w, c.y / c.w);
+        maxW = fmax(maxW, c.w);
+    }
+    // the largest axis-aligned rectangle inside the projected quad; the
+    // camera looks down +z, so car +x can end up on either side of the screen
+    int left = p[0].x + p[2].x < p[1].x + p[3].x ? 0 : 1;
+    int bottom = p[0].y + p[1].y < p[2].y + p[3].y ? 0 : 2;
+    r.x0 = fmax(p[left].x, p[left + 2].x);
+    r.x1 = fmin(p[1 - left].x, p[3 - left].x);
+    r.y0 = fmax(p[bottom].y, p[bottom + 1].y);
+    r.y1 = fmin(p[2 - bottom].y, p[3 - bottom].y);
+    r.w = maxW;
+    return r.x0 < r.x1 && r.y0 < r.y1;
+}
+
+bool CompareCarDistance(const std::pair<float, int> &a, const std::pair<float, int> &b)
+{
+    return a.first < b.first;
+}
+
+//
+// Draws the enabled enemy cars that survive culling, nearest first so the
+// occlusion queries of far cars are tested against the near ones.
+//
+void OcclusionCuller::DrawCars(Renderer &rm, GameScene &scene, const std::vector<GameObject> &cars)
+{
+    memset(&frameStats, 0, sizeof(frameStats));
+    glm::mat4 vp = rm.GetViewProjection();
+
+    if (lastZ.size() != cars.size())
+        lastZ.assign(cars.size(), 0.0f);
+
+    std::vector<std::pair<float, int> > order;
+    for (int i = 0; i < cars.size(); i++) {
+        // a car that jumped back was respawned; its query result is stale
+        if (cars[i].position[2] > lastZ[i])
+            rm.ResetOcclusionQuery(i);
+        lastZ[i] = cars[i].position[2];
+        if (cars[i].enabled)
+            order.push_back(std::make_pair(cars[i].position[2], i));
+    }
+    std::sort(order.begin(), order.end(), CompareCarDistance);
+
+    std::vector<std::vector<ScreenRect> > occluders(numLanes); // per lane
+    for (int k = 0; k < order.size(); k++) {
+        int i = order[k].second;
+        int lane = i % numLanes;
+        glm::mat4 model = ObstacleModelMatrix(cars[i]);
+        const Shape &shape = shapes[cars[i].type];
+        frameStats.tested++;
+
+        // with several views a car is only rejected when it is outside all
+        // of them; occlusion depends on the viewpoint, so it needs one view
+        bool outside = true;
+        for (int v = 0; v < rm.GetViewCount() && outside; v++)
+            outside = OutsideFrustum(rm.GetViewProjection(v), model, shape);
+        if (outside) {
+            frameStats.frustumRejected++;
+            continue;
+        }
+        if (rm.GetViewCount() > 1) {
+            scene.DrawCar(rm, i);
+            continue;
+        }
+
+        ScreenRect box;
+        if (OccludeeRect(vp, model, shape, box)) {
+            bool hidden = false;
+            for (int j = 0; j < occluders[lane].size() && !hidden; j++) {
+                ScreenRect &o = occluders[lane][j];
+                hidden = box.w > o.w && box.x0 >= o.x0 && box.x1 <= o.x1
+                                     && box.y0 >= o.y0 && box.y1 <= o.y1;
+            }
+            if (hidden) {
+                frameStats.occlusionRejected++;
+                continue;
+            }
+        }
+        ScreenRect occluder;
+        if (OccluderRect(vp, model, shape, occluder))
+            occluders[lane].push_back(occluder);
+
+        if (!useQueries) {
+            scene.DrawCar(rm, i);
+            continue;
+        }
+
+        bool wasHidden = rm.PollOcclusionQuery(i) == 0;
+        bool querying = rm.BeginOcclusionQuery(i);
+        if (wasHidden) {
+            glm::mat4 bounds = model * TranslateMatrix(shape.boundsMin.x, shape.boundsMin.y, shape.boundsMin.z)
+                                     * ScaleMatrix(shape.boundsMax.x - shape.boundsMin.x,
+                                                   shape.boundsMax.y - shape.boundsMin.y,
+                                                   shape.boundsMax.z - shape.boundsMin.z);
+            rm.RenderProxy(RenderManager::CUBE, bounds);
+            frameStats.queryRejected++;
+        }
+        else {
+            scene.DrawCar(rm, i);
+        }
+        if (querying)
+            rm.EndOcclusionQuery();
+    }
+
+    totalStats.tested += frameStats.tested;
+    totalStats.frustumRejected += frameStats.frustumRejected;
+    totalStats.occlusionRejected += frameStats.occlusionRejected;
+    totalStats.queryRejected += frameStats.queryRejected;
+}
+
+//
+// GPU-driven culling and drawing. Every drawn part of every car and ground
+// instance stays resident in GPU buffers with its bounding sphere; each
+// frame the CPU uploads only the instance roots (world matrix, color and
+// whether it is enabled) that changed, which with the world not scrolling
+// (see ViewScroll) are the players and the rows that came into view. A
+// compute pass tests the parts against all the view frustums, appends the
+// visible ones to a per-shape range of the instance buffer and counts them
+// into DrawElementsIndirectCommands, so the whole scene is one
+// glMultiDrawElementsIndirect per shape. There are no occlusion tests on
+// this path. Needs GL 4.3.
+//
+class GPUCuller
+{
+  public:
+           GPUCuller() : layoutVersion(-1), numItems(0), bytesUploaded(0), frames(0) { }
+    bool   Init(RenderManager &);
+    void   Draw(RenderManager &, GameScene &);
+    int    GetItemCount() { return numItems; }; // resident parts
+    double GetUploadPerFrame() { return frames ? (double) bytesUploaded / frames : 0.0; }; // bytes
+
+  private:
+    // std430 layouts of the compute shader buffers
+    struct Part
+    {
+        glm::mat4 rootRelative; // prefab part relative to the instance root
+        glm::vec4 color;
+        glm::vec4 sphere;       // mesh bounding sphere
+        GLint     info[4];      // shape, uses the instance color
+    };
+    struct Object
+    {
+        glm::mat4 world;
+        glm::vec4 color;        // w = 0 when disabled
+    };
+
+    static const int maxViews = 4; // planes[24] in the compute shader
+
+    int    layoutVersion;       // GameScene layout the buffers were built for
+    int    numItems;
+    GLuint program;
+    GLuint partBuffer, objectBuffer, itemBuffer, instanceBuffer, commandBuffer;
+    GLint  planesLoc, numViewsLoc, numItemsLoc;
+    std::vector<Object> objects;
+    std::vector<Object> uploaded;  // what objectBuffer holds
+    uint64_t bytesUploaded;        // objects and commands, since Init
+    int      frames;
+
+    void Rebuild(RenderManager &, GameScene &);
+};
+
+bool GPUCuller::Init(RenderManager &rm)
+{
+    if (!rm.SupportsGPUCulling()) {
+        fprintf(stderr, "GPU culling needs OpenGL 4.3, using the CPU culler\n");
+        return false;
+    }
+    const char *compute_shader = GetCullComputeShader();
+    GLuint cs = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(cs, 1, &compute_shader, NULL);
+    glCompileShader(cs);
+    int ok = -1;
+    glGetShaderiv(cs, GL_COMPILE_STATUS, &ok);
+    if (ok != GL_TRUE) {
+        fprintf(stderr, "ERROR: culling shader did not compile\n");
+        _print_shader_info_log(cs);
+        return false;
+    }
+    program = glCreateProgram();
+    glAttachShader(program, cs);
+    glLinkProgram(program);
+    planesLoc = glGetUniformLocation(program, "planes");
+    numViewsLoc = glGetUniformLocation(program, "numViews");
+    numItemsLoc = glGetUniformLocation(program, "numItems");
+
+    GLuint buffers[5];
+    glGenBuffers(5, buffers);
+    partBuffer = buffers[0];
+    objectBuffer = buffers[1];
+    itemBuffer = buffers[2];
+    instanceBuffer = buffers[3];
+    commandBuffer = buffers[4];
+    return rm.SetUpIndirect(instanceBuffer);
+}
+
+//
+// Uploads the parts of each prefab and one (instance, part) item per drawn
+// part of each instance. Only needed when the instance count changes.
+//
+void GPUCuller::Rebuild(RenderManager &rm, GameScene &scene)
+{
+    std::vector<Part> parts;
+    std::vector<const Prefab *> prefabs;
+    std::vector<int> firstPart;  // per prefab, index into parts of its part 0
+    std::vector<GLuint> items;
+    for (int i = 0; i < scene.GetInstanceCount(); i++) {
+        const Prefab *prefab = scene.GetInstance(i).prefab;
+        int p = std::find(prefabs.begin(), prefabs.end(), prefab) - prefabs.begin();
+        if (p == prefabs.size()) {
+            prefabs.push_back(prefab);
+            firstPart.push_back(parts.size());
+            std::vector<glm::mat4> relative(prefab->size());
+            for (int k = 0; k < prefab->size(); k++) {
+                const PrefabPart &pp = (*prefab)[k];
+                relative[k] = pp.parent < 0 ? pp.local : relative[pp.parent] * pp.local;
+                Part part;
+                part.rootRelative = relative[k];
+                part.color = glm::vec4(pp.color, 1.0f);
+                part.sphere = rm.GetMeshBounds(pp.shape);
+                part.info[0] = pp.shape;
+                part.info[1] = pp.instanceColor;
+                part.info[2] = part.info[3] = 0;
+                parts.push_back(part);
+            }
+        }
+        for (int k = 0; k < prefab->size(); k++) {
+            if (!(*prefab)[k].drawn)
+                continue;
+            items.push_back(i);
+            items.push_back(firstPart[p] + k);
+        }
+    }
+    numItems = items.size() / 2;
+    objects.resize(scene.GetInstanceCount());
+    uploaded.assign(objects.size(), Object());
+    for (int i = 0; i < uploaded.size(); i++)
+        uploaded[i].color.w = -1.0f; // never matches, so Draw uploads everything
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, partBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, parts.size() * sizeof(Part), parts.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, itemBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, items.size() * sizeof(GLuint), items.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, objectBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, objects.size() * sizeof(Object), NULL, GL_STREAM_DRAW);
+    // room for every item in each shape's range, see baseInstance
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, instanceBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, numShapeTypes * numItems * sizeof(Object), NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, numShapeTypes * 5 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    layoutVersion = scene.GetLayoutVersion();
+}
+
+// The scene must already be Synced for this frame and the views set
+void GPUCuller::Draw(RenderManager &rm, GameScene &scene)
+{
+    if (scene.GetLayoutVersion() != layoutVersion)
+        Rebuild(rm, scene);
+    if (numItems == 0)
+        return;
+
+    // upload each run of objects that changed
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, objectBuffer);
+    int first = -1;  // start of the current run
+    for (int i = 0; i <= objects.size(); i++) {
+        bool changed = false;
+        if (i < objects.size()) {
+            const GameScene::Instance &inst = scene.GetInstance(i);
+            objects[i].world = scene.GetGraph().GetWorld(inst.root);
+            objects[i].color = glm::vec4(inst.color, inst.enabled ? 1.0f : 0.0f);
+            changed = memcmp(&objects[i], &uploaded[i], sizeof(Object)) != 0;
+        }
+        if (changed) {
+            uploaded[i] = objects[i];
+            if (first < 0)
+                first = i;
+        }
+        else if (first >= 0) {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(Object), (i - first) * sizeof(Object),
+                            &objects[first]);
+            bytesUploaded += (i - first) * sizeof(Object);
+            first = -1;
+        }
+    }
+    GLuint commands[numShapeTypes * 5];
+    for (int st = 0; st < numShapeTypes; st++) {
+        GLuint *cmd = &commands[st * 5];
+        cmd[0] = rm.GetIndexCount((RenderManager::ShapeType) st);  // count
+        cmd[1] = 0;                                                // instanceCount, from the compute pass
+        cmd[2] = 0;                                                // firstIndex
+        cmd[3] = 0;                                                // baseVertex
+        cmd[4] = st * numItems;                                    // baseInstance
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(commands), commands);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    bytesUploaded += sizeof(commands);
+    frames++;
+
+    // frustum planes of each view (Gribb and Hartmann), normalized for sphere tests
+    glm::vec4 planes[maxViews * 6];
+    int numViews = rm.GetViewCount();
+    for (int v = 0; v < numViews; v++) {
+        glm::mat4 m = rm.GetViewProjection(v);
+        glm::vec4 row[4];
+        for (int r = 0; r < 4; r++)
+            row[r] = glm::vec4(m[0][r], m[1][r], m[2][r], m[3][r]);
+        for (int k = 0; k < 6; k++) {
+            glm::vec4 p = k % 2 == 0 ? row[3] + row[k / 2] : row[3] - row[k / 2];
+            planes[v * 6 + k] = p / glm::length(glm::vec3(p));
+        }
+    }
+    glProgramUniform4fv(program, planesLoc, numViews * 6, &planes[0][0]);
+    glProgramUniform1i(program, numViewsLoc, numViews);
+    glProgramUniform1ui(program, numItemsLoc, numItems);
+
+    GLuint buffers[5] = {partBuffer, objectBuffer, itemBuffer, instanceBuffer, commandBuffer};
+    for (int b = 0; b < 5; b++)
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, b, buffers[b]);
+    rm.DispatchCompute(program, (numItems + 63) / 64,
+                       GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    rm.RenderIndirect(commandBuffer);
+}
+
+void SetUpGame(int counter, Renderer &rm, GameScene &scene, OcclusionCuller &culler,
+               const std::vector<GameObject> &playerCars, const std::vector<GameObject> &cars,
+               const std::vector<GameObject> &grounds)
+{
+    double var = (counter%10)/9.0; // oscillates between 0 and 1
+    if ((counter/10 % 2) == 1)
+       var=1-var; 
+
+    scene.Sync(playerCars, cars, grounds);
+
+    for (int i = 0; i < playerCars.size(); i++) {
+        scene.DrawPlayer(rm, i);
+    }
+
+    // draw the ground before the enemy cars so it can occlude them
+    for (int i = 0; i < grounds.size(); i++) {
+        if (grounds[i].enabled)
+            scene.DrawGround(rm, i);
+    }
+
+    culler.DrawCars(rm, scene, cars);
+}
+
+void movePlayerLeftOrRight(GameObject &car, float lrSpeed, float moveToX, float minX = -1.5, float maxX = 1.5) {
+    float curX = car.position[0];
+    float nextX = curX + lrSpeed;
+
+    if (curX > moveToX) {
+        nextX = curX - lrSpeed;
+    }
+
+    if ((curX < 0 && nextX > 0) || (curX > 0 && nextX < 0))  {
+        car.position[0] = 0;
+    }
+    else if ((curX < moveToX && nextX > moveToX) || (curX > moveToX && nextX < moveToX)) {
+        car.position[0] = moveToX;
+    }
+    else {
+        if (moveToX > curX) {
+            car.position[0] += lrSpeed;
+        }
+        else if (moveToX < curX){
+            car.position[0] -= lrSpeed;
+        }
+    }
+}
+
+GameObject 
+setUpMainPlayerCar(float color[3]) {
+    //                      (            color           |  position | scale  )
+    GameObject mainPlayerCar(color[0], color[1], color[2], 0, 0.01, 0, 1, 1, 2);
+    return mainPlayerCar;
+}
+
+// true if lane i stays empty in a row where empty, and with two the lane to
+// its right, have no obstacle
+bool LaneLeftEmpty(int i, int numLanes, int empty, bool two)
+{
+    return i == empty || (two && i == (empty + 1) % numLanes);
+}
+
+//
+// Respawns the row of numLanes obstacles named by row: one or two random
+// lanes stay empty, never in the same pattern as the previous row, and the
+// others get an obstacle of a random type, centred in the lane.
+//
+void SpawnObstacleRow(ObstaclePool &pool, ObstacleHandle *row, int numLanes, std::vector<bool> &lastRowEnabledStatus)
+{
+    for (int i = 0; i < numLanes; i++) {
+        pool.Despawn(row[i]);
+        row[i] = noObstacle;
+    }
+
+    // randomly choose one or two lanes to leave empty (25% of the rows have
+    // two), again while the row matches the previous one
+    int empty;
+    bool two;
+    bool theSame;
+    do {
+        empty = rand() % numLanes;
+        two = rand() % 4 == 0;
+        theSame = true;
+        for (int i = 0; i < numLanes; i++)
+            theSame = theSame && LaneLeftEmpty(i, numLanes, empty, two) != lastRowEnabledStatus[i];
+    } while (theSame);
+
+    for (int i = 0; i < numLanes; i++) {
+        lastRowEnabledStatus[i] = !LaneLeftEmpty(i, numLanes, empty, two);
+        if (!lastRowEnabledStatus[i])
+            continue;
+        row[i] = pool.Spawn(RandomObstacleType());
+        GameObject *obstacle = pool.Get(row[i]);
+        obstacle->position[0] = -LaneX(numLanes, i) + 0.5 - obstacle->size[0] / 2; // see ObstacleModelMatrix
+    }
+}
+
+std::vector<GameObject> 
+setUpGrounds(int numRows) {
+    std::vector<GameObject> grounds;
+
+    for (int i = 0; i < numRows; i++) {
+        //          ( color |    position   |  scale )
+        GameObject g(0, 0, 0, 0, 5.0, i*10.0, 0, 0, 0);
+        grounds.push_back(g);
+    }
+
+    return grounds;
+}
+
+//
+// World streaming
+//
+// Car rows and ground tiles live in ring buffers. Element k places behind
+// the head is the Serial(k)th ever placed and sits at a fixed world
+// position, base + Serial(k)*spacing; scrolling the world only adds to
+// the distance travelled, and recycling the element that passed the camera
+// is just advancing the head. Z gives positions relative to the camera,
+// WorldZ relative to a floating origin, which stay put while an element is
+// in view. Only the elements near the front, the ones that can be seen or
+// hit, ever have their GameObject positions written.
+//
+class WorldRing
+{
+  public:
+           WorldRing() : count(0), head(0), recycled(0), spacing(1.0), base(0.0), travelled(0.0) { }
+    void   Reset(int n, float s, float z) { count = n; head = 0; recycled = 0; spacing = s; base = z; travelled = 0.0; };
+    void   Scroll(float dz) { travelled += dz; };
+    int    Slot(int k) { return (head + k) % count; };
+    float  Z(int k) { return WorldZ(k, travelled); };
+    float  WorldZ(int k, double origin) { return base + (double) Serial(k) * spacing - origin; };
+    double Travelled() { return travelled; };
+    int    Serial(int k) { return recycled + k; }; // counts every element ever placed
+    int    Count() { return count; };
+    int    FirstAtOrAfter(float z);
+    int    CountBefore(float z);
+    int    Recycle();
+
+  private:
+    int    count;     // number of elements
+    int    head;      // slot of the element nearest the camera
+    int    recycled;
+    float  spacing;   // distance between consecutive elements
+    double base;      // world z of the first element
+    double travelled; // the camera's world z
+};
+
+// smallest k with Z(k) >= z (Count() if there is none)
+int WorldRing::FirstAtOrAfter(float z)
+{
+    float frontZ = Z(0);
+    if (z <= frontZ)
+        return 0;
+    return (int) fmin(count, ceil((z - frontZ) / spacing));
+}
+
+// number of elements with Z(k) < z
+int WorldRing::CountBefore(float z)
+{
+    return FirstAtOrAfter(z);
+}
+
+// Moves the head element to the back of the ring and returns its slot
+int WorldRing::Recycle()
+{
+    int slot = head;
+    head = (head + 1) % count;
+    recycled++;
+    return slot;
+}
+
+// ------------ CONFIG --------------
+
+// the shape of the world and its speeds, see --config
+struct GameConfig
+{
+    int   numLanes;
+    int   numCarRows;
+    int   numGroundRows;
+    float carRowSpacing;
+    float forwardSpeed;   // starting speed, per reference tick
+    float speedIncrease;  // added every 100 reference ticks
+};
+
+const GameConfig defaultConfig = {
+    3,    // numLanes
+    7,    // numCarRows
+    12,   // numGroundRows
+    18.0, // carRowSpacing
+    0.3,  // forwardSpeed
+    0.03  // speedIncrease
+};
+
+const float  streamDistance      = 110.0; // rows and tiles closer than this are placed and drawn
+const double referenceTickRate   = 60.0; // speeds and counts are tuned for this many ticks per second
+const double defaultTickRate     = 60.0; // simulation ticks per second
+const int    maxTicksPerFrame    = 8;    // drop time rather than spiral when frames are very slow
+const double idleFps             = 10.0; // redraw limit while the window is unfocused
+const double hiddenWaitSeconds   = 0.25; // event wait while minimized, the game is paused
+const double rebaseDistance      = 1024.0; // move the world origin this often, keeping world z small
+
+// ----------------------------------
+
+const int   maxPlayers = 4;
+const float playerColors[maxPlayers][3] = {{0, 0.396, 1},     // blue
+                                           {0.1, 0.7, 0.2},   // green
+                                           {1, 0.8, 0},       // yellow
+                                           {0.6, 0.2, 0.8}};  // purple
+const int   playerStartOffsets[maxPlayers] = {0, -1, 1, 0}; // lanes from the middle one
+
+struct PlayerState
+{
+    GameObject car;
+    int        curIdx;   // lane the car is moving to
+    bool       crashed;  // out until the next restart
+};
+
+struct GameState
+{
+    GameConfig config;
+    std::vector<PlayerState> players; // all on the same road
+    ObstaclePool obstacles;
+    std::vector<ObstacleHandle> rowObstacles; // the obstacle in each lane of each car row
+    std::vector<GameObject> grounds;
+    std::vector<bool> lastRowEnabledStatus; // keep track of which lanes had obstacles in the previous row
+    int   counter;
+    int   gameOverCounter;
+    float forwardSpeed;
+    int   score;
+    bool  gameOver;         // every player has crashed
+    bool  shouldPrintScore;
+    float tickScale;        // reference ticks per simulation tick
+    WorldRing carRows;      // slot s is rowObstacles[numLanes*s ..]
+    WorldRing groundTiles;  // slot s is grounds[s]
+    double worldOrigin;     // distance travelled when the floating origin was last moved
+    std::vector<GameObject> visibleCars;    // the streamed window handed to the renderer,
+    std::vector<GameObject> visibleGrounds; // at fixed world positions, see ViewScroll
+};
+
+//
+// The renderer gets the world in a frame that doesn't scroll: the rows and
+// tiles stay where they are and the camera (with the players) moves by
+// ViewScroll instead, so a steady frame changes one view matrix rather than
+// every object's. The frame's origin jumps forward every rebaseDistance to
+// keep the positions small enough for float precision on long runs.
+//
+float ViewScroll(GameState &g)
+{
+    return g.carRows.Travelled() - g.worldOrigin;
+}
+
+// number of simulation ticks lasting as long as n reference ticks
+int ScaledTicks(const GameState &g, int n)
+{
+    return (int) fmax(1.0, floor(n / g.tickScale + 0.5));
+}
+
+//
+// Places the car rows and ground tiles within streamDistance and copies
+// them into the visible lists. A row keeps the same visible entries while
+// it is in view, so per-car state in the renderer stays attached to it.
+//
+void StreamVisible(GameState &g)
+{
+    int lanes = g.config.numLanes;
+    int carCapacity = (int) fmin(g.carRows.Count(), ceil(streamDistance / g.config.carRowSpacing) + 1);
+    g.visibleCars.resize(carCapacity * lanes);
+    for (int i = 0; i < g.visibleCars.size(); i++)
+        g.visibleCars[i].enabled = false;
+    int rows = g.carRows.CountBefore(streamDistance);
+    for (int k = 0; k < rows && k < carCapacity; k++) {
+        int slot = g.carRows.Slot(k);
+        for (int j = 0; j < lanes; j++) {
+            GameObject *car = g.obstacles.Get(g.rowObstacles[lanes*slot + j]);
+            if (!car)
+                continue;
+            car->position[2] = g.carRows.Z(k);
+            GameObject &visible = g.visibleCars[lanes*(g.carRows.Serial(k) % carCapacity) + j];
+            visible = *car;
+            visible.position[2] = g.carRows.WorldZ(k, g.worldOrigin);
+        }
+    }
+
+    int groundCapacity = (int) fmin(g.groundTiles.Count(), ceil(streamDistance / 10.0) + 2);
+    g.visibleGrounds.resize(groundCapacity);
+    for (int i = 0; i < g.visibleGrounds.size(); i++)
+        g.visibleGrounds[i].enabled = false;
+    int tiles = g.groundTiles.CountBefore(streamDistance);
+    for (int k = 0; k < tiles && k < groundCapacity; k++) {
+        GameObject &ground = g.grounds[g.groundTiles.Slot(k)];
+        ground.position[2] = g.groundTiles.Z(k);
+        GameObject &visible = g.visibleGrounds[g.groundTiles.Serial(k) % groundCapacity];
+        visible = ground;
+        visible.position[2] = g.groundTiles.WorldZ(k, g.worldOrigin);
+    }
+}
+
+void ResetGame(GameState &g)
+{
+    for (int i = 0; i < g.players.size(); i++) {
+        PlayerState &p = g.players[i];
+        float color[3] = {playerColors[i][0], playerColors[i][1], playerColors[i][2]};
+        p.car = setUpMainPlayerCar(color);
+        p.curIdx = fmin(g.config.numLanes - 1, fmax(0, (g.config.numLanes - 1) / 2 + playerStartOffsets[i]));
+        p.car.position[0] = LaneX(g.config.numLanes, p.curIdx);
+        p.crashed = false;
+    }
+    const GameConfig &c = g.config;
+    g.lastRowEnabledStatus.resize(c.numLanes, false);
+    g.obstacles.Clear();
+    g.obstacles.Reserve(c.numCarRows * c.numLanes); // the most there can be
+    g.rowObstacles.assign(c.numCarRows * c.numLanes, noObstacle);
+    // the first two rows stay empty so that the player can orient themselves
+    for (int row = 2; row < c.numCarRows; row++)
+        SpawnObstacleRow(g.obstacles, &g.rowObstacles[row * c.numLanes], c.numLanes, g.lastRowEnabledStatus);
+    g.grounds = setUpGrounds(c.numGroundRows);
+    g.carRows.Reset(c.numCarRows, c.carRowSpacing, 0.0);
+    g.groundTiles.Reset(c.numGroundRows, 10.0, 0.0);
+    g.worldOrigin = 0.0;
+    StreamVisible(g);
+    g.gameOver = false;
+    g.shouldPrintScore = true;
+    g.forwardSpeed = c.forwardSpeed;
+    g.counter = 0;
+    g.gameOverCounter = 0;
+    g.score = 0;
+}
+
+//
+// Advances the game by one simulation tick. Collisions detected and
+// TelemetryFlags raised during the tick are added to the out parameters.
+//
+void SimulateTick(GameState &g, bool restartRequested, int &collisions, uint32_t &telemetryFlags)
+{
+    g.counter++;
+
+    // increase the forward speed by a little over time
+    if (g.counter % ScaledTicks(g, 100) == 0) { 
+        g.forwardSpeed += g.config.speedIncrease;
+    }
+
+    float lrSpeed = g.forwardSpeed / 1.5; // the speed to move the main player left or right
+
+    if (g.gameOver) {
+        g.forwardSpeed = 0.0;
+        lrSpeed = 0.0;
+
+        if (g.shouldPrintScore) {
+            telemetryFlags |= TELEMETRY_GAME_OVER;
+            g.shouldPrintScore = false;
+            g.gameOverCounter = 0;
+        }
+
+        // reset the level if the user presses the space key
+        if (restartRequested) {
+            ResetGame(g);
+            telemetryFlags |= TELEMETRY_NEW_GAME;
+        }
+    }
+
+    // make the crashed players' colors flash between red and original color
+    bool anyCrashed = false;
+    for (int i = 0; i < g.players.size(); i++)
+        anyCrashed = anyCrashed || g.players[i].crashed;
+    if (anyCrashed) {
+        g.gameOverCounter++;
+        if (g.gameOverCounter >= ScaledTicks(g, 30))
+            g.gameOverCounter = 0;
+    }
+    for (int i = 0; i < g.players.size(); i++) {
+        if (g.players[i].crashed && g.gameOverCounter < ScaledTicks(g, 15))
+            g.players[i].car.setColor(1.0, 0.0, 0.0);
+        else
+            g.players[i].car.setColor(playerColors[i][0], playerColors[i][1], playerColors[i][2]);
+    }
+
+    // distances covered during this tick
+    float step = g.forwardSpeed * g.tickScale;
+    bool allCrashed = true;
+    for (int i = 0; i < g.players.size(); i++) {
+        PlayerState &p = g.players[i];
+        if (p.crashed)
+            continue;
+        float startX = p.car.position[0];
+        movePlayerLeftOrRight(p.car, lrSpeed * g.tickScale, LaneX(g.config.numLanes, p.curIdx));
+        float dx = p.car.position[0] - startX;
+        GameObject playerAtStart = p.car;
+        playerAtStart.position[0] = startX;
+
+        // check if a collision will happen anywhere along this tick's motion;
+        // relative to an obstacle, the player moves forward by step, so only
+        // the rows starting within the longest obstacle behind to step past
+        // the player's front can be hit
+        float length = p.car.size[2];
+        for (int k = g.carRows.FirstAtOrAfter(-MaxObstacleLength());
+             k < g.carRows.Count() && g.carRows.Z(k) <= length + step; k++) {
+            ObstacleHandle *row = &g.rowObstacles[g.config.numLanes * g.carRows.Slot(k)];
+            for (int j = 0; j < g.config.numLanes; j++) {
+                GameObject *obstacle = g.obstacles.Get(row[j]);
+                if (!obstacle)
+                    continue;
+                obstacle->position[2] = g.carRows.Z(k);
+                if (playerAtStart.willCollideSwept(*obstacle, dx, step)) {
+                    p.crashed = true;
+                    collisions++;
+                }
+            }
+        }
+        allCrashed = allCrashed && p.crashed;
+    }
+    if (allCrashed)
+        g.gameOver = true;
+
+    // move the enemy cars and ground forward each tick
+    g.carRows.Scroll(step);
+    g.groundTiles.Scroll(step);
+    if (ViewScroll(g) >= rebaseDistance)
+        g.worldOrigin += rebaseDistance;
+
+    // respawn rows that are behind the camera to the back
+    while (g.carRows.Z(0) < -5.0) {
+        int slot = g.carRows.Recycle();
+        ObstacleHandle *row = &g.rowObstacles[g.config.numLanes * slot];
+        // the score increases unless the row was empty
+        bool anyEnabled = false;
+        for (int j = 0; j < g.config.numLanes; j++)
+            anyEnabled = anyEnabled || g.obstacles.Get(row[j]);
+        if (anyEnabled) {
+            g.score++;
+        }
+        SpawnObstacleRow(g.obstacles, row, g.config.numLanes, g.lastRowEnabledStatus);
+    }
+    while (g.groundTiles.Z(0) <= -10.0) {
+        g.groundTiles.Recycle();
+    }
+
+    StreamVisible(g);
+}
 
-    glm::mat4 mainCarTrans = TranslateMatrix(mpCar.position[0], 0.41, 0);
-    SetUpCar(identity*mainCarTrans, rm, mpCar.color[0], mpCar.color[1], mpCar.color[2]);
+void ApplyInput(GameState &g, const InputEvent &ev, bool &restartRequested)
+{
+    // move the car by snapping it into one of the lanes
+    bool playing = ev.player < g.players.size();
+    if (ev.action == INPUT_RIGHT && playing)
+        g.players[ev.player].curIdx = fmin(g.config.numLanes - 1, g.players[ev.player].curIdx + 1);
+    else if (ev.action == INPUT_LEFT && playing)
+        g.players[ev.player].curIdx = fmax(0, g.players[ev.player].curIdx - 1);
+    else if (ev.action == INPUT_RESTART)
+        restartRequested = true;
+}
 
-    for (int i = 0; i < cars.size(); i++) {
-        if (cars[i].enabled) {
-            glm::mat4 t = TranslateMatrix(cars[i].position[0], 0.4, cars[i].position[2]);
-            SetUpCar(identity*t, rm, cars[i].color[0], cars[i].color[1], cars[i].color[2]);
-        }
+//
+// The values that decide what a frame looks like. When they are the same
+// as for the last drawn frame, drawing again would produce the same image.
+//
+void VisibleState(GameState &g, int fbWidth, int fbHeight, std::vector<float> &state)
+{
+    state.clear();
+    state.push_back(fbWidth);
+    state.push_back(fbHeight);
+    state.push_back(g.carRows.Z(0)); // the scroll position
+    state.push_back(g.groundTiles.Z(0));
+    for (int i = 0; i < g.players.size(); i++) {
+        GameObject &car = g.players[i].car;
+        state.push_back(car.position[0]);
+        state.insert(state.end(), car.color, car.color + 3);
     }
+}
 
-    for (int i = 0; i < grounds.size(); i++) {
-        SetUpGround(identity*roadTrans, rm , grounds[i]);
+// Sets a view per player and places the player cars, both at ViewScroll
+void SetUpViews(Renderer &r, GameState &g, std::vector<GameObject> &playerCars)
+{
+    glm::vec3 origin(0, 0, 8);
+    glm::vec3 up(0, 1, 0);
+    glm::vec3 camera(0, 6, -7);
+
+    float scroll = ViewScroll(g);
+    playerCars.resize(g.players.size());
+    for (int i = 0; i < g.players.size(); i++) {
+        playerCars[i] = g.players[i].car;
+        playerCars[i].position[2] = scroll;
+        // in split screen each view follows its own player across the lanes
+        glm::vec3 offset(g.players.size() > 1 ? playerCars[i].position[0] : 0, 0, scroll);
+        glm::vec3 eye = camera + offset;
+        glm::vec3 target = origin + offset;
+        r.SetView(i, eye, target, up);
     }
 }
 
-void movePlayerLeftOrRight(GameObject &car, float lrSpeed, float moveToX, float minX = -1.5, float maxX = 1.5) {
-    float curX = car.position[0];
-    float nextX = curX + lrSpeed;
+struct GameOptions
+{
+    const char *telemetryFile; // per-frame telemetry output, NULL = none
+    const char *metricsAddress; // live metrics port or socket path, NULL = none
+    const char *inputScript;   // synthetic input to play back, NULL = none
+    PacingMode  pacing;
+    double      targetFps;     // used by PACING_FIXED
+    double      tickRate;      // simulation ticks per second
+    double      gpuBudgetMs;   // dynamic resolution budget, 0 = off
+    bool        occlusionQueries;
+    bool        benchTransforms; // run the transform benchmark and exit
+    bool        benchObstacles;  // run the obstacle pool benchmark and exit
+    const char *captureTarget;   // .y4m file or PNG file prefix, NULL = no capture
+    RenderManager::AntiAliasing antiAliasing;
+    int         players;         // split-screen players, 1 to maxPlayers
+    GameConfig  config;          // --config file, then the individual options
+    bool        idle;            // skip unchanged frames, throttle when unfocused or hidden
+    RenderManager::DebrisMode debris;
+    bool        gpuCulling;      // cull and draw with a compute pass and indirect draws
+    bool        impostors;       // ray-cast sphere parts on quads instead of drawing the mesh
+    bool        fragmentLighting; // light per pixel instead of per vertex
+    float       specular;        // Ks, 0 leaves the specular term out of the shaders
+    bool        renderStats;     // print the rolling render stats every second
+    int         softwareFrames;  // render this many frames on the CPU and exit, 0 = GL
+    const char *softwareOut;     // PNG prefix for the software frames, NULL = none
+    int         nullFrames;      // build this many frames without GL and exit, 0 = GL
+    const char *recordFile;      // save the --null command stream here, NULL = don't
+    const char *replayFile;      // replay a saved command stream with GL and exit
+};
 
-    if (curX > moveToX) {
-        nextX = curX - lrSpeed;
-    }
+// Sets the config entry called name (an option name without the dashes).
+// Returns false for an unknown name or an out of range value.
+bool SetConfigValue(GameConfig &config, const char *name, const char *value)
+{
+    int n = atoi(value);
+    float v = atof(value);
+    if (strcmp(name, "lanes") == 0 && n >= 2) // a single lane leaves nowhere to dodge
+        config.numLanes = n;
+    else if (strcmp(name, "rows") == 0 && n >= 1)
+        config.numCarRows = n;
+    else if (strcmp(name, "ground-rows") == 0 && n >= 1)
+        config.numGroundRows = n;
+    else if (strcmp(name, "row-spacing") == 0 && v > 2.0) // more than a car length
+        config.carRowSpacing = v;
+    else if (strcmp(name, "speed") == 0 && v > 0.0)
+        config.forwardSpeed = v;
+    else if (strcmp(name, "speed-step") == 0 && v >= 0.0)
+        config.speedIncrease = v;
+    else
+        return false;
+    return true;
+}
 
-    if ((curX < 0 && nextX > 0) || (curX > 0 && nextX < 0))  {
-        car.position[0] = 0;
+// A config file has one "<name> <value>" per line; # starts a comment
+bool LoadConfigFile(const char *filename, GameConfig &config)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open config file %s\n", filename);
+        return false;
     }
-    else if ((curX < moveToX && nextX > moveToX) || (curX > moveToX && nextX < moveToX)) {
-        car.position[0] = moveToX;
+    char line[256];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineNumber++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+        char name[64], value[64];
+        int fields = sscanf(line, "%63s %63s", name, value);
+        if (fields <= 0)
+            continue; // blank line
+        if (fields != 2 || !SetConfigValue(config, name, value)) {
+            fprintf(stderr, "ERROR: bad config entry at %s:%d\n", filename, lineNumber);
+            fclose(f);
+            return false;
+        }
     }
-    else {
-        if (moveToX > curX) {
-            car.position[0] += lrSpeed;
+    fclose(f);
+    return true;
+}
+
+void PrintUsage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [options]\n", prog);
+    fprintf(stderr, "  --telemetry <file>      record per-frame telemetry (.csv = text, otherwise binary)\n");
+    fprintf(stderr, "  --metrics <address>     serve live metrics on a localhost port or a Unix socket path\n");
+    fprintf(stderr, "  --input-script <file>   play back \"<tick> <left|right|restart>\" input events\n");
+    fprintf(stderr, "  --pacing <mode>         uncapped, vsync (default), fixed or adaptive\n");
+    fprintf(stderr, "  --fps <n>               target frame rate for --pacing fixed (default 60)\n");
+    fprintf(stderr, "  --tick-rate <hz>        simulation ticks per second (default 60)\n");
+    fprintf(stderr, "  --dynamic-res <ms>      scale the render resolution to keep GPU time under <ms>\n");
+    fprintf(stderr, "  --occlusion-queries     also cull cars with GL occlusion queries\n");
+    fprintf(stderr, "  --gpu-culling           cull and draw everything on the GPU (needs OpenGL 4.3)\n");
+    fprintf(stderr, "  --impostors             draw lights and leaves as ray-cast quads\n");
+    fprintf(stderr, "  --lighting <mode>       evaluate the lighting per vertex (default) or per fragment\n");
+    fprintf(stderr, "  --specular <ks>         specular coefficient (default 0, no specular term)\n");
+    fprintf(stderr, "  --bench-transforms      print the per-frame transform cost vs car count and exit\n");
+    fprintf(stderr, "  --bench-obstacles       print the obstacle spawn/despawn cost and exit\n");
+    fprintf(stderr, "  --capture <target>      record frames to a .y4m file, or <target>NNNNN.png files\n");
+    fprintf(stderr, "  --aa <mode>             anti-aliasing: none (default), fxaa or msaa4\n");
+    fprintf(stderr, "  --players <n>           split-screen players, 1 to 4 (default 1)\n");
+    fprintf(stderr, "  --debris <mode>         crash debris: gpu (default), cpu or off\n");
+    fprintf(stderr, "  --software <frames>     render frames with the CPU rasterizer, print the timing and exit\n");
+    fprintf(stderr, "  --software-out <prefix> also write the software frames to <prefix>NNNNN.png\n");
+    fprintf(stderr, "  --null <frames>         build frames without GL, print the CPU cost and exit\n");
+    fprintf(stderr, "  --record <file>         with --null, save the draw command stream\n");
+    fprintf(stderr, "  --replay <file>         draw a saved command stream with GL, print the cost and exit\n");
+    fprintf(stderr, "  --render-stats          print draw, upload and state change counts every second\n");
+    fprintf(stderr, "  --no-idle               draw every frame, even when unchanged, unfocused or minimized\n");
+    fprintf(stderr, "  --config <file>         read \"<name> <value>\" lines for the options below\n");
+    fprintf(stderr, "  --lanes <n>             number of lanes, at least 2 (default %d)\n", defaultConfig.numLanes);
+    fprintf(stderr, "  --rows <n>              enemy car rows in the world (default %d)\n", defaultConfig.numCarRows);
+    fprintf(stderr, "  --ground-rows <n>       ground tiles in the world (default %d)\n", defaultConfig.numGroundRows);
+    fprintf(stderr, "  --row-spacing <d>       distance between car rows (default %g)\n", defaultConfig.carRowSpacing);
+    fprintf(stderr, "  --speed <v>             starting forward speed (default %g)\n", defaultConfig.forwardSpeed);
+    fprintf(stderr, "  --speed-step <v>        speed added every 100 ticks (default %g)\n", defaultConfig.speedIncrease);
+}
+
+GameOptions ParseOptions(int argc, char *argv[])
+{
+    GameOptions options;
+    options.telemetryFile = NULL;
+    options.metricsAddress = NULL;
+    options.inputScript = NULL;
+    options.pacing = PACING_VSYNC;
+    options.targetFps = 60.0;
+    options.tickRate = defaultTickRate;
+    options.gpuBudgetMs = 0.0;
+    options.occlusionQueries = false;
+    options.gpuCulling = false;
+    options.impostors = false;
+    options.fragmentLighting = false;
+    options.specular = 0.0f;
+    options.benchTransforms = false;
+    options.benchObstacles = false;
+    options.captureTarget = NULL;
+    options.antiAliasing = RenderManager::AA_NONE;
+    options.players = 1;
+    options.config = defaultConfig;
+    options.idle = true;
+    options.debris = RenderManager::DEBRIS_GPU;
+    options.renderStats = false;
+    options.softwareFrames = 0;
+    options.softwareOut = NULL;
+    options.nullFrames = 0;
+    options.recordFile = NULL;
+    options.replayFile = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--telemetry") == 0 && i+1 < argc) {
+            options.telemetryFile = argv[++i];
         }
-        else if (moveToX < curX){
-            car.position[0] -= lrSpeed;
+        else if (strcmp(argv[i], "--metrics") == 0 && i+1 < argc) {
+            options.metricsAddress = argv[++i];
+        }
+        else if (strcmp(argv[i], "--input-script") == 0 && i+1 < argc) {
+            options.inputScript = argv[++i];
+        }
+        else if (strcmp(argv[i], "--pacing") == 0 && i+1 < argc) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "uncapped") == 0)
+                options.pacing = PACING_UNCAPPED;
+            else if (strcmp(mode, "vsync") == 0)
+                options.pacing = PACING_VSYNC;
+            else if (strcmp(mode, "fixed") == 0)
+                options.pacing = PACING_FIXED;
+            else if (strcmp(mode, "adaptive") == 0)
+                options.pacing = PACING_ADAPTIVE;
+            else {
+                PrintUsage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--fps") == 0 && i+1 < argc && atof(argv[i+1]) > 0.0) {
+            options.targetFps = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tick-rate") == 0 && i+1 < argc && atof(argv[i+1]) > 0.0) {
+            options.tickRate = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--dynamic-res") == 0 && i+1 < argc && atof(argv[i+1]) > 0.0) {
+            options.gpuBudgetMs = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--occlusion-queries") == 0) {
+            options.occlusionQueries = true;
+        }
+        else if (strcmp(argv[i], "--gpu-culling") == 0) {
+            options.gpuCulling = true;
+        }
+        else if (strcmp(argv[i], "--impostors") == 0) {
+            options.impostors = true;
+        }
+        else if (strcmp(argv[i], "--lighting") == 0 && i+1 < argc
+                 && (strcmp(argv[i+1], "vertex") == 0 || strcmp(argv[i+1], "fragment") == 0)) {
+            options.fragmentLighting = strcmp(argv[++i], "fragment") == 0;
+        }
+        else if (strcmp(argv[i], "--specular") == 0 && i+1 < argc && atof(argv[i+1]) >= 0.0) {
+            options.specular = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bench-transforms") == 0) {
+            options.benchTransforms = true;
+        }
+        else if (strcmp(argv[i], "--bench-obstacles") == 0) {
+            options.benchObstacles = true;
+        }
+        else if (strcmp(argv[i], "--capture") == 0 && i+1 < argc) {
+            options.captureTarget = argv[++i];
+        }
+        else if (strcmp(argv[i], "--players") == 0 && i+1 < argc
+                 && atoi(argv[i+1]) >= 1 && atoi(argv[i+1]) <= maxPlayers) {
+            options.players = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--software") == 0 && i+1 < argc && atoi(argv[i+1]) > 0) {
+            options.softwareFrames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--software-out") == 0 && i+1 < argc) {
+            options.softwareOut = argv[++i];
+        }
+        else if (strcmp(argv[i], "--null") == 0 && i+1 < argc && atoi(argv[i+1]) > 0) {
+            options.nullFrames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i+1 < argc) {
+            options.recordFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i+1 < argc) {
+            options.replayFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--render-stats") == 0) {
+            options.renderStats = true;
+        }
+        else if (strcmp(argv[i], "--no-idle") == 0) {
+            options.idle = false;
+        }
+        else if (strcmp(argv[i], "--config") == 0 && i+1 < argc) {
+            if (!LoadConfigFile(argv[++i], options.config))
+                exit(EXIT_FAILURE);
+        }
+        else if (strncmp(argv[i], "--", 2) == 0 && i+1 < argc
+                 && SetConfigValue(options.config, argv[i] + 2, argv[i+1])) {
+            i++;
+        }
+        else if (strcmp(argv[i], "--debris") == 0 && i+1 < argc) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "off") == 0)
+                options.debris = RenderManager::DEBRIS_OFF;
+            else if (strcmp(mode, "gpu") == 0)
+                options.debris = RenderManager::DEBRIS_GPU;
+            else if (strcmp(mode, "cpu") == 0)
+                options.debris = RenderManager::DEBRIS_CPU;
+            else {
+                PrintUsage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[i], "--aa") == 0 && i+1 < argc) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "none") == 0)
+                options.antiAliasing = RenderManager::AA_NONE;
+            else if (strcmp(mode, "fxaa") == 0)
+                options.antiAliasing = RenderManager::AA_FXAA;
+            else if (strcmp(mode, "msaa4") == 0)
+                options.antiAliasing = RenderManager::AA_MSAA4;
+            else {
+                PrintUsage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else {
+            PrintUsage(argv[0]);
+            exit(EXIT_FAILURE);
         }
     }
+    return options;
 }
 
-GameObject 
-setUpMainPlayerCar(float color[3]) {
-    //                      (            color           |  position | scale  )
-    GameObject mainPlayerCar(color[0], color[1], color[2], 0, 0.01, 0, 1, 1, 2);
-    return mainPlayerCar;
+//
+// The game without a window, for the headless backends: one tick per
+// frame, with input from --input-script if any, drawn through any Renderer.
+//
+// The lighting set by --lighting and --specular
+RenderManager::Lighting SceneLighting(const GameOptions &options)
+{
+  RenderManager::Lighting lighting = {glm::normalize(glm::vec3(0, 6, -10)),
+                                      glm::vec4(0.3, 0.7, options.specular, 50.5),
+                                      options.fragmentLighting};
+  return lighting;
 }
 
-std::vector<GameObject>
-setUpEnemyCars(int numRows, float spacing, bool lastRowEnabledStatus[3]) {
-    std::vector<GameObject> cars;
-
-    for (int row = 0; row < numRows; row++) {
-        //             ( color |     position     |  scale )
-        GameObject car1(0, 0, 0, -1.5, 0, spacing*row, 1, 1, 2);
-        GameObject car2(0, 0, 0, 0   , 0, spacing*row, 1, 1, 2);
-        GameObject car3(0, 0, 0, 1.5 , 0, spacing*row, 1, 1, 2);
+class HeadlessGame
+{
+  public:
+         HeadlessGame(const GameOptions &options);
+    void Tick(int frame);
+    void Draw(Renderer &);
+    OcclusionCuller &GetCuller() { return culler; };
 
-        GameObject* curRow[3] = {&car1, &car2, &car3};
-        resetEnemyCarRow(curRow, 0.0, lastRowEnabledStatus);
+  private:
+    GameScene               scene;
+    OcclusionCuller         culler;
+    GameState               game;
+    InputQueue              input;
+    InputScript             script;
+    std::vector<GameObject> playerCars;
+};
 
-        // disable the first set of cars so that the player can orient themselves
-        if (row < 2) {
-            car1.enabled = false;
-            car2.enabled = false;
-            car3.enabled = false;
-        }
+HeadlessGame::HeadlessGame(const GameOptions &options)
+  : scene(options.config.numLanes)
+{
+  culler.SetLaneCount(options.config.numLanes);
+  game.config = options.config;
+  game.players.resize(options.players);
+  game.tickScale = referenceTickRate / options.tickRate;
+  ResetGame(game);
+  if (options.inputScript != NULL && !script.Load(options.inputScript))
+    exit(EXIT_FAILURE);
+}
 
-        cars.push_back(car1);
-        cars.push_back(car2);
-        cars.push_back(car3);
-    }
+void HeadlessGame::Tick(int frame)
+{
+  script.Inject(frame, input, 0.0);
+  bool restartRequested = false;
+  InputEvent ev;
+  while (input.Pop(ev))
+    ApplyInput(game, ev, restartRequested);
+  int collisions = 0;
+  uint32_t telemetryFlags = 0;
+  SimulateTick(game, restartRequested, collisions, telemetryFlags);
+}
 
-    return cars;
+void HeadlessGame::Draw(Renderer &r)
+{
+  r.BeginFrame();
+  SetUpViews(r, game, playerCars);
+  SetUpGame(game.counter, r, scene, culler, playerCars, game.visibleCars, game.visibleGrounds);
+  r.EndFrame();
 }
 
-std::vector<GameObject> 
-setUpGrounds(int numRows) {
-    std::vector<GameObject> grounds;
+void PrintHeadlessCulling(OcclusionCuller &culler)
+{
+  CullStats cull = culler.GetTotalStats();
+  fprintf(stderr, "Culling: %u of %u car instances rejected (frustum %u, occlusion %u)\n",
+          cull.Rejected(), cull.tested, cull.frustumRejected, cull.occlusionRejected);
+}
 
-    for (int i = 0; i < numRows; i++) {
-        //          ( color |    position   |  scale )
-        GameObject g(0, 0, 0, 0, 5.0, i*10.0, 0, 0, 0);
-        grounds.push_back(g);
+// Draws every frame with the software rasterizer at the default window size
+void RunSoftwareRenderer(const GameOptions &options)
+{
+  SoftwareRasterizer sr(700, 700);
+  sr.SetViewCount(options.players);
+  sr.SetLighting(SceneLighting(options));
+  HeadlessGame game(options);
+
+  for (int frame = 0; frame < options.softwareFrames; frame++) {
+    game.Tick(frame);
+    game.Draw(sr);
+    if (options.softwareOut != NULL) {
+      char name[1024];
+      snprintf(name, sizeof(name), "%s%05d.png", options.softwareOut, frame);
+      if (!sr.WritePNG(name)) {
+        fprintf(stderr, "ERROR: could not write %s\n", name);
+        exit(EXIT_FAILURE);
+      }
     }
-
-    return grounds;
+  }
+  sr.PrintStats();
+  PrintHeadlessCulling(game.GetCuller());
 }
 
-int main() 
+//
+// Builds every frame into the recording backend, so the time is the CPU
+// cost of building and submitting the scene with no driver underneath.
+//
+void RunNullRenderer(const GameOptions &options)
 {
-  // ------------ CONFIG --------------
+  RecordingRenderer recorder(options.recordFile != NULL);
+  recorder.SetViewCount(options.players);
+  HeadlessGame game(options);
+
+  double drawSeconds = 0.0;
+  for (int frame = 0; frame < options.nullFrames; frame++) {
+    game.Tick(frame);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    game.Draw(recorder);
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    drawSeconds += d.count();
+  }
+  int frames = options.nullFrames;
+  fprintf(stderr, "Null renderer: %d frames, building and submitting %.3f ms per frame, "
+          "%.1f draws and %.1f KB of commands per frame\n",
+          frames, drawSeconds / frames * 1000.0, (double) recorder.GetDraws() / frames,
+          recorder.GetBytes() / 1024.0 / frames);
+  PrintHeadlessCulling(game.GetCuller());
+  if (options.recordFile != NULL) {
+    if (!recorder.Save(options.recordFile)) {
+      fprintf(stderr, "ERROR: could not write %s\n", options.recordFile);
+      exit(EXIT_FAILURE);
+    }
+    fprintf(stderr, "Command stream saved to %s\n", options.recordFile);
+  }
+}
 
-  const float defaultForwardSpeed = 0.3;
-  const int   numGroundRows       = 12; 
-  const int   numCarRows          = 7;
-  const float carRowSpacing       = 18.0;
+//
+// Plays a saved command stream into the GL backend as fast as --pacing
+// allows, so the time is the driver and GPU cost alone.
+//
+void RunReplay(const GameOptions &options)
+{
+  CommandStreamPlayer player;
+  if (!player.Load(options.replayFile))
+    exit(EXIT_FAILURE);
 
-  // ----------------------------------
-  RenderManager rm;
+  RenderManager rm(NULL, options.antiAliasing);
   GLFWwindow *window = rm.GetWindow();
+  rm.SetLighting(SceneLighting(options));
+  rm.SetSphereImpostors(options.impostors);
+  FramePacer pacer(options.pacing, options.targetFps);
+  pacer.Start();
+
+  double submitSeconds = 0.0;
+  int frames = 0;
+  for (int f = 0; f < player.GetFrameCount() && !glfwWindowShouldClose(window); f++) {
+    glfwPollEvents();
+    double start = glfwGetTime();
+    rm.BeginFrame();
+    player.Replay(f, rm);
+    rm.EndFrame();
+    submitSeconds += glfwGetTime() - start;
+    frames++;
+    pacer.WaitForNextFrame();
+    glfwSwapBuffers(window);
+  }
+  if (frames > 0) {
+    fprintf(stderr, "Replay: %d frames, CPU %.3f ms per frame in BeginFrame, Render and EndFrame, "
+            "GPU frame time %.2f ms\n", frames, submitSeconds / frames * 1000.0, rm.GetGPUFrameTime() * 1000.0);
+  }
+  rm.PrintRenderStats();
+  glfwTerminate();
+}
 
-  glm::vec3 origin(0, 0, 8);
-  glm::vec3 up(0, 1, 0);
-  glm::vec3 camera(0, 6, -7);
-
-  bool lastRowEnabledStatus[3] = {false, false, false}; // keep track of which cars were enabled in the previous row
-  float defaultMainPlayerColor[3] = {0, 0.396, 1}; // blue
-  GameObject mainPlayerCar = setUpMainPlayerCar(defaultMainPlayerColor);
-  std::vector<GameObject> cars = setUpEnemyCars(numCarRows, carRowSpacing,lastRowEnabledStatus);
-  std::vector<GameObject> grounds = setUpGrounds(numGroundRows);
+int main(int argc, char *argv[]) 
+{
+  GameOptions options = ParseOptions(argc, argv);
 
-  int counter = 0;
-  int gameOverCounter = 0;
+  if (options.benchTransforms) {
+    RunTransformBenchmark();
+    return 0;
+  }
+  if (options.benchObstacles) {
+    RunObstacleBenchmark();
+    return 0;
+  }
+  if (options.softwareFrames > 0) {
+    RunSoftwareRenderer(options);
+    return 0;
+  }
+  if (options.nullFrames > 0) {
+    RunNullRenderer(options);
+    return 0;
+  }
+  if (options.replayFile != NULL) {
+    RunReplay(options);
+    return 0;
+  }
 
-  float forwardSpeed = defaultForwardSpeed;
+  StartupTimeline startup;
+  RenderManager rm(&startup, options.antiAliasing);
+  GLFWwindow *window = rm.GetWindow();
+  rm.SetDynamicResolution(options.gpuBudgetMs);
+  rm.SetViewCount(options.players);
+  rm.SetDebrisMode(options.debris);
+  rm.SetLighting(SceneLighting(options));
+  rm.SetSphereImpostors(options.impostors);
+
+  FramePacer pacer(options.pacing, options.targetFps);
+  pacer.Start();
+
+  GameScene scene(options.config.numLanes);
+  OcclusionCuller culler;
+  culler.SetUseQueries(options.occlusionQueries);
+  culler.SetLaneCount(options.config.numLanes);
+  GPUCuller gpuCuller;
+  bool gpuCulling = options.gpuCulling && gpuCuller.Init(rm);
+
+  GameState game;
+  game.config = options.config;
+  game.players.resize(options.players);
+  game.tickScale = referenceTickRate / options.tickRate;
+  ResetGame(game);
+
+  TelemetryWriter telemetry;
+  if (!telemetry.Start(options.telemetryFile))
+    exit(EXIT_FAILURE);
+  MetricsServer metrics;
+  if (options.metricsAddress != NULL && !metrics.Start(options.metricsAddress))
+    exit(EXIT_FAILURE);
+  uint32_t telemetryFlags = TELEMETRY_NEW_GAME;
 
-  bool rightKeyPressed = false;
-  bool leftKeyPressed = false;
-  const float locations[3] = {1.5, 0.0, -1.5};
-  int curIdx = 1;
-  int score = 0;
-  bool gameOver = false;
-  bool shouldPrintScore = true;
+  FrameCapture capture;
+  int captureWidth, captureHeight;
+  glfwGetFramebufferSize(window, &captureWidth, &captureHeight);
+  if (!capture.Start(options.captureTarget, captureWidth, captureHeight, options.targetFps))
+    exit(EXIT_FAILURE);
+  double lastFrameStart = glfwGetTime();
 
-  cerr << "\n\n----------------------------------------\n";
+  InputQueue input;
+  glfwSetWindowUserPointer(window, &input);
+  glfwSetKeyCallback(window, KeyCallback);
+  InputScript script;
+  if (options.inputScript != NULL && !script.Load(options.inputScript))
+    exit(EXIT_FAILURE);
+  LatencyStats inputToSim;
+  LatencyStats inputToPresent;
+  std::vector<double> presentPending; // receive times of the events applied this frame
+  int tick = 0; // like counter, but never reset by a restart
+
+  const double tickPeriod = 1.0 / options.tickRate;
+  double tickAccumulator = tickPeriod; // run the first tick straight away
+  bool firstFrame = true;
+  std::vector<GameObject> playerCars;
+  std::vector<bool> debrisSpawned(options.players, false);
+  // CPU seconds per subsystem over the whole run, to see how each scales
+  // with the lane and row counts
+  double simSeconds = 0.0, sceneSeconds = 0.0, submitSeconds = 0.0;
+  int frames = 0;
+  UtilizationMeter utilization;
+  std::vector<float> visible, lastVisible;
+  double lastDrawTime = lastFrameStart;
+  double lastStatsPrint = lastFrameStart;
+  // accumulated over the iterations --idle skips, until the next record
+  int collisions = 0;
+  int ticks = 0;
+  uint32_t allocationsAtStart = threadAllocations;
+  startup.Mark("game state ready");
 
   while (!glfwWindowShouldClose(window)) 
   {
-    double angle=counter/300.0*2*M_PI;
-    counter++;
-
-    // increase the forward speed by a little over time
-    if (counter % 100 == 0) { 
-        forwardSpeed += 0.03;
+    int fbWidth, fbHeight;
+    glfwGetFramebufferSize(window, &fbWidth, &fbHeight);
+    bool hidden = glfwGetWindowAttrib(window, GLFW_ICONIFIED) || fbWidth == 0 || fbHeight == 0;
+    bool unfocused = !glfwGetWindowAttrib(window, GLFW_FOCUSED);
+    if (options.idle && hidden && !firstFrame) {
+        // nothing can be seen, so pause the game instead of catching up later
+        glfwWaitEventsTimeout(hiddenWaitSeconds);
+        lastFrameStart = glfwGetTime();
+        tickAccumulator = 0.0;
+        utilization.Sample(true, rm.GetGPUBusyTime(), false);
+        continue;
     }
 
-    float lrSpeed = forwardSpeed / 1.5; // the speed to move the main player left or right
-
-    rm.SetView(camera, origin, up);
+    double frameStart = glfwGetTime();
+    float frameTime = frameStart - lastFrameStart;
+    lastFrameStart = frameStart;
 
-    // wipe the drawing surface clear
-    glClearColor(0.501, 0.819, 1, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-    if (gameOver) {
-        forwardSpeed = 0.0;
-        lrSpeed = 0.0;
+    // update other events like input handling
+    glfwPollEvents();
 
-        if (shouldPrintScore) {
-            cerr << "\rFinal score: " << score << "\t\t\t\n\n";
-            cerr << "- Press SPACE to play again!\n";
-            cerr << "- Close the window to exit.\n";
-            shouldPrintScore = false;
-            gameOverCounter = 0;
+    double simStart = glfwGetTime();
+    tickAccumulator = fmin(tickAccumulator + frameTime, maxTicksPerFrame * tickPeriod);
+    while (tickAccumulator >= tickPeriod) {
+        tickAccumulator -= tickPeriod;
+        ticks++;
+        script.Inject(tick++, input, frameStart);
+
+        // apply every input event received since the last tick
+        bool restartRequested = false;
+        double tickTime = glfwGetTime();
+        InputEvent ev;
+        while (input.Pop(ev)) {
+            ApplyInput(game, ev, restartRequested);
+            inputToSim.Add(tickTime - ev.time);
+            presentPending.push_back(ev.time);
         }
 
-        // reset the level if the user presses the space key
-        if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS) {
-            mainPlayerCar = setUpMainPlayerCar(defaultMainPlayerColor);
-            cars = setUpEnemyCars(numCarRows, carRowSpacing,lastRowEnabledStatus);
-            grounds = setUpGrounds(numGroundRows);
-            gameOver = false;
-            shouldPrintScore = true;
-            forwardSpeed = defaultForwardSpeed;
-            counter = 0;
-            curIdx = 1;
-            score = 0;
-            cerr << "\n\n----------------------------------------\n";
-        }
-
-        // make the main player color flash between red and original color
-        gameOverCounter++;
-        if (gameOverCounter < 15) {
-            mainPlayerCar.setColor(1.0, 0.0, 0.0);
-        }
-        else if (gameOverCounter < 30) {
-            mainPlayerCar.setColor(defaultMainPlayerColor[0], defaultMainPlayerColor[1], defaultMainPlayerColor[2]);
-        }
-        else {
-            gameOverCounter = 0;
-        }
+        SimulateTick(game, restartRequested, collisions, telemetryFlags);
     }
-    else {
-        mainPlayerCar.setColor(defaultMainPlayerColor[0], defaultMainPlayerColor[1], defaultMainPlayerColor[2]);
+    double sceneStart = glfwGetTime();
+    simSeconds += sceneStart - simStart;
+
+    // throw debris from the cars that crashed since the last frame
+    for (int i = 0; i < game.players.size(); i++) {
+        PlayerState &p = game.players[i];
+        if (p.crashed && !debrisSpawned[i]) {
+            GameObject &car = p.car;
+            glm::vec3 center(car.position[0] + car.size[0] / 2, car.position[1] + car.size[1] / 2,
+                             car.position[2] + car.size[2] / 2);
+            rm.SpawnDebris(center, glm::vec3(playerColors[i][0], playerColors[i][1], playerColors[i][2]));
+        }
+        debrisSpawned[i] = p.crashed;
     }
 
-    // move the car by snapping it into one of the lanes
-    if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) {
-        if (!rightKeyPressed)
-            curIdx = fmin(2, curIdx + 1);
-        rightKeyPressed = true;
-    }
-    if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_RELEASE) {
-        rightKeyPressed = false;
-    }
-    if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) {
-        if (!leftKeyPressed)
-            curIdx = fmax(0, curIdx - 1);
-        leftKeyPressed = true;
+    bool idle = game.gameOver || unfocused;
+    if (options.idle) {
+        // redraw only when the picture would change, and not too often
+        // when nobody is looking at the window
+        VisibleState(game, fbWidth, fbHeight, visible);
+        bool throttled = unfocused && frameStart - lastDrawTime < 1.0 / idleFps;
+        if (!firstFrame && ((visible == lastVisible && !rm.DebrisActive()) || throttled)) {
+            double wait = throttled ? lastDrawTime + 1.0 / idleFps - glfwGetTime()
+                                    : tickPeriod - tickAccumulator;
+            glfwWaitEventsTimeout(fmax(wait, 0.001));
+            utilization.Sample(idle, rm.GetGPUBusyTime(), false);
+            continue;
+        }
+        lastVisible.swap(visible);
     }
-    if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_RELEASE) {
-        leftKeyPressed = false;
+    frameTime = frameStart - lastDrawTime; // since the previous drawn frame
+    lastDrawTime = frameStart;
+
+    rm.BeginFrame();
+    rm.UpdateDebris(frameTime);
+    rm.SetDebrisOffset(glm::vec3(0, 0, ViewScroll(game)));
+    SetUpViews(rm, game, playerCars);
+    if (gpuCulling) {
+        scene.Sync(playerCars, game.visibleCars, game.visibleGrounds);
+        gpuCuller.Draw(rm, scene);
     }
-
-    movePlayerLeftOrRight(mainPlayerCar, lrSpeed, locations[curIdx]);
-
-    // move the enemy cars and ground forward each frame
-    for (int i = 0; i < cars.size(); i+=3) {
-        cars[i].moveForward(forwardSpeed);
-        cars[i+1].moveForward(forwardSpeed);
-        cars[i+2].moveForward(forwardSpeed);
-
-        // check if a collision will happen
-        for (int j = 0; j < 3; j++) {
-            if (cars[i + j].enabled && mainPlayerCar.willCollide(cars[i + j])) {
-                // mainPlayerCar.setColor(1, 0, 0);
-                gameOver = true;
-            }
-        }
-
-        // check if the score should increase
-        if (cars[i].position[2] < -5.0) {
-            // make sure all three cars are not enabled
-            if (!(!cars[i].enabled && !cars[i+1].enabled && !cars[i+2].enabled)) {
-                score++;
-                cerr << "\rScore: " << score  << "\t\t\t"; // <<<<<<<<<<<<<
-            }
-        }
-
-        // respawn to the back if the car is behind camera
-        if (cars[i].position[2] < -5.0) {
-            GameObject* row[3] = {&cars[i], &cars[i+1], &cars[i+2]};
-            resetEnemyCarRow(row, -numCarRows*carRowSpacing, lastRowEnabledStatus); // reset back
-        }
+    else
+        SetUpGame(game.counter, rm, scene, culler, playerCars, game.visibleCars, game.visibleGrounds);
+    double submitStart = glfwGetTime();
+    sceneSeconds += submitStart - sceneStart;
+    rm.EndFrame();
+    submitSeconds += glfwGetTime() - submitStart;
+    frames++;
+    if (options.renderStats && frameStart - lastStatsPrint >= 1.0) {
+        rm.PrintRenderStats();
+        lastStatsPrint = frameStart;
     }
+    capture.Capture(frameTime);
+
+    TelemetryRecord rec;
+    rec.frame = game.counter;
+    rec.frameTime = frameTime;
+    rec.score = game.score;
+    rec.forwardSpeed = game.forwardSpeed;
+    rec.collisions = collisions;
+    rec.drawCalls = rm.GetDrawCalls();
+    rec.culled = culler.GetFrameStats().Rejected();
+    rec.flags = telemetryFlags;
+    rec.ticks = ticks;
+    rec.allocations = threadAllocations - allocationsAtStart;
+    telemetry.Push(rec);
+    metrics.Push(rec);
+    telemetryFlags = 0;
+    collisions = 0;
+    ticks = 0;
+    allocationsAtStart = threadAllocations;
+
+    pacer.WaitForNextFrame();
+    // put the stuff we've been drawing onto the display
+    glfwSwapBuffers(window);
 
-    for (int i = 0; i < grounds.size(); i++) {
-        grounds[i].moveForward(forwardSpeed);
-        if (grounds[i].position[2] <= -10.0) {
-            grounds[i].moveForward(-10.0 * numGroundRows); // reset back
-        }
+    if (firstFrame) {
+        startup.Mark("first frame presented");
+        startup.Print();
+        firstFrame = false;
     }
+    double presentTime = glfwGetTime();
+    for (int i = 0; i < presentPending.size(); i++)
+        inputToPresent.Add(presentTime - presentPending[i]);
+    presentPending.clear();
+    utilization.Sample(idle, rm.GetGPUBusyTime(), true);
+  }
 
-    SetUpGame(counter, rm, mainPlayerCar, cars, grounds);
-
-
-
-    // update other events like input handling
-    glfwPollEvents();
-    // put the stuff we've been drawing onto the display
-    glfwSwapBuffers(window);
+  telemetry.Stop();
+  metrics.Stop();
+  capture.Stop();
+  capture.PrintOverhead();
+  if (telemetry.GetDropped() > 0)
+    fprintf(stderr, "Telemetry: dropped %u records\n", telemetry.GetDropped());
+  inputToSim.Print("Input-to-simulation latency");
+  inputToPresent.Print("Input-to-present latency");
+  if (frames > 0) {
+    fprintf(stderr, "World of %d lanes x %d rows, per frame: simulation %.3f ms, scene and culling %.3f ms, draw submission %.3f ms\n",
+            game.config.numLanes, game.config.numCarRows, simSeconds / frames * 1000.0,
+            sceneSeconds / frames * 1000.0, submitSeconds / frames * 1000.0);
   }
+  fprintf(stderr, "GPU frame time %.2f ms, resolution scale %.2f\n",
+          rm.GetGPUFrameTime()*1000.0, rm.GetResolutionScale());
+  rm.PrintAntiAliasingCost();
+  utilization.Print();
+  rm.PrintDebrisCost();
+  rm.PrintShaderVariants();
+  rm.PrintRenderStats();
+  CullStats cull = culler.GetTotalStats();
+  if (gpuCulling)
+    fprintf(stderr, "Culling: on the GPU, %d resident parts, %.0f bytes uploaded per frame\n",
+            gpuCuller.GetItemCount(), gpuCuller.GetUploadPerFrame());
+  else
+    fprintf(stderr, "Culling: %u of %u car instances rejected (frustum %u, occlusion %u, queries %u)\n",
+            cull.Rejected(), cull.tested, cull.frustumRejected, cull.occlusionRejected, cull.queryRejected);
 
   // close GL context and any other GLFW resources
   glfwTerminate();
   return 0;
 }
     
+//
+// Shared by the variants: the view block, the light and the lighting
+// terms the variant's #defines keep. The position and normal are the
+// mesh's own, untransformed.
+//
+const char *GetShaderPrelude()
+{
+   static char shaderPrelude[2048];
+   strcpy(shaderPrelude, 
+           "layout (std140) uniform View {\n"
+           "  mat4 viewProjection;\n"
+           "  vec4 cameraloc;\n"
+           "};\n"
+           "uniform vec3 lightdir;\n"
+           "uniform vec4 lightcoeff;\n"
+           "float shading(vec3 position, vec3 normal) {\n"
+           "  float amount = 0.0;\n"
+           "#ifdef AMBIENT\n"
+           "  amount += lightcoeff[0];\n"
+           "#endif\n"
+           "#if defined(DIFFUSE) || defined(SPECULAR)\n"
+           "  float diffuse = max(0.0, dot(lightdir, normal));\n"
+           "#endif\n"
+           "#ifdef DIFFUSE\n"
+           "  amount += lightcoeff[1]*diffuse;\n"
+           "#endif\n"
+           "#ifdef SPECULAR\n"
+           "  vec3 viewdir = normalize(cameraloc.xyz - position);\n"
+           "  vec3 r = normalize((2.0 * diffuse) * normal - lightdir);\n"
+           "  amount += lightcoeff[2]*pow(max(0.0, dot(r, viewdir)), lightcoeff[3]);\n"
+           "#endif\n"
+           "  return amount;\n"
+           "}\n"
+         );
+   return shaderPrelude;
+}
+
 const char *GetVertexShader()
 {
-   static char vertexShader[1024];
+   static char vertexShader[2048];
    strcpy(vertexShader, 
-           "#version 400\n"
            "layout (location = 0) in vec3 vertex_position;\n"
-           "layout (location = 1) in vec3 vertex_normal;"
-           "uniform mat4 MVP;\n"
-           "uniform vec3 cameraloc;\n"
-           "uniform vec3 lightdir;\n"
-           "uniform vec4 lightcoeff;\n"
+           "layout (location = 1) in vec3 vertex_normal;\n"
+           "#ifdef INSTANCED\n"
+           "layout (location = 2) in mat4 instance_model;\n"
+           "layout (location = 6) in vec4 instance_color;\n"
+           "flat out vec3 color;\n"
+           "#else\n"
+           "uniform mat4 model;\n"
+           "#endif\n"
+           "#ifdef PER_FRAGMENT\n"
+           "out vec3 position;\n"
+           "out vec3 normal;\n"
+           "#else\n"
            "out float shading_amount;\n"
+           "#endif\n"
            "void main() {\n"
-           "  gl_Position = MVP*vec4(vertex_position, 1.0);\n"
-
-           "  vec3 viewdir = cameraloc - vertex_position;"
-           "       viewdir = normalize(viewdir);"
-
-           "  float diffuse = dot(lightdir, vertex_normal);"
-           "        diffuse = max(0.0, diffuse);"
-
-           "  vec3 r = (2.0 * diffuse) * vertex_normal - lightdir;"
-           "       r = normalize(r);"
-
-           "  float specular = dot(r, viewdir);"
-           "        specular = max(0.0, specular);"
-           "        specular = pow(specular, lightcoeff[3]);"
-
-           "  shading_amount = lightcoeff[0] + lightcoeff[1]*diffuse + lightcoeff[2]*specular;"
+           "#ifdef INSTANCED\n"
+           "  gl_Position = viewProjection*instance_model*vec4(vertex_position, 1.0);\n"
+           "  color = instance_color.rgb;\n"
+           "#else\n"
+           "  gl_Position = viewProjection*model*vec4(vertex_position, 1.0);\n"
+           "#endif\n"
+           "#ifdef PER_FRAGMENT\n"
+           "  position = vertex_position;\n"
+           "  normal = vertex_normal;\n"
+           "#else\n"
+           "  shading_amount = shading(vertex_position, vertex_normal);\n"
+           "#endif\n"
            "}\n"
          );
    return vertexShader;
@@ -1219,17 +7142,290 @@ const char *GetFragmentShader()
 {
    static char fragmentShader[1024];
    strcpy(fragmentShader, 
-           "#version 400\n"
+           "#ifdef INSTANCED\n"
+           "flat in vec3 color;\n"
+           "#else\n"
            "uniform vec3 color;\n"
+           "#endif\n"
+           "#ifdef PER_FRAGMENT\n"
+           "in vec3 position;\n"
+           "in vec3 normal;\n"
+           "#else\n"
            "in float shading_amount;\n"
+           "#endif\n"
            "out vec4 frag_color;\n"
            "void main() {\n"
-           "  frag_color = vec4(color, 1.0);\n"
-           "  frag_color[0] = min(1.0, frag_color[0] * shading_amount);"
-           "  frag_color[1] = min(1.0, frag_color[1] * shading_amount);"
-           "  frag_color[2] = min(1.0, frag_color[2] * shading_amount);"
+           "#ifdef PER_FRAGMENT\n"
+           "  float shading_amount = shading(position, normalize(normal));\n"
+           "#endif\n"
+           "  frag_color = vec4(min(vec3(1.0), color * shading_amount), 1.0);\n"
            "}\n"
          );
    return fragmentShader;
 }
 
+// Generates a triangle covering the screen from gl_VertexID alone
+const char *GetFXAAVertexShader()
+{
+   static char fxaaVertexShader[1024];
+   strcpy(fxaaVertexShader, 
+           "#version 400\n"
+           "out vec2 uv;\n"
+           "void main() {\n"
+           "  uv = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+           "  gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);\n"
+           "}\n"
+         );
+   return fxaaVertexShader;
+}
+
+//
+// FXAA, the single-pass version: find the local edge direction from the
+// luma of the four diagonal neighbours, then blend along it with two or
+// four taps, falling back to two when four overshoot the local range.
+//
+const char *GetFXAAFragmentShader()
+{
+   static char fxaaFragmentShader[2048];
+   strcpy(fxaaFragmentShader, 
+           "#version 400\n"
+           "uniform sampler2D scene;\n"
+           "uniform vec2 texel;\n"
+           "uniform vec2 uvScale;\n"
+           "uniform vec2 uvMax;\n"
+           "in vec2 uv;\n"
+           "out vec4 frag_color;\n"
+           "vec3 Tap(vec2 p) { return texture(scene, min(p, uvMax)).rgb; }\n"
+           "float Luma(vec3 c) { return dot(c, vec3(0.299, 0.587, 0.114)); }\n"
+           "void main() {\n"
+           "  vec2 p = uv * uvScale;\n"
+           "  float nw = Luma(Tap(p + vec2(-1.0, -1.0) * texel));\n"
+           "  float ne = Luma(Tap(p + vec2( 1.0, -1.0) * texel));\n"
+           "  float sw = Luma(Tap(p + vec2(-1.0,  1.0) * texel));\n"
+           "  float se = Luma(Tap(p + vec2( 1.0,  1.0) * texel));\n"
+           "  vec3 rgbM = Tap(p);\n"
+           "  float m = Luma(rgbM);\n"
+           "  float lumaMin = min(m, min(min(nw, ne), min(sw, se)));\n"
+           "  float lumaMax = max(m, max(max(nw, ne), max(sw, se)));\n"
+           "  vec2 dir = vec2((sw + se) - (nw + ne), (nw + sw) - (ne + se));\n"
+           "  float reduce = max((nw + ne + sw + se) * 0.03125, 1.0 / 128.0);\n"
+           "  float rcpMin = 1.0 / (min(abs(dir.x), abs(dir.y)) + reduce);\n"
+           "  dir = clamp(dir * rcpMin, vec2(-8.0), vec2(8.0)) * texel;\n"
+           "  vec3 a = 0.5 * (Tap(p + dir * (1.0/3.0 - 0.5)) + Tap(p + dir * (2.0/3.0 - 0.5)));\n"
+           "  vec3 b = a * 0.5 + 0.25 * (Tap(p - dir * 0.5) + Tap(p + dir * 0.5));\n"
+           "  float lumaB = Luma(b);\n"
+           "  frag_color = vec4((lumaB < lumaMin || lumaB > lumaMax) ? a : b, 1.0);\n"
+           "}\n"
+         );
+   return fxaaFragmentShader;
+}
+
+//
+// Debris update, run with transform feedback: spawns a particle from a
+// hash of its index, or integrates it with gravity and a damped bounce on
+// the road. Must match DebrisSimulator.
+//
+const char *GetDebrisUpdateShader()
+{
+   static char debrisUpdateShader[2048];
+   strcpy(debrisUpdateShader, 
+           "#version 400\n"
+           "layout (location = 0) in vec4 posAge;\n"
+           "layout (location = 1) in vec4 velocity;\n"
+           "uniform vec3 origin;\n"
+           "uniform int spawn;\n"
+           "uniform uint seed;\n"
+           "uniform float dt;\n"
+           "out vec4 outPosAge;\n"
+           "out vec4 outVelocity;\n"
+           "float Random(uint x) {\n"
+           "  x ^= x >> 16; x *= 0x7feb352dU;\n"
+           "  x ^= x >> 15; x *= 0x846ca68bU;\n"
+           "  x ^= x >> 16;\n"
+           "  return float(x >> 8) * (1.0 / 16777216.0);\n"
+           "}\n"
+           "void main() {\n"
+           "  if (spawn != 0) {\n"
+           "    uint id = uint(gl_VertexID) * 4u + seed;\n"
+           "    float angle = Random(id) * 6.2831853;\n"
+           "    float up = Random(id + 1u);\n"
+           "    float speed = 2.0 + 10.0 * Random(id + 2u);\n"
+           "    float horizontal = sqrt(1.0 - up * up);\n"
+           "    vec3 v = vec3(cos(angle) * horizontal, up, sin(angle) * horizontal) * speed;\n"
+           "    outPosAge = vec4(origin + v * 0.03, 0.0);\n"
+           "    outVelocity = vec4(v, 0.5 + 0.5 * Random(id + 3u));\n"
+           "    return;\n"
+           "  }\n"
+           "  vec3 v = velocity.xyz;\n"
+           "  v.y -= 9.8 * dt;\n"
+           "  vec3 p = posAge.xyz + v * dt;\n"
+           "  if (p.y < 0.0) {\n"
+           "    p.y = 0.0;\n"
+           "    v *= vec3(0.7, -0.4, 0.7);\n"
+           "  }\n"
+           "  outPosAge = vec4(p, posAge.w + dt);\n"
+           "  outVelocity = vec4(v, velocity.w);\n"
+           "}\n"
+         );
+   return debrisUpdateShader;
+}
+
+const char *GetDebrisVertexShader()
+{
+   static char debrisVertexShader[1024];
+   strcpy(debrisVertexShader, 
+           "#version 400\n"
+           "layout (location = 0) in vec4 posAge;\n"
+           "layout (location = 1) in vec4 velocity;\n"
+           "layout (std140) uniform View {\n"
+           "  mat4 viewProjection;\n"
+           "  vec4 cameraloc;\n"
+           "};\n"
+           "uniform float lifetime;\n"
+           "uniform float pointScale;\n"
+           "uniform vec3 offset;\n"
+           "out float fade;\n"
+           "void main() {\n"
+           "  fade = 1.0 - posAge.w / lifetime;\n"
+           "  gl_Position = fade > 0.0 ? viewProjection * vec4(posAge.xyz + offset, 1.0)\n"
+           "                           : vec4(2.0, 2.0, 2.0, 1.0);\n" // dead: outside the clip volume
+           "  gl_PointSize = max(1.0, pointScale * velocity.w / gl_Position.w);\n"
+           "}\n"
+         );
+   return debrisVertexShader;
+}
+
+// Debris starts in the car's color and darkens to soot as it fades
+const char *GetDebrisFragmentShader()
+{
+   static char debrisFragmentShader[1024];
+   strcpy(debrisFragmentShader, 
+           "#version 400\n"
+           "uniform vec3 color;\n"
+           "in float fade;\n"
+           "out vec4 frag_color;\n"
+           "void main() {\n"
+           "  frag_color = vec4(mix(vec3(0.15), color, fade), 1.0);\n"
+           "}\n"
+         );
+   return debrisFragmentShader;
+}
+
+//
+// An ellipsoid (a model-transformed unit sphere) as a quad facing the
+// camera, sized so it covers the silhouette of the ellipsoid's bounding
+// sphere. The fragment shader gets the ray through each pixel in the
+// sphere's own coordinates, where it is a plain unit sphere.
+//
+const char *GetImpostorVertexShader()
+{
+   static char impostorVertexShader[2048];
+   strcpy(impostorVertexShader, 
+           "uniform mat4 model;\n"
+           "out vec3 surface;\n"
+           "flat out vec3 eye;\n"
+           "void main() {\n"
+           "  vec2 corner = vec2((gl_VertexID & 1) * 2 - 1, (gl_VertexID & 2) - 1);\n"
+           "  vec3 center = model[3].xyz;\n"
+           "  float radius = sqrt(max(dot(model[0].xyz, model[0].xyz),\n"
+           "                      max(dot(model[1].xyz, model[1].xyz), dot(model[2].xyz, model[2].xyz))));\n"
+           "  vec3 toEye = cameraloc.xyz - center;\n"
+           "  float dist = length(toEye);\n"
+           "  vec3 forward = toEye / dist;\n"
+           "  vec3 right = normalize(cross(abs(forward.y) < 0.99 ? vec3(0, 1, 0) : vec3(1, 0, 0), forward));\n"
+           "  vec3 up = cross(forward, right);\n"
+           // where the cone of rays touching the sphere crosses the plane through its center
+           "  float size = radius * dist / sqrt(max(dist*dist - radius*radius, 1e-6));\n"
+           "  vec3 world = center + (corner.x * right + corner.y * up) * size;\n"
+           "  gl_Position = viewProjection * vec4(world, 1.0);\n"
+           "  mat4 toSphere = inverse(model);\n"
+           "  surface = (toSphere * vec4(world, 1.0)).xyz;\n"
+           "  eye = (toSphere * vec4(cameraloc.xyz, 1.0)).xyz;\n"
+           "}\n"
+         );
+   return impostorVertexShader;
+}
+
+//
+// Intersects the ray with the unit sphere and writes the hit point's
+// depth. Shading is per pixel, with the position and normal the sphere
+// mesh would have at the hit point.
+//
+const char *GetImpostorFragmentShader()
+{
+   static char impostorFragmentShader[2048];
+   strcpy(impostorFragmentShader, 
+           "uniform mat4 model;\n"
+           "uniform vec3 color;\n"
+           "in vec3 surface;\n"
+           "flat in vec3 eye;\n"
+           "out vec4 frag_color;\n"
+           "void main() {\n"
+           "  vec3 dir = surface - eye;\n"
+           "  float a = dot(dir, dir);\n"
+           "  float b = dot(eye, dir);\n"
+           "  float disc = b*b - a*(dot(eye, eye) - 1.0);\n"
+           "  if (disc < 0.0)\n"
+           "    discard;\n"
+           "  vec3 p = eye + dir * ((-b - sqrt(disc)) / a);\n"
+           "  vec4 clip = viewProjection * model * vec4(p, 1.0);\n"
+           "  gl_FragDepth = 0.5 * clip.z / clip.w + 0.5;\n"
+
+           "  frag_color = vec4(min(vec3(1.0), color * shading(p, p)), 1.0);\n"
+           "}\n"
+         );
+   return impostorFragmentShader;
+}
+
+//
+// One invocation per resident part: transforms its bounding sphere, keeps
+// it if it is inside any view's frustum and appends it to its shape's
+// instances, counting it in that shape's indirect draw command.
+//
+const char *GetCullComputeShader()
+{
+   static char cullComputeShader[2560];
+   strcpy(cullComputeShader, 
+           "#version 430\n"
+           "layout (local_size_x = 64) in;\n"
+           "struct Part { mat4 rootRelative; vec4 color; vec4 sphere; ivec4 info; };\n"
+           "struct Object { mat4 world; vec4 color; };\n"
+           "struct Command { uint count, instanceCount, firstIndex, baseVertex, baseInstance; };\n"
+           "layout (std430, binding = 0) readonly buffer Parts { Part parts[]; };\n"
+           "layout (std430, binding = 1) readonly buffer Objects { Object objects[]; };\n"
+           "layout (std430, binding = 2) readonly buffer Items { uvec2 items[]; };\n"
+           "layout (std430, binding = 3) writeonly buffer Instances { Object instances[]; };\n"
+           "layout (std430, binding = 4) buffer Commands { Command commands[]; };\n"
+           "uniform vec4 planes[24];\n"
+           "uniform int numViews;\n"
+           "uniform uint numItems;\n"
+           "void main() {\n"
+           "  uint i = gl_GlobalInvocationID.x;\n"
+           "  if (i >= numItems)\n"
+           "    return;\n"
+           "  uvec2 item = items[i];\n"
+           "  vec4 instanceColor = objects[item.x].color;\n"
+           "  if (instanceColor.w == 0.0)\n"
+           "    return;\n"
+           "  mat4 model = objects[item.x].world * parts[item.y].rootRelative;\n"
+           "  vec4 sphere = parts[item.y].sphere;\n"
+           "  vec3 center = (model * vec4(sphere.xyz, 1.0)).xyz;\n"
+           "  float radius = sphere.w * sqrt(max(dot(model[0].xyz, model[0].xyz),\n"
+           "                                 max(dot(model[1].xyz, model[1].xyz), dot(model[2].xyz, model[2].xyz))));\n"
+           "  bool visible = false;\n"
+           "  for (int v = 0; v < numViews && !visible; v++) {\n"
+           "    visible = true;\n"
+           "    for (int k = 0; k < 6; k++)\n"
+           "      if (dot(planes[v*6 + k].xyz, center) + planes[v*6 + k].w < -radius)\n"
+           "        visible = false;\n"
+           "  }\n"
+           "  if (!visible)\n"
+           "    return;\n"
+           "  ivec4 info = parts[item.y].info;\n"
+           "  uint slot = commands[info.x].baseInstance + atomicAdd(commands[info.x].instanceCount, 1u);\n"
+           "  instances[slot].world = model;\n"
+           "  instances[slot].color = info.y != 0 ? vec4(instanceColor.rgb, 1.0) : parts[item.y].color;\n"
+           "}\n"
+         );
+   return cullComputeShader;
+}